@@ -0,0 +1,186 @@
+// Checks and times the beach line search of jc_voronoi, with and without JCV_BEACHLINE_HASH
+// cc -O2 beachline.c -o /tmp/bl_walk -lm && cc -O2 -DJCV_BEACHLINE_HASH beachline.c -o /tmp/bl_hash -lm
+// /tmp/bl_walk check > /tmp/bl_walk.txt && /tmp/bl_hash check > /tmp/bl_hash.txt && diff /tmp/bl_walk.txt /tmp/bl_hash.txt && echo identical
+// /tmp/bl_walk bench && /tmp/bl_hash bench
+
+#define JC_VORONOI_IMPLEMENTATION
+#include "jc_voronoi/jc_voronoi.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef M_PI
+#define M_PI 3.141592653589793
+#endif
+
+static uint32_t rng_state;
+static float rng()
+{
+  // xorshift32
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return (rng_state >> 8) / 16777216.0f;
+}
+
+enum { UNIFORM, CLUSTERED, GRID, CIRCLE, BUBBLE, N_KINDS };
+static const char *kind_names[] = {"uniform", "clustered", "grid", "circle", "bubble"};
+
+// Largest inputs that are compared and timed. On rings, neighbouring sites get
+// closer than the float precision allows beyond this, and the stock sweep breaks
+// down too (wrong diagrams, then runaway allocation at 50k points on a circle).
+// Exactly cocircular sites are not compared at all: which of the tied arcs the
+// walk lands on depends on where it starts, so even the stock code gives different
+// diagrams when started from either end of the beach line
+static const int max_check[] = {100000, 100000, 100000, 0, 10000};
+static const int max_bench[] = {100000, 100000, 100000, 30000, 10000};
+
+// Points in [0, 1000)^2
+static void gen_points(int kind, int n, jcv_point *p)
+{
+  rng_state = 2463534242u + kind * 7919 + n;
+  int side = (int)ceilf(sqrtf((float)n));
+  for (int i = 0; i < n; i++) {
+    float x, y;
+    switch (kind) {
+    case UNIFORM:
+      x = rng() * 1000; y = rng() * 1000;
+      break;
+    case CLUSTERED: {
+      // Sum of uniforms around a few centres
+      int c = (int)(rng() * 8);
+      float cx = 150 + (c % 4) * 230, cy = 250 + (c / 4) * 500;
+      x = cx + (rng() + rng() + rng() - 1.5f) * 60;
+      y = cy + (rng() + rng() + rng() - 1.5f) * 60;
+      break;
+    }
+    case GRID:
+      // Many sites share the same x and y, and many are cocircular
+      x = 10 + (i % side) * 980.0f / side;
+      y = 10 + (i / side) * 980.0f / side;
+      break;
+    case CIRCLE: {
+      float phi = (float)M_PI * 2 * i / n;
+      x = 500 + 450 * cosf(phi);
+      y = 500 + 450 * sinf(phi);
+      break;
+    }
+    default: {
+      // Wobbly ring like the bubbles, the case that matters in the game
+      float phi = (float)M_PI * 2 * i / n;
+      float r = 300 * (1 + 0.15f * sinf(phi * 3) + 0.05f * sinf(phi * 7 + 1));
+      x = 500 + r * cosf(phi);
+      y = 500 + r * sinf(phi);
+      break;
+    }
+    }
+    p[i].x = x;
+    p[i].y = y;
+  }
+}
+
+static double now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static const jcv_rect rect = {{-10, -10}, {1010, 1010}};
+
+// FNV-1a over the bytes of the diagram, in list order
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len)
+{
+  const uint8_t *b = (const uint8_t *)data;
+  for (size_t i = 0; i < len; i++) h = (h ^ b[i]) * 1099511628211u;
+  return h;
+}
+
+static void check(int kind, int n, jcv_point *p)
+{
+  jcv_diagram d;
+  memset(&d, 0, sizeof d);
+  jcv_diagram_generate(n, p, &rect, NULL, &d);
+
+  uint64_t h = 14695981039346656037u;
+  int n_edges = 0, n_graph_edges = 0;
+  for (const jcv_edge *e = jcv_diagram_get_edges(&d); e != NULL; e = jcv_diagram_get_next_edge(e)) {
+    int s[2] = {
+      e->sites[0] ? e->sites[0]->index : -1,
+      e->sites[1] ? e->sites[1]->index : -1,
+    };
+    h = hash_bytes(h, s, sizeof s);
+    h = hash_bytes(h, e->pos, sizeof e->pos);
+    n_edges++;
+  }
+  const jcv_site *sites = jcv_diagram_get_sites(&d);
+  for (int i = 0; i < d.numsites; i++) {
+    h = hash_bytes(h, &sites[i].index, sizeof(int));
+    for (const jcv_graphedge *ge = sites[i].edges; ge != NULL; ge = ge->next) {
+      int nb = ge->neighbor ? ge->neighbor->index : -1;
+      h = hash_bytes(h, &nb, sizeof nb);
+      h = hash_bytes(h, ge->pos, sizeof ge->pos);
+      n_graph_edges++;
+    }
+  }
+  printf("%-10s %6d  sites %6d  edges %6d  graph edges %6d  %016llx\n",
+    kind_names[kind], n, d.numsites, n_edges, n_graph_edges, (unsigned long long)h);
+
+  jcv_diagram_free(&d);
+}
+
+static double bench(int n, jcv_point *p)
+{
+  int reps = (n <= 1000 ? 200 : n <= 10000 ? 20 : 3);
+  double best = 1e30;
+  for (int r = 0; r < reps; r++) {
+    jcv_diagram d;
+    memset(&d, 0, sizeof d);
+    double t0 = now_ms();
+    jcv_diagram_generate(n, p, &rect, NULL, &d);
+    double t = now_ms() - t0;
+    jcv_diagram_free(&d);
+    if (best > t) best = t;
+  }
+  return best;
+}
+
+int main(int argc, char *argv[])
+{
+  static const int sizes[] = {100, 300, 1000, 3000, 10000, 30000, 100000};
+  static jcv_point p[100000];
+  const char *mode = (argc > 1 ? argv[1] : "check");
+
+#ifdef JCV_BEACHLINE_HASH
+  fprintf(stderr, "beach line: hash\n");
+#else
+  fprintf(stderr, "beach line: walk\n");
+#endif
+
+  if (strcmp(mode, "check") == 0) {
+    for (int k = 0; k < N_KINDS; k++)
+      for (int i = 0; i < sizeof sizes / sizeof sizes[0] && sizes[i] <= max_check[k]; i++) {
+        gen_points(k, sizes[i], p);
+        check(k, sizes[i], p);
+      }
+  } else {
+    printf("n         ");
+    for (int k = 0; k < N_KINDS; k++) printf(" %10s", kind_names[k]);
+    printf("   (ms, best of several runs)\n");
+    for (int i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+      printf("%-10d", sizes[i]);
+      for (int k = 0; k < N_KINDS; k++) {
+        if (sizes[i] > max_bench[k]) { printf(" %10s", "-"); continue; }
+        gen_points(k, sizes[i], p);
+        printf(" %10.3f", bench(sizes[i], p));
+      }
+      printf("\n");
+    }
+  }
+
+  return 0;
+}
@@ -46,6 +46,10 @@ extern "C" {
 #endif
 
 // Also see: JCV_DISABLE_STRUCT_PACKING
+// Also see: JCV_BEACHLINE_HASH, which finds the arc above a new site through a
+//           bucketed hash over x (as in Fortune's sweep2) instead of walking the
+//           beach line from the last insertion. Expected O(1) instead of O(sqrt(n))
+//           steps per site; the diagram is the same
 
 typedef JCV_REAL_TYPE jcv_real;
 
@@ -88,6 +92,14 @@ typedef void (*FJCVFreeFn)(void* userctx, void* p);
 // Same as above, but allows the client to use a custom allocator
 extern void jcv_diagram_generate_useralloc( int num_points, const jcv_point* points, const jcv_rect* rect, const jcv_clipper* clipper, void* userallocctx, FJCVAllocFn allocfn, FJCVFreeFn freefn, jcv_diagram* diagram );
 
+// Flags for jcv_diagram_generate_useralloc_flags
+// Only build the edge list (jcv_diagram_get_edges): the sites get no graph edges,
+// so nothing is sorted by angle and no gaps are filled against the clipper
+#define JCV_GENERATE_EDGES_ONLY 1
+
+// Same as above, with a combination of JCV_GENERATE_* flags
+extern void jcv_diagram_generate_useralloc_flags( int num_points, const jcv_point* points, const jcv_rect* rect, const jcv_clipper* clipper, void* userallocctx, FJCVAllocFn allocfn, FJCVFreeFn freefn, int flags, jcv_diagram* diagram );
+
 // Uses free (or the registered custom free function)
 extern void jcv_diagram_free( jcv_diagram* diagram );
 
@@ -356,6 +368,9 @@ typedef struct jcv_halfedge_
     jcv_real                y;
     int                     direction; // 0=left, 1=right
     int                     pqpos;
+#ifdef JCV_BEACHLINE_HASH
+    int                     hashpos; // Bucket that refers to this half edge, or -1
+#endif
 } jcv_halfedge;
 
 typedef struct jcv_memoryblock_
@@ -385,12 +400,17 @@ struct jcv_context_internal_
     jcv_halfedge*       beachline_end;
     jcv_halfedge*       last_inserted;
     jcv_priorityqueue*  eventqueue;
+#ifdef JCV_BEACHLINE_HASH
+    jcv_halfedge**      hash;
+    int                 hashsize;
+    int                 _hashpadding;
+#endif
 
     jcv_site*           sites;
     jcv_site*           bottomsite;
     int                 numsites;
     int                 currentsite;
-    int                 _padding;
+    int                 flags;
 
     jcv_memoryblock*    memblocks;
     jcv_edge*           edgepool;
@@ -766,6 +786,9 @@ static inline jcv_halfedge* jcv_halfedge_new(jcv_context_internal* internal, jcv
     he->right       = 0;
     he->direction   = direction;
     he->pqpos       = 0;
+#ifdef JCV_BEACHLINE_HASH
+    he->hashpos     = -1;
+#endif
     // These are set outside
     //he->y
     //he->vertex
@@ -774,6 +797,12 @@ static inline jcv_halfedge* jcv_halfedge_new(jcv_context_internal* internal, jcv
 
 static void jcv_halfedge_delete(jcv_context_internal* internal, jcv_halfedge* he)
 {
+#ifdef JCV_BEACHLINE_HASH
+    // The half edge is recycled, so it must not be found through the hash anymore
+    if( he->hashpos >= 0 )
+        internal->hash[he->hashpos] = 0;
+    he->hashpos = -1;
+#endif
     he->right = internal->halfedgepool;
     internal->halfedgepool = he;
 }
@@ -991,10 +1020,49 @@ static inline jcv_site* jcv_nextsite(jcv_context_internal* internal)
     return (internal->currentsite < internal->numsites) ? &internal->sites[internal->currentsite++] : 0;
 }
 
+#ifdef JCV_BEACHLINE_HASH
+static inline int jcv_hash_bucket(const jcv_context_internal* internal, const jcv_point* p)
+{
+    jcv_real width = internal->rect.max.x - internal->rect.min.x;
+    int bucket = width > 0 ? (int)((p->x - internal->rect.min.x) / width * (jcv_real)internal->hashsize) : 0;
+    if( bucket < 0 )
+        bucket = 0;
+    if( bucket >= internal->hashsize )
+        bucket = internal->hashsize - 1;
+    return bucket;
+}
+
+static inline void jcv_hash_set(jcv_context_internal* internal, int bucket, jcv_halfedge* he)
+{
+    jcv_halfedge* old = internal->hash[bucket];
+    if( old == he )
+        return;
+    if( old )
+        old->hashpos = -1;
+    if( he->hashpos >= 0 )
+        internal->hash[he->hashpos] = 0;
+    internal->hash[bucket] = he;
+    he->hashpos = bucket;
+}
+#endif
+
 static jcv_halfedge* jcv_get_edge_above_x(jcv_context_internal* internal, const jcv_point* p)
 {
     // Gets the arc on the beach line at the x coordinate (i.e. right above the new site event)
 
+#ifdef JCV_BEACHLINE_HASH
+    // Start from the nearest bucket that holds a half edge. The two ends of the
+    // beach line stay in the first and last buckets, so the search terminates
+    int bucket = jcv_hash_bucket(internal, p);
+    jcv_halfedge* he = internal->hash[bucket];
+    for( int i = 1; !he; ++i )
+    {
+        if( bucket - i >= 0 && (he = internal->hash[bucket - i]) != 0 )
+            break;
+        if( bucket + i < internal->hashsize )
+            he = internal->hash[bucket + i];
+    }
+#else
     // A good guess it's close by (Can be optimized)
     jcv_halfedge* he = internal->last_inserted;
     if( !he )
@@ -1004,6 +1072,7 @@ static jcv_halfedge* jcv_get_edge_above_x(jcv_context_internal* internal, const
         else
             he = internal->beachline_end;
     }
+#endif
 
     //
     if( he == internal->beachline_start || (he != internal->beachline_end && jcv_halfedge_rightof(he, p)) )
@@ -1023,6 +1092,11 @@ static jcv_halfedge* jcv_get_edge_above_x(jcv_context_internal* internal, const
         while( he != internal->beachline_start && !jcv_halfedge_rightof(he, p) );
     }
 
+#ifdef JCV_BEACHLINE_HASH
+    // Remember the result for the next site in this bucket
+    if( bucket > 0 && bucket < internal->hashsize - 1 && he != internal->beachline_start )
+        jcv_hash_set(internal, bucket, he);
+#endif
     return he;
 }
 
@@ -1137,6 +1211,9 @@ static void jcv_finishline(jcv_context_internal* internal, jcv_edge* e)
         return;
     }
 
+    if( internal->flags & JCV_GENERATE_EDGES_ONLY )
+        return;
+
     // Make sure the graph edges are CCW
     int flip = jcv_determinant(&e->sites[0]->p, &e->pos[0], &e->pos[1]) > (jcv_real)0 ? 0 : 1;
 
@@ -1487,6 +1564,12 @@ static jcv_context_internal* jcv_alloc_internal(int num_points, void* userallocc
     size_t eventssize = (size_t)(num_points*2) * sizeof(void*); // beachline can have max 2*n-5 parabolas
     size_t sitessize = (size_t)num_points * sizeof(jcv_site);
     size_t memsize = sizeof(jcv_priorityqueue) + eventssize + sitessize + sizeof(jcv_context_internal) + 16u; // 16 bytes padding for alignment
+#ifdef JCV_BEACHLINE_HASH
+    // Fortune's choice of 2 * sqrt(n) buckets, plus the two ends
+    int hashsize = 2 * (int)JCV_SQRT((jcv_real)num_points) + 2;
+    size_t hashmemsize = (size_t)hashsize * sizeof(void*);
+    memsize += hashmemsize + 8u;
+#endif
 
     char* originalmem = (char*)allocfn(userallocctx, memsize);
     memset(originalmem, 0, memsize);
@@ -1516,15 +1599,30 @@ static jcv_context_internal* jcv_alloc_internal(int num_points, void* userallocc
 
     assert((mem+eventssize) <= (originalmem+memsize));
 
+#ifdef JCV_BEACHLINE_HASH
+    mem += eventssize;
+    mem = (char*)jcv_align(mem, sizeof(void*));
+    tmp.charp = mem;
+    internal->hash = (jcv_halfedge**)tmp.voidpp;
+    internal->hashsize = hashsize;
+    assert((mem+hashmemsize) <= (originalmem+memsize));
+#endif
+
     return internal;
 }
 
 void jcv_diagram_generate_useralloc(int num_points, const jcv_point* points, const jcv_rect* rect, const jcv_clipper* clipper, void* userallocctx, FJCVAllocFn allocfn, FJCVFreeFn freefn, jcv_diagram* d)
+{
+    jcv_diagram_generate_useralloc_flags(num_points, points, rect, clipper, userallocctx, allocfn, freefn, 0, d);
+}
+
+void jcv_diagram_generate_useralloc_flags(int num_points, const jcv_point* points, const jcv_rect* rect, const jcv_clipper* clipper, void* userallocctx, FJCVAllocFn allocfn, FJCVFreeFn freefn, int flags, jcv_diagram* d)
 {
     if( d->internal )
         jcv_diagram_free( d );
 
     jcv_context_internal* internal = jcv_alloc_internal(num_points, userallocctx, allocfn, freefn);
+    internal->flags = flags;
 
     internal->beachline_start = jcv_halfedge_new(internal, 0, 0);
     internal->beachline_end = jcv_halfedge_new(internal, 0, 0);
@@ -1536,6 +1634,12 @@ void jcv_diagram_generate_useralloc(int num_points, const jcv_point* points, con
 
     internal->last_inserted = 0;
 
+#ifdef JCV_BEACHLINE_HASH
+    // The memory is cleared on allocation
+    jcv_hash_set(internal, 0, internal->beachline_start);
+    jcv_hash_set(internal, internal->hashsize - 1, internal->beachline_end);
+#endif
+
     int max_num_events = num_points*2; // beachline can have max 2*n-5 parabolas
     jcv_pq_create(internal->eventqueue, max_num_events, (void**)internal->eventmem);
 
@@ -1629,7 +1733,8 @@ void jcv_diagram_generate_useralloc(int num_points, const jcv_point* points, con
         jcv_finishline(internal, he->edge);
     }
 
-    jcv_fillgaps(d);
+    if( !(flags & JCV_GENERATE_EDGES_ONLY) )
+        jcv_fillgaps(d);
 }
 
 #endif // JC_VORONOI_IMPLEMENTATION
@@ -1641,6 +1746,7 @@ ABOUT:
     A fast single file 2D voronoi diagram generator
 
 HISTORY:
+            local       - Added jcv_diagram_generate_useralloc_flags and JCV_GENERATE_EDGES_ONLY
     0.9     2023-01-22  - Modified the Delauney iterator creation api
     0.8     2022-12-20  - Added fix for missing border edges
                           More robust removal of duplicate graph edges
@@ -1709,6 +1815,7 @@ USAGE:
 
     void jcv_diagram_generate( int num_points, const jcv_point* points, const jcv_rect* rect, const jcv_clipper* clipper, jcv_diagram* diagram );
     void jcv_diagram_generate_useralloc( int num_points, const jcv_point* points, const jcv_rect* rect, const jcv_clipper* clipper, const jcv_clipper* clipper, void* userallocctx, FJCVAllocFn allocfn, FJCVFreeFn freefn, jcv_diagram* diagram );
+    void jcv_diagram_generate_useralloc_flags( ..., int flags, jcv_diagram* diagram );
     void jcv_diagram_free( jcv_diagram* diagram );
 
     const jcv_site* jcv_diagram_get_sites( const jcv_diagram* diagram );
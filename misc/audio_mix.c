@@ -0,0 +1,178 @@
+// Mixer for the seams of `audio.loop` in `audio.lua`, built into the desktop
+// module with `polygon_rast.c` (see the build lines at its top). Adds up the
+// packets decoded from the streams that overlap at a seam, as the Lua loop did
+// through `SoundData:getSample`/`setSample`, but with the arithmetic in straight
+// loops over the samples, which the compiler vectorizes
+//
+// cc -O2 -Wall audio_mix.c -o /tmp/mix -DTESTRUN -lm && /tmp/mix
+
+#define _export
+
+#if __EMSCRIPTEN__
+#include <emscripten/emscripten.h>
+#undef _export
+#define _export EMSCRIPTEN_KEEPALIVE
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest packet, in values (samples times channels)
+#define MIX_MAX_VALUES 16384
+
+// Running sums; in double, as the Lua loop added them up
+static double mix_acc[MIX_MAX_VALUES];
+
+/*
+  Mixes `n_in` packets of 16-bit samples into `out` (`n` values, `channels` to
+  a frame). Packet `k` is `in[k]`, of `lens[k]` values; shorter ones are padded
+  with silence. Sample for sample this is LÖVE's conversion to float (s / 32767),
+  the sum in double, and the conversion back ((float)sum * 32767, truncated),
+  except that sums beyond full scale are clamped.
+  With `gain_from` and `gain_to`, packet `k` is scaled by a gain going linearly
+  from `gain_from[k]` at the first frame to `gain_to[k]` past the last, for
+  crossfades; without them it is a plain sum.
+  Returns the number of clamped values, or -1 if `n` is too large
+*/
+_export int audio_mix(int16_t *out, int n, int channels, int n_in,
+  const int16_t *const *in, const int *lens,
+  const float *gain_from, const float *gain_to)
+{
+  if (n < 0 || n > MIX_MAX_VALUES || channels <= 0) return -1;
+
+  for (int j = 0; j < n; j++) mix_acc[j] = 0;
+  for (int k = 0; k < n_in; k++) {
+    const int16_t *p = in[k];
+    int len = (lens[k] < n ? lens[k] : n);
+    if (gain_from == NULL) {
+      for (int j = 0; j < len; j++) mix_acc[j] += (double)(p[j] / 32767.0f);
+    } else {
+      int frames = n / channels;
+      float g0 = gain_from[k], dg = (gain_to[k] - gain_from[k]) / (frames > 0 ? frames : 1);
+      for (int j = 0; j < len; j++)
+        mix_acc[j] += (double)(p[j] / 32767.0f * (g0 + dg * (j / channels)));
+    }
+  }
+
+  int clamped = 0;
+  for (int j = 0; j < n; j++) {
+    // Clamped after truncating, in integers, which vectorizes
+    int32_t v = (int32_t)((float)mix_acc[j] * 32767.0f);
+    clamped += (v < -32768) | (v > 32767);
+    out[j] = (int16_t)(v < -32768 ? -32768 : v > 32767 ? 32767 : v);
+  }
+  return clamped;
+}
+
+#ifdef TESTRUN
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// The Lua loop of `audio.loop` as it was, with `SoundData:getSample` and
+// `setSample` as LÖVE does them for 16-bit data (Lua numbers are doubles, the
+// arguments and results of the two methods floats)
+static void lua_path_mix(int16_t *out, int frames, int channels, int n_in,
+  const int16_t *const *in, const int *counts)
+{
+  for (int i = 0; i < frames; i++)
+    for (int c = 0; c < channels; c++) {
+      double mix_sample = 0;
+      for (int k = 0; k < n_in; k++)
+        if (i < counts[k])
+          mix_sample = mix_sample + (float)in[k][i * channels + c] / (float)32767;
+      float sample = (float)mix_sample;
+      out[i * channels + c] = (int16_t)(int32_t)(sample * (float)32767);
+    }
+}
+
+static uint32_t test_rng_state = 2463534242u;
+static uint32_t test_rng()
+{
+  test_rng_state ^= test_rng_state << 13;
+  test_rng_state ^= test_rng_state >> 17;
+  test_rng_state ^= test_rng_state << 5;
+  return test_rng_state;
+}
+
+int main()
+{
+  // The game's loop: 6400-byte packets of 16-bit stereo
+  enum { FRAMES = 1600, CH = 2, N = FRAMES * CH };
+  static int16_t pkt[4][N], ref[N], out[N];
+  const int16_t *in[4] = { pkt[0], pkt[1], pkt[2], pkt[3] };
+
+  // Overlaps of 2 to 4 packets, some cut short as at the end of a stream,
+  // at amplitudes from quiet to loud enough to clip
+  int n_cases = 0, n_exact = 0, n_values = 0, n_clamped = 0, n_clamped_diff = 0;
+  for (int amp = 2000; amp <= 32000; amp *= 2)
+    for (int n_in = 2; n_in <= 4; n_in++)
+      for (int rep = 0; rep < 20; rep++) {
+        int counts[4], lens[4];
+        for (int k = 0; k < n_in; k++) {
+          counts[k] = (test_rng() % 3 == 0 ? test_rng() % (FRAMES + 1) : FRAMES);
+          lens[k] = counts[k] * CH;
+          for (int j = 0; j < N; j++)
+            pkt[k][j] = (int16_t)((int32_t)(test_rng() % (2 * amp + 1)) - amp);
+        }
+        lua_path_mix(ref, FRAMES, CH, n_in, in, counts);
+        int clamped = audio_mix(out, N, CH, n_in, in, lens, NULL, NULL);
+        // Beyond full scale the Lua path wraps around in the float to int16
+        // conversion, so only the rest is compared
+        bool exact = true;
+        for (int j = 0; j < N; j++) {
+          double sum = 0;
+          for (int k = 0; k < n_in; k++) if (j < lens[k]) sum += pkt[k][j];
+          if (sum < -32768 || sum > 32767) {
+            n_clamped_diff += (out[j] != ref[j]);
+            continue;
+          }
+          if (out[j] != ref[j]) exact = false;
+          n_values++;
+        }
+        n_cases++;
+        n_exact += exact;
+        n_clamped += clamped;
+      }
+  printf("sums: %d / %d packets sample-exact against the Lua path (%d values), "
+    "%d clamped (%d of them differing)\n",
+    n_exact, n_cases, n_values, n_clamped, n_clamped_diff);
+
+  // A crossfade with gains 1 to 1 is the plain sum
+  for (int k = 0; k < 2; k++)
+    for (int j = 0; j < N; j++) pkt[k][j] = (int16_t)((int32_t)(test_rng() % 20001) - 10000);
+  static const float ones[2] = { 1, 1 }, zero_one[2] = { 0, 1 }, one_zero[2] = { 1, 0 };
+  int lens[2] = { N, N }, counts[2] = { FRAMES, FRAMES };
+  lua_path_mix(ref, FRAMES, CH, 2, in, counts);
+  audio_mix(out, N, CH, 2, in, lens, ones, ones);
+  bool same = true;
+  for (int j = 0; j < N; j++) if (out[j] != ref[j]) same = false;
+  printf("crossfade at unit gains: %s\n", same ? "ok" : "MISMATCH");
+  // From all of the first to all of the second
+  audio_mix(out, N, CH, 2, in, lens, one_zero, zero_one);
+  int err_start = 0, err_end = 0;
+  for (int c = 0; c < CH; c++) {
+    err_start += abs(out[c] - pkt[0][c]);
+    int j = N - CH + c;
+    err_end += abs(out[j] - (int)(pkt[0][j] / (float)FRAMES + pkt[1][j] * (FRAMES - 1.0f) / FRAMES));
+  }
+  printf("crossfade ends: off by %d at the start, %d at the end\n", err_start, err_end);
+
+  // Timing, for the 3 packets at a seam
+  int lens3[3] = { N, N, N };
+  const int reps = 2000;
+  double t0 = now_ms();
+  for (int r = 0; r < reps; r++) audio_mix(out, N, CH, 3, in, lens3, NULL, NULL);
+  printf("3 packets of %d frames: %.4f ms\n", FRAMES, (now_ms() - t0) / reps);
+
+  return 0;
+}
+#endif
@@ -22,4 +22,6 @@ else
     sha1sum "$wd/release/Blow Something.love"
   )
   rm -rf "$t"
+  # The native library goes next to the .love; the game runs without it
+  sh misc/build_native.sh desktop || echo "Native library not built"
 fi
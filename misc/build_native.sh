@@ -0,0 +1,24 @@
+# Native library (`polygon_rast.c` and the files built with it) for this machine:
+#   sh misc/build_native.sh server   server/libpolygon_rast.so, opened by `server/rast.js`
+#   sh misc/build_native.sh desktop  release/, next to the .love, for `src/native.lua`
+CC=${CC:-cc}
+LIB=libpolygon_rast.so
+if [ "$(uname)" = "Darwin" ]; then LIB=libpolygon_rast.dylib; fi
+
+cd "$(dirname "$0")" || exit
+case "$1" in
+  server)
+    # Room for 512 x 512 images, see `server/rast.js`
+    ${CC} -O3 -DNDEBUG -DENC_MAX_PIXELS=262144 -shared -fPIC -o "../server/${LIB}" \
+      polygon_rast.c image_encode.c image_normalize.c -lm
+    ;;
+  desktop)
+    mkdir -p ../release
+    ${CC} -O3 -DNDEBUG -shared -fPIC -o "../release/${LIB}" \
+      polygon_rast.c image_encode.c audio_mix.c -lm
+    ;;
+  *)
+    echo "Usage: $0 server|desktop" >&2
+    exit 1
+    ;;
+esac
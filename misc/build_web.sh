@@ -5,6 +5,7 @@ rm -rf release/Blow-Something-web
 ${NODE} ${LOVEJS_INDEX} -c -t "Blow Something" -m 64000000 "release/Blow Something.love" release/Blow-Something-web
 cp misc/web_index.html release/Blow-Something-web/index.html
 cp misc/polygon_rast.wasm release/Blow-Something-web/polygon_rast.wasm
+cp misc/polygon_rast_worker.js release/Blow-Something-web/polygon_rast_worker.js
 # Patch for filesystem access
 perl -pi -e 's/var SYSCALLS/try{if(!window.FS)window.FS=FS;}catch(e){}var SYSCALLS/' release/Blow-Something-web/love.js
 rm -rf release/Blow-Something-web/theme
@@ -1 +1,4 @@
-(cd server; rsync -aPL *.js Blow-Something-web art:~/Blow-Something)
+# The server needs the native library for drawings; it is built here, for a
+# server of the same architecture
+sh misc/build_native.sh server || exit
+(cd server; rsync -aPL *.js libpolygon_rast.so Blow-Something-web art:~/Blow-Something)
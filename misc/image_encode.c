@@ -0,0 +1,686 @@
+// Image encoder, built into the same module as `polygon_rast.c` (see the build
+// lines at its top). Encodes the recognition uploads and the screenshots, which
+// LÖVE either cannot encode (`rgba16f`/`rgba4` canvases on the web) or encodes
+// slowly (zlib at its default level, on the main thread)
+//
+// cc -O2 -Wall image_encode.c -o /tmp/enc -DTESTRUN -lm && /tmp/enc
+// cc -O2 image_encode.c -o /tmp/enc_bench -DBENCHRUN -lm && /tmp/enc_bench
+
+#define _export
+
+#if __EMSCRIPTEN__
+#include <emscripten/emscripten.h>
+#undef _export
+#define _export EMSCRIPTEN_KEEPALIVE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Left out of the compact build with the rest of the big buffers
+#ifndef COMPACT_MEMORY
+
+// Largest image, a screenshot at the game's resolution. The server's build raises
+// it for the uploads it normalizes (see `image_normalize.c`)
+#ifndef ENC_MAX_PIXELS
+#define ENC_MAX_PIXELS (180 * 320)
+#endif
+
+// Pixel formats of `enc_buf`, as LÖVE's `ImageData:getFormat()`
+#define ENC_RGBA8   0
+#define ENC_RGBA16F 1   // Half floats, clamped to [0, 1]
+#define ENC_RGBA4   2   // One 16-bit word per pixel, red in the high nibble
+
+// Input pixels, converted to rgba8 in place before encoding
+static uint8_t enc_buf[ENC_MAX_PIXELS * 8];
+_export uint8_t *get_enc_buf() { return enc_buf; }
+_export int get_enc_max_pixels() { return ENC_MAX_PIXELS; }
+
+// Encoded file; QOI is the larger one in the worst case (5 bytes per pixel)
+#define ENC_OUT_SIZE (ENC_MAX_PIXELS * 5 + 64)
+static uint8_t enc_out[ENC_OUT_SIZE];
+_export uint8_t *get_enc_out() { return enc_out; }
+
+// Filtered scanlines, each prefixed with its filter type (up to 512 rows)
+static uint8_t enc_rows[ENC_MAX_PIXELS * 4 + 512];
+
+static void convert_to_rgba8(int n, int format)
+{
+  if (format == ENC_RGBA16F) {
+    // 8 bytes to 4, so going forward never overwrites what is still to be read.
+    // Blocks go through a local buffer, as the compiler cannot tell that.
+    // Rebiasing the exponent gives the float for normal numbers; subnormals
+    // come out below 2^-14 and round to 0 anyway, infinities and NaNs beyond 1
+    const uint16_t *src = (const uint16_t *)enc_buf;
+    for (int i = 0; i < n * 4; i += 256) {
+      uint8_t block[256];
+      int len = (n * 4 - i < 256 ? n * 4 - i : 256);
+      for (int k = 0; k < len; k++) {
+        uint32_t h = src[i + k];
+        union { uint32_t u; float f; } x = { .u = ((h & 0x7fff) << 13) + ((127 - 15) << 23) };
+        float v = (x.f < 1 ? x.f : 1) * (float)((h >> 15) ^ 1);
+        block[k] = (uint8_t)(int)(v * 255 + 0.5f);
+      }
+      memcpy(enc_buf + i, block, len);
+    }
+  } else if (format == ENC_RGBA4) {
+    // 2 bytes to 4, backwards
+    const uint16_t *src = (const uint16_t *)enc_buf;
+    for (int i = n - 1; i >= 0; i--) {
+      uint16_t p = src[i];
+      enc_buf[i * 4 + 3] = (p & 15) * 17;
+      enc_buf[i * 4 + 2] = ((p >> 4) & 15) * 17;
+      enc_buf[i * 4 + 1] = ((p >> 8) & 15) * 17;
+      enc_buf[i * 4 + 0] = (p >> 12) * 17;
+    }
+  }
+}
+
+// ======== PNG ======== //
+
+static uint32_t crc_table[256];
+
+static void crc_init()
+{
+  if (crc_table[1] != 0) return;
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t crc32(const uint8_t *p, int n)
+{
+  uint32_t c = 0xffffffffu;
+  for (int i = 0; i < n; i++) c = crc_table[(c ^ p[i]) & 0xff] ^ (c >> 8);
+  return c ^ 0xffffffffu;
+}
+
+static uint32_t adler32(const uint8_t *p, int n)
+{
+  uint32_t a = 1, b = 0;
+  while (n > 0) {
+    // Largest run before `b` can overflow
+    int k = (n < 5552 ? n : 5552);
+    n -= k;
+    while (k-- > 0) {
+      a += *p++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return (b << 16) | a;
+}
+
+static inline void put_be32(uint8_t *p, uint32_t x)
+{
+  p[0] = x >> 24; p[1] = x >> 16; p[2] = x >> 8; p[3] = x;
+}
+
+// Filters each row with whichever of None, Sub and Up leaves the smallest sum
+// of absolute residuals (the usual heuristic, without Average and Paeth, which
+// rarely win on flat drawings). Returns the size of the filtered data
+static int filter_rows(int w, int h, bool adaptive)
+{
+  int stride = w * 4;
+  uint8_t *q = enc_rows;
+  for (int y = 0; y < h; y++) {
+    const uint8_t *row = enc_buf + y * stride;
+    const uint8_t *up = row - stride;
+    int best = 0;
+    if (adaptive) {
+      // Separate branch-free loops, so that each one vectorizes.
+      // On the first row, Up is the same as None
+      uint32_t cost_none = 0, cost_sub = 0, cost_up = UINT32_MAX;
+      for (int i = 0; i < stride; i++) cost_none += abs((int8_t)row[i]);
+      for (int i = 0; i < 4; i++) cost_sub += abs((int8_t)row[i]);
+      for (int i = 4; i < stride; i++) cost_sub += abs((int8_t)(row[i] - row[i - 4]));
+      if (y > 0) {
+        cost_up = 0;
+        for (int i = 0; i < stride; i++) cost_up += abs((int8_t)(row[i] - up[i]));
+      }
+      if (cost_sub < cost_none) { best = 1; cost_none = cost_sub; }
+      if (cost_up < cost_none) best = 2;
+    }
+    *q++ = best;
+    if (best == 0) {
+      memcpy(q, row, stride);
+    } else if (best == 1) {
+      for (int i = 0; i < 4; i++) q[i] = row[i];
+      for (int i = 4; i < stride; i++) q[i] = row[i] - row[i - 4];
+    } else {
+      for (int i = 0; i < stride; i++) q[i] = row[i] - up[i];
+    }
+    q += stride;
+  }
+  return q - enc_rows;
+}
+
+// Deflate with stored blocks only
+static int deflate_store(const uint8_t *in, int n, uint8_t *out)
+{
+  uint8_t *q = out;
+  do {
+    int len = (n < 65535 ? n : 65535);
+    n -= len;
+    *q++ = (n == 0);  // BFINAL, BTYPE = 00
+    q[0] = len; q[1] = len >> 8;
+    q[2] = ~len; q[3] = ~len >> 8;
+    memcpy(q + 4, in, len);
+    q += 4 + len;
+    in += len;
+  } while (n > 0);
+  return q - out;
+}
+
+// Deflate as one block with the fixed Huffman codes and greedy LZ77 matching,
+// looking up one earlier position per 4-byte hash. Compresses the filtered
+// scanlines of flat drawings about as well as zlib's fast levels, at a
+// fraction of the time. Returns 0 if the result would not fit in `cap` bytes
+#define HASH_BITS 14
+static int32_t hash_head[1 << HASH_BITS];
+
+// Bit-reversed fixed codes, as deflate sends Huffman codes from the top bit
+static uint16_t lit_code[288];
+static uint8_t lit_len[288];
+static uint16_t dist_code[30];
+// Length 3..258 to symbol and extra bits
+static uint16_t len_sym[259];
+static uint8_t len_extra_n[259], len_extra[259];
+static const uint16_t len_base[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t len_bits[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const uint16_t dist_base[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+static const uint8_t dist_bits[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+static uint32_t bit_reverse(uint32_t x, int n)
+{
+  uint32_t r = 0;
+  for (int i = 0; i < n; i++) r = (r << 1) | ((x >> i) & 1);
+  return r;
+}
+
+static void fixed_codes_init()
+{
+  if (lit_len[0] != 0) return;
+  for (int s = 0; s < 288; s++) {
+    int code, len;
+    if (s < 144) { code = 0x30 + s; len = 8; }
+    else if (s < 256) { code = 0x190 + (s - 144); len = 9; }
+    else if (s < 280) { code = s - 256; len = 7; }
+    else { code = 0xc0 + (s - 280); len = 8; }
+    lit_code[s] = bit_reverse(code, len);
+    lit_len[s] = len;
+  }
+  for (int d = 0; d < 30; d++) dist_code[d] = bit_reverse(d, 5);
+  for (int k = 0; k < 29; k++) {
+    int end = (k == 28 ? 259 : len_base[k + 1]);
+    for (int l = len_base[k]; l < end; l++) {
+      len_sym[l] = 257 + k;
+      len_extra_n[l] = len_bits[k];
+      len_extra[l] = l - len_base[k];
+    }
+  }
+}
+
+static inline int dist_index(int d)
+{
+  // Codes double in range every two, so start from the top bit
+  int k = 0;
+  if (d > 4) {
+    int b = 31 - __builtin_clz(d - 1);
+    k = b * 2 + ((d - 1) >> (b - 1) & 1);
+  } else {
+    k = d - 1;
+  }
+  return k;
+}
+
+static int deflate_fast(const uint8_t *in, int n, uint8_t *out, int cap)
+{
+  fixed_codes_init();
+  for (int i = 0; i < (1 << HASH_BITS); i++) hash_head[i] = -1;
+
+  uint64_t bits = 0;
+  int n_bits = 0;
+  uint8_t *q = out, *q_end = out + cap - 8;
+  #define PUT(_v, _n) do { \
+    bits |= (uint64_t)(_v) << n_bits; n_bits += (_n); \
+    while (n_bits >= 8) { *q++ = bits; bits >>= 8; n_bits -= 8; } \
+  } while (0)
+
+  PUT(3, 3);  // BFINAL, BTYPE = 01
+  int i = 0;
+  while (i < n) {
+    if (q >= q_end) return 0;
+    int best_len = 0, best_dist = 0;
+    if (i + 4 <= n) {
+      uint32_t v;
+      memcpy(&v, in + i, 4);
+      uint32_t hh = (v * 2654435761u) >> (32 - HASH_BITS);
+      int cand = hash_head[hh];
+      hash_head[hh] = i;
+      if (cand >= 0 && i - cand <= 32768 && memcmp(in + cand, in + i, 4) == 0) {
+        int max_len = (n - i < 258 ? n - i : 258);
+        int l = 4;
+        while (l < max_len && in[cand + l] == in[i + l]) l++;
+        best_len = l;
+        best_dist = i - cand;
+      }
+    }
+    if (best_len == 0) {
+      PUT(lit_code[in[i]], lit_len[in[i]]);
+      i++;
+    } else {
+      int s = len_sym[best_len];
+      PUT(lit_code[s], lit_len[s]);
+      if (len_extra_n[best_len]) PUT(len_extra[best_len], len_extra_n[best_len]);
+      int d = dist_index(best_dist);
+      PUT(dist_code[d], 5);
+      if (dist_bits[d]) PUT(best_dist - dist_base[d], dist_bits[d]);
+      i += best_len;
+    }
+  }
+  PUT(lit_code[256], lit_len[256]);
+  if (n_bits > 0) *q++ = bits;
+  #undef PUT
+  return q - out;
+}
+#undef HASH_BITS
+
+// Encodes the `w` x `h` image in `enc_buf` as a PNG in `enc_out`, converting
+// it to rgba8 first. `level` 0 stores the scanlines unfiltered, 1 filters and
+// compresses them. Returns the size of the file, or 0 if the image is too large
+/*
+  local size = lib.encode_png(w, h, 0, 1)
+  local s = ffi.string(lib.get_enc_out(), size)
+*/
+_export int encode_png(int w, int h, int format, int level)
+{
+  if (w <= 0 || h <= 0 || w * h > ENC_MAX_PIXELS ||
+      (size_t)h * (w * 4 + 1) > sizeof enc_rows) return 0;
+  convert_to_rgba8(w * h, format);
+  crc_init();
+
+  static const uint8_t signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+  uint8_t *q = enc_out;
+  memcpy(q, signature, 8);
+  q += 8;
+
+  put_be32(q, 13);
+  memcpy(q + 4, "IHDR", 4);
+  put_be32(q + 8, w);
+  put_be32(q + 12, h);
+  q[16] = 8;    // Bit depth
+  q[17] = 6;    // RGBA
+  q[18] = q[19] = q[20] = 0;
+  put_be32(q + 21, crc32(q + 4, 17));
+  q += 25;
+
+  uint8_t *idat = q;
+  memcpy(idat + 4, "IDAT", 4);
+  uint8_t *z = idat + 8;
+  z[0] = 0x78;
+  z[1] = 0x01;
+  int n = filter_rows(w, h, level > 0);
+  // Room for the stored fallback, the Adler-32, the CRC and IEND
+  int cap = (enc_out + ENC_OUT_SIZE - 32) - (z + 2);
+  // The fixed codes expand data that does not compress, such as noise; it is
+  // stored then, as it is whenever they do not come out smaller
+  int stored = n + 5 * ((n + 65534) / 65535 > 0 ? (n + 65534) / 65535 : 1);
+  int len = (level > 0 ? deflate_fast(enc_rows, n, z + 2, cap < stored ? cap : stored) : 0);
+  if (len == 0 || len >= stored) len = deflate_store(enc_rows, n, z + 2);
+  put_be32(z + 2 + len, adler32(enc_rows, n));
+  int idat_len = 2 + len + 4;
+  put_be32(idat, idat_len);
+  put_be32(idat + 8 + idat_len, crc32(idat + 4, 4 + idat_len));
+  q = idat + 12 + idat_len;
+
+  put_be32(q, 0);
+  memcpy(q + 4, "IEND", 4);
+  put_be32(q + 8, crc32(q + 4, 4));
+  q += 12;
+
+  return q - enc_out;
+}
+
+// ======== QOI ======== //
+
+// Encodes the image in `enc_buf` as QOI (https://qoiformat.org/) in `enc_out`.
+// Faster than the PNG and usually smaller than its stored form, for tools
+// that read it; the recognition server does not. Returns the size of the file
+_export int encode_qoi(int w, int h, int format)
+{
+  if (w <= 0 || h <= 0 || w * h > ENC_MAX_PIXELS) return 0;
+  convert_to_rgba8(w * h, format);
+
+  uint8_t *q = enc_out;
+  memcpy(q, "qoif", 4);
+  put_be32(q + 4, w);
+  put_be32(q + 8, h);
+  q[12] = 4;    // RGBA
+  q[13] = 0;    // sRGB with linear alpha
+  q += 14;
+
+  uint32_t index[64] = { 0 };
+  uint8_t pr = 0, pg = 0, pb = 0, pa = 255;
+  int run = 0;
+  int n = w * h;
+  for (int i = 0; i < n; i++) {
+    const uint8_t *p = &enc_buf[i * 4];
+    uint8_t r = p[0], g = p[1], b = p[2], a = p[3];
+    if (r == pr && g == pg && b == pb && a == pa) {
+      if (++run == 62) {
+        *q++ = 0xc0 | (run - 1);
+        run = 0;
+      }
+      continue;
+    }
+    if (run > 0) {
+      *q++ = 0xc0 | (run - 1);
+      run = 0;
+    }
+    uint32_t px;
+    memcpy(&px, p, 4);
+    int k = (r * 3 + g * 5 + b * 7 + a * 11) % 64;
+    if (index[k] == px) {
+      *q++ = k;
+    } else {
+      index[k] = px;
+      if (a == pa) {
+        int8_t vr = r - pr, vg = g - pg, vb = b - pb;
+        int8_t vg_r = vr - vg, vg_b = vb - vg;
+        if (vr >= -2 && vr <= 1 && vg >= -2 && vg <= 1 && vb >= -2 && vb <= 1) {
+          *q++ = 0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+        } else if (vg >= -32 && vg <= 31 && vg_r >= -8 && vg_r <= 7 && vg_b >= -8 && vg_b <= 7) {
+          *q++ = 0x80 | (vg + 32);
+          *q++ = (vg_r + 8) << 4 | (vg_b + 8);
+        } else {
+          q[0] = 0xfe; q[1] = r; q[2] = g; q[3] = b;
+          q += 4;
+        }
+      } else {
+        q[0] = 0xff; q[1] = r; q[2] = g; q[3] = b; q[4] = a;
+        q += 5;
+      }
+    }
+    pr = r; pg = g; pb = b; pa = a;
+  }
+  if (run > 0) *q++ = 0xc0 | (run - 1);
+  static const uint8_t end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+  memcpy(q, end, 8);
+  q += 8;
+
+  return q - enc_out;
+}
+
+#endif  // COMPACT_MEMORY
+
+#if defined(TESTRUN) || defined(BENCHRUN)
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// A flat bubble-like drawing with an outline and a gradient highlight, over
+// transparency, as the recognition uploads look
+static void test_image(int w, int h, uint8_t *rgba)
+{
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      uint8_t *p = &rgba[(y * w + x) * 4];
+      float dx = (x - w * 0.5f) / (w * 0.35f), dy = (y - h * 0.45f) / (h * 0.3f);
+      float r = sqrtf(dx * dx + dy * dy) * (1 + 0.1f * sinf(atan2f(dy, dx) * 5));
+      if (r < 0.95f) {
+        float hl = fmaxf(0, 1 - r * 1.2f);
+        p[0] = 255;
+        p[1] = 48 + (int)(hl * 100);
+        p[2] = 77 + (int)(hl * 60);
+        p[3] = 160 + (int)(hl * 80);
+      } else if (r < 1.02f) {
+        p[0] = 255; p[1] = 48; p[2] = 77; p[3] = 255;
+      } else {
+        p[0] = p[1] = p[2] = p[3] = 0;
+      }
+    }
+}
+#endif
+
+#ifdef TESTRUN
+// Just enough of inflate to read back what `encode_png` writes:
+// stored and fixed-Huffman blocks
+struct bit_reader { const uint8_t *p; int pos; };
+static int get_bits(struct bit_reader *br, int n)
+{
+  int v = 0;
+  for (int i = 0; i < n; i++, br->pos++)
+    v |= ((br->p[br->pos >> 3] >> (br->pos & 7)) & 1) << i;
+  return v;
+}
+static int get_huff(struct bit_reader *br, int n)
+{
+  int v = 0;
+  for (int i = 0; i < n; i++, br->pos++)
+    v = (v << 1) | ((br->p[br->pos >> 3] >> (br->pos & 7)) & 1);
+  return v;
+}
+static int fixed_lit(struct bit_reader *br)
+{
+  int c = get_huff(br, 7);
+  if (c <= 0x17) return 256 + c;
+  c = (c << 1) | get_huff(br, 1);
+  if (c >= 0x30 && c <= 0xbf) return c - 0x30;
+  if (c >= 0xc0 && c <= 0xc7) return 280 + c - 0xc0;
+  c = (c << 1) | get_huff(br, 1);
+  return 144 + c - 0x190;
+}
+static int inflate(const uint8_t *in, uint8_t *out)
+{
+  struct bit_reader br = { in, 0 };
+  int n = 0, final;
+  do {
+    final = get_bits(&br, 1);
+    int type = get_bits(&br, 2);
+    if (type == 0) {
+      br.pos = (br.pos + 7) & ~7;
+      const uint8_t *p = in + br.pos / 8;
+      int len = p[0] | p[1] << 8;
+      memcpy(out + n, p + 4, len);
+      n += len;
+      br.pos += (4 + len) * 8;
+    } else if (type == 1) {
+      while (true) {
+        int s = fixed_lit(&br);
+        if (s < 256) { out[n++] = s; continue; }
+        if (s == 256) break;
+        int len = len_base[s - 257] + get_bits(&br, len_bits[s - 257]);
+        int d = get_huff(&br, 5);
+        int dist = dist_base[d] + get_bits(&br, dist_bits[d]);
+        for (int i = 0; i < len; i++, n++) out[n] = out[n - dist];
+      }
+    } else {
+      return -1;
+    }
+  } while (!final);
+  return n;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Decodes the PNG in `enc_out` (single IDAT) and compares with `ref`
+static bool check_png(int size, int w, int h, const uint8_t *ref)
+{
+  const uint8_t *p = enc_out + 8;
+  if (get_be32(p + 8) != (uint32_t)w || get_be32(p + 12) != (uint32_t)h) return false;
+  if (crc32(p + 4, 17) != get_be32(p + 21)) return false;
+  p += 25;
+  int idat_len = get_be32(p);
+  if (crc32(p + 4, 4 + idat_len) != get_be32(p + 8 + idat_len)) return false;
+  if ((p[8] * 256 + p[9]) % 31 != 0) return false;
+  static uint8_t rows[ENC_MAX_PIXELS * 4 + 320];
+  int n = inflate(p + 10, rows);
+  if (n != h * (w * 4 + 1)) return false;
+  if (adler32(rows, n) != get_be32(p + 8 + idat_len - 4)) return false;
+  if (p + 12 + idat_len + 12 != enc_out + size) return false;
+  // Unfilter
+  int stride = w * 4;
+  static uint8_t img[ENC_MAX_PIXELS * 4];
+  for (int y = 0; y < h; y++) {
+    const uint8_t *f = rows + y * (stride + 1);
+    uint8_t *row = img + y * stride;
+    for (int i = 0; i < stride; i++) {
+      uint8_t left = (i >= 4 ? row[i - 4] : 0), up = (y > 0 ? row[i - stride] : 0);
+      if (f[0] == 0) row[i] = f[1 + i];
+      else if (f[0] == 1) row[i] = f[1 + i] + left;
+      else if (f[0] == 2) row[i] = f[1 + i] + up;
+      else return false;
+    }
+  }
+  return memcmp(img, ref, w * h * 4) == 0;
+}
+
+static bool check_qoi(int size, int w, int h, const uint8_t *ref)
+{
+  if (memcmp(enc_out, "qoif", 4) != 0 ||
+      get_be32(enc_out + 4) != (uint32_t)w || get_be32(enc_out + 8) != (uint32_t)h) return false;
+  const uint8_t *p = enc_out + 14;
+  uint8_t index[64][4] = {{ 0 }};
+  uint8_t px[4] = {0, 0, 0, 255};
+  int run = 0;
+  for (int i = 0; i < w * h; i++) {
+    if (run > 0) {
+      run--;
+    } else {
+      int b = *p++;
+      if (b == 0xfe) { px[0] = p[0]; px[1] = p[1]; px[2] = p[2]; p += 3; }
+      else if (b == 0xff) { memcpy(px, p, 4); p += 4; }
+      else if ((b & 0xc0) == 0x00) memcpy(px, index[b], 4);
+      else if ((b & 0xc0) == 0x40) {
+        px[0] += ((b >> 4) & 3) - 2; px[1] += ((b >> 2) & 3) - 2; px[2] += (b & 3) - 2;
+      } else if ((b & 0xc0) == 0x80) {
+        int vg = (b & 0x3f) - 32, c = *p++;
+        px[0] += vg - 8 + (c >> 4); px[1] += vg; px[2] += vg - 8 + (c & 15);
+      } else {
+        run = b & 0x3f;
+      }
+      memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+    }
+    if (memcmp(px, ref + i * 4, 4) != 0) return false;
+  }
+  return p + 8 == enc_out + size;
+}
+
+int main()
+{
+  static uint8_t ref[ENC_MAX_PIXELS * 4];
+  static const int sizes[][2] = {{144, 180}, {180, 320}, {1, 1}, {7, 3}};
+  for (int k = 0; k < (int)(sizeof sizes / sizeof sizes[0]); k++) {
+    int w = sizes[k][0], h = sizes[k][1];
+    test_image(w, h, ref);
+    for (int level = 0; level <= 1; level++) {
+      memcpy(enc_buf, ref, w * h * 4);
+      int size = encode_png(w, h, ENC_RGBA8, level);
+      printf("png %3dx%-3d level %d  %6d bytes  %s\n", w, h, level, size,
+        check_png(size, w, h, ref) ? "ok" : "MISMATCH");
+    }
+    memcpy(enc_buf, ref, w * h * 4);
+    int size = encode_qoi(w, h, ENC_RGBA8);
+    printf("qoi %3dx%-3d          %6d bytes  %s\n", w, h, size,
+      check_qoi(size, w, h, ref) ? "ok" : "MISMATCH");
+  }
+
+  // Noise does not compress; the fixed codes would expand it, so it is stored,
+  // at the size of level 0
+  srand(1);
+  for (int i = 0; i < 180 * 320 * 4; i++) ref[i] = rand();
+  memcpy(enc_buf, ref, 180 * 320 * 4);
+  int size_stored = encode_png(180, 320, ENC_RGBA8, 0);
+  memcpy(enc_buf, ref, 180 * 320 * 4);
+  int size = encode_png(180, 320, ENC_RGBA8, 1);
+  printf("png noise  %6d bytes  %s, %s\n", size, check_png(size, 180, 320, ref) ? "ok" : "MISMATCH",
+    size == size_stored ? "stored" : "NOT STORED");
+
+  // Format conversions
+  static const uint16_t halfs[] = {0x0000, 0x3800, 0x3c00, 0x4000, 0xbc00, 0x7c00, 0x7e00, 0x0001, 0x2c00};
+  static const uint8_t halfs_8[] = {0, 128, 255, 255, 0, 255, 255, 0, 16};
+  memcpy(enc_buf, halfs, sizeof halfs);
+  memset((uint8_t *)enc_buf + sizeof halfs, 0, 6);
+  convert_to_rgba8(3, ENC_RGBA16F);
+  printf("rgba16f %s\n", memcmp(enc_buf, halfs_8, sizeof halfs_8) == 0 ? "ok" : "MISMATCH");
+  static const uint16_t nibbles[] = {0xf00f, 0x1234};
+  static const uint8_t nibbles_8[] = {255, 0, 0, 255, 17, 34, 51, 68};
+  memcpy(enc_buf, nibbles, sizeof nibbles);
+  convert_to_rgba8(2, ENC_RGBA4);
+  printf("rgba4 %s\n", memcmp(enc_buf, nibbles_8, sizeof nibbles_8) == 0 ? "ok" : "MISMATCH");
+
+  return 0;
+}
+#endif
+
+#ifdef BENCHRUN
+#include <time.h>
+static double now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int main()
+{
+  static uint8_t ref[ENC_MAX_PIXELS * 8];
+  printf("image             format    png store (ms, bytes)  png fast (ms, bytes)  qoi (ms, bytes)\n");
+  static const struct { int w, h, format; const char *name; } cases[] = {
+    {144, 180, ENC_RGBA8, "upload"},
+    {180, 320, ENC_RGBA8, "screenshot"},
+    {180, 320, ENC_RGBA16F, "screenshot"},
+  };
+  static const char *format_names[] = {"rgba8", "rgba16f", "rgba4"};
+  for (int k = 0; k < (int)(sizeof cases / sizeof cases[0]); k++) {
+    int w = cases[k].w, h = cases[k].h, n = w * h;
+    test_image(w, h, ref);
+    int bytes = 4;
+    if (cases[k].format == ENC_RGBA16F) {
+      // Widen to half floats, back to front
+      uint16_t *hf = (uint16_t *)ref;
+      for (int i = n * 4 - 1; i >= 0; i--) {
+        union { float f; uint32_t u; } x = { .f = ref[i] / 255.0f };
+        hf[i] = (x.u == 0 ? 0 : ((x.u >> 13) - ((127 - 15) << 10)) & 0x7fff);
+      }
+      bytes = 8;
+    }
+    printf("%-10s %3dx%-3d %-8s", cases[k].name, w, h, format_names[cases[k].format]);
+    for (int mode = 0; mode < 3; mode++) {
+      const int reps = 200;
+      int size = 0;
+      double t0 = now_ms();
+      for (int r = 0; r < reps; r++) {
+        memcpy(enc_buf, ref, n * bytes);
+        size = (mode < 2 ? encode_png(w, h, cases[k].format, mode) :
+          encode_qoi(w, h, cases[k].format));
+      }
+      double t = (now_ms() - t0) / reps;
+      printf("  %9.3f %7d     ", t, size);
+    }
+    printf("\n");
+  }
+  return 0;
+}
+#endif
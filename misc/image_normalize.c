@@ -0,0 +1,962 @@
+// Normalizes recognition uploads on the server: decodes the upload (a drawing,
+// see `render_drawing` in `polygon_rast.c`, or a PNG from earlier versions of
+// the game), composites it over the background and encodes the PNG that goes to
+// the recognizer, replacing sharp's metadata/flatten/encode round trips. Also
+// hashes the result for the server's recognition cache (`upload_phash`).
+// Only built into the server's copy of the library (see `server/rast.js`):
+// cc -O3 -DNDEBUG -DENC_MAX_PIXELS=262144 -shared -fPIC -o libpolygon_rast.so polygon_rast.c image_encode.c image_normalize.c -lm
+//
+// Checks and benchmark, from `misc`, with the other two files built without theirs:
+// cc -O3 -DNDEBUG -DENC_MAX_PIXELS=262144 -c polygon_rast.c -o /tmp/pr.o && cc -O3 -DNDEBUG -DENC_MAX_PIXELS=262144 -c image_encode.c -o /tmp/ie.o
+// cc -O2 -Wall -DTESTRUN image_normalize.c /tmp/pr.o /tmp/ie.o -o /tmp/norm -lm && /tmp/norm
+// cc -O3 -DBENCHRUN image_normalize.c /tmp/pr.o /tmp/ie.o -o /tmp/norm_bench -lm && /tmp/norm_bench test_images/*.png
+// With -DBENCH_LIBPNG (and -lpng -lz), also times the libpng path below sharp
+
+#define _export
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// `image_encode.c`
+uint8_t *get_enc_buf();
+uint8_t *get_enc_out();
+int get_enc_max_pixels();
+int encode_png(int w, int h, int format, int level);
+// `polygon_rast.c`
+int render_drawing(const uint8_t *data, int len, int w, int h, uint8_t *out);
+int shape_features(const uint8_t *pix, int w, int h, uint32_t background, float *out);
+
+#define min(_a, _b) ((_a) < (_b) ? (_a) : (_b))
+#define max(_a, _b) ((_a) > (_b) ? (_a) : (_b))
+
+#define NORM_MALFORMED    (-1)
+#define NORM_TOO_LARGE    (-2)
+// A valid PNG that this decoder leaves to libvips: interlaced, not 8 bits
+// per channel, or with a colour key
+#define NORM_UNSUPPORTED  (-3)
+
+// Largest upload, as it was checked with sharp
+#define NORM_MAX_BYTES (1024 * 1024)
+#define NORM_MAX_SIDE 512
+
+// Concatenated IDAT chunks, and the decompressed scanlines
+static uint8_t norm_zbuf[NORM_MAX_BYTES];
+static uint8_t norm_rows[NORM_MAX_SIDE * (NORM_MAX_SIDE * 4 + 1)];
+
+// The last image normalized, left in `get_enc_buf()` for `upload_phash`
+static int norm_w = 0, norm_h = 0;
+static uint8_t norm_bg[3];
+
+// ======== Inflate ======== //
+
+struct inflate_state {
+  const uint8_t *in, *in_end;
+  uint64_t bits;
+  int n_bits;
+  int overrun;  // Zero bytes fed past the end
+};
+
+static inline void refill(struct inflate_state *s)
+{
+  while (s->n_bits <= 56) {
+    uint64_t b = 0;
+    if (s->in < s->in_end) b = *s->in++;
+    else s->overrun++;
+    s->bits |= b << s->n_bits;
+    s->n_bits += 8;
+  }
+}
+
+static inline uint32_t get_bits(struct inflate_state *s, int n)
+{
+  if (s->n_bits < n) refill(s);
+  uint32_t v = s->bits & ((1u << n) - 1);
+  s->bits >>= n;
+  s->n_bits -= n;
+  return v;
+}
+
+// Canonical Huffman code as a table indexed by the next `bits` input bits
+// (least significant first); entries are symbol << 4 | length, 0 for no code
+struct huffman {
+  uint16_t table[1 << 15];
+  int bits;
+};
+
+static bool huffman_build(struct huffman *h, const uint8_t *lengths, int n)
+{
+  int count[16] = { 0 };
+  for (int i = 0; i < n; i++) count[lengths[i]]++;
+  count[0] = 0;
+  int max_len = 0, left = 1;
+  for (int len = 1; len < 16; len++) {
+    if (count[len]) max_len = len;
+    left = left * 2 - count[len];
+    if (left < 0) return false;  // Over-subscribed
+  }
+  // An empty distance code is allowed, for blocks of literals only
+  h->bits = (max_len > 0 ? max_len : 1);
+  memset(h->table, 0, sizeof(uint16_t) << h->bits);
+  int next[16];
+  next[1] = 0;
+  for (int len = 1; len < 15; len++) next[len + 1] = (next[len] + count[len]) << 1;
+  for (int sym = 0; sym < n; sym++) {
+    int len = lengths[sym];
+    if (len == 0) continue;
+    uint32_t code = next[len]++, rev = 0;
+    for (int i = 0; i < len; i++) rev = (rev << 1) | ((code >> i) & 1);
+    for (uint32_t k = rev; k < (1u << h->bits); k += 1u << len)
+      h->table[k] = sym << 4 | len;
+  }
+  return true;
+}
+
+static inline int huffman_decode(struct inflate_state *s, const struct huffman *h)
+{
+  if (s->n_bits < 15) refill(s);
+  uint16_t e = h->table[s->bits & ((1u << h->bits) - 1)];
+  int len = e & 15;
+  if (len == 0) return -1;
+  s->bits >>= len;
+  s->n_bits -= len;
+  return e >> 4;
+}
+
+static const uint16_t len_base[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t len_bits[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const uint16_t dist_base[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+static const uint8_t dist_bits[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+// Inflates the zlib stream into `out`, which must come out exactly `out_len`
+// bytes long. Returns false on malformed input
+static bool zlib_inflate(const uint8_t *in, int in_len, uint8_t *out, int out_len)
+{
+  static struct huffman lit, dist;
+  if (in_len < 2 || (in[0] & 15) != 8 || (in[0] << 8 | in[1]) % 31 != 0 || (in[1] & 32))
+    return false;
+  struct inflate_state s = { in + 2, in + in_len, 0, 0, 0 };
+  int n = 0;
+  bool final;
+  do {
+    final = get_bits(&s, 1);
+    int type = get_bits(&s, 2);
+    if (type == 0) {
+      // Stored: drop to the byte boundary; the bytes read ahead are in `bits`
+      get_bits(&s, s.n_bits & 7);
+      uint32_t len = get_bits(&s, 16);
+      uint32_t nlen = get_bits(&s, 16);
+      if ((len ^ 0xffff) != nlen || len > (uint32_t)(out_len - n)) return false;
+      for (; len > 0 && s.n_bits > 0; len--) out[n++] = get_bits(&s, 8);
+      if (len > s.in_end - s.in) return false;
+      memcpy(out + n, s.in, len);
+      s.in += len;
+      n += len;
+      continue;
+    }
+    if (type == 1) {
+      uint8_t lengths[288 + 32];
+      memset(lengths, 8, 144);
+      memset(lengths + 144, 9, 112);
+      memset(lengths + 256, 7, 24);
+      memset(lengths + 280, 8, 8);
+      memset(lengths + 288, 5, 30);
+      huffman_build(&lit, lengths, 288);
+      huffman_build(&dist, lengths + 288, 30);
+    } else if (type == 2) {
+      static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+      int hlit = get_bits(&s, 5) + 257;
+      int hdist = get_bits(&s, 5) + 1;
+      int hclen = get_bits(&s, 4) + 4;
+      if (hlit > 286 || hdist > 30) return false;
+      uint8_t cl_lengths[19] = { 0 };
+      for (int i = 0; i < hclen; i++) cl_lengths[order[i]] = get_bits(&s, 3);
+      if (!huffman_build(&lit, cl_lengths, 19)) return false;
+      uint8_t lengths[286 + 30];
+      for (int i = 0; i < hlit + hdist; ) {
+        int sym = huffman_decode(&s, &lit);
+        if (sym < 0) return false;
+        if (sym < 16) {
+          lengths[i++] = sym;
+          continue;
+        }
+        int prev = 0, rep;
+        if (sym == 16) {
+          if (i == 0) return false;
+          prev = lengths[i - 1];
+          rep = 3 + get_bits(&s, 2);
+        } else if (sym == 17) {
+          rep = 3 + get_bits(&s, 3);
+        } else {
+          rep = 11 + get_bits(&s, 7);
+        }
+        if (i + rep > hlit + hdist) return false;
+        while (rep-- > 0) lengths[i++] = prev;
+      }
+      if (lengths[256] == 0) return false;
+      if (!huffman_build(&lit, lengths, hlit) ||
+          !huffman_build(&dist, lengths + hlit, hdist)) return false;
+    } else {
+      return false;
+    }
+
+    while (true) {
+      int sym = huffman_decode(&s, &lit);
+      if (sym < 0) return false;
+      if (sym < 256) {
+        if (n >= out_len) return false;
+        out[n++] = sym;
+        continue;
+      }
+      if (sym == 256) break;
+      sym -= 257;
+      if (sym >= 29) return false;
+      int len = len_base[sym] + get_bits(&s, len_bits[sym]);
+      int d = huffman_decode(&s, &dist);
+      if (d < 0 || d >= 30) return false;
+      int dist_len = dist_base[d] + get_bits(&s, dist_bits[d]);
+      if (dist_len > n || len > out_len - n) return false;
+      const uint8_t *src = out + n - dist_len;
+      uint8_t *dst = out + n;
+      for (int i = 0; i < len; i++) dst[i] = src[i];
+      n += len;
+    }
+  } while (!final);
+  // Whatever was decoded from the zeros fed past the end is not data
+  int consumed = (s.in - in) + s.overrun - s.n_bits / 8;
+  return n == out_len && consumed <= in_len;
+}
+
+// ======== PNG ======== //
+
+static inline uint32_t be32(const uint8_t *p)
+{
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Straight alpha over the opaque background, rounded as (x + 127) / 255.
+// 16-bit lanes are enough all the way, so the loop vectorizes
+static void composite_rgba(uint8_t *p, int n, const uint8_t *bg)
+{
+  for (int i = 0; i < n; i++) {
+    uint16_t a = p[i * 4 + 3];
+    for (int c = 0; c < 3; c++) {
+      uint16_t v = p[i * 4 + c] * a + bg[c] * (255 - a) + 128;
+      p[i * 4 + c] = (v + (v >> 8)) >> 8;
+    }
+    p[i * 4 + 3] = 255;
+  }
+}
+
+static inline int paeth(int a, int b, int c)
+{
+  int p = a + b - c;
+  int pa = p > a ? p - a : a - p;
+  int pb = p > b ? p - b : b - p;
+  int pc = p > c ? p - c : c - p;
+  return (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+}
+
+// Decodes the PNG into `out` (RGBA, composited). Palettes are composited once,
+// other images with alpha a row at a time while the row is still in cache
+static int decode_png(const uint8_t *data, int len, int max_side, const uint8_t *bg,
+  uint8_t *out, int *out_w, int *out_h)
+{
+  static const uint8_t signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+  if (len < 8 + 25 || memcmp(data, signature, 8) != 0) return NORM_MALFORMED;
+
+  int w = 0, h = 0, depth = 0, type = -1, interlace = 0;
+  uint8_t palette[256][4];
+  int n_palette = 0;
+  bool has_trns = false, has_ihdr = false;
+  int z_len = 0;
+  for (int p = 8; ; ) {
+    if (p + 12 > len) return NORM_MALFORMED;
+    uint32_t chunk_len = be32(data + p);
+    const uint8_t *chunk_type = data + p + 4, *body = data + p + 8;
+    if (chunk_len > (uint32_t)(len - p - 12)) return NORM_MALFORMED;
+    if (memcmp(chunk_type, "IHDR", 4) == 0) {
+      if (chunk_len != 13) return NORM_MALFORMED;
+      w = be32(body);
+      h = be32(body + 4);
+      depth = body[8];
+      type = body[9];
+      interlace = body[12];
+      has_ihdr = true;
+      if (w <= 0 || h <= 0) return NORM_MALFORMED;
+      if (w > max_side || h > max_side || (int64_t)w * h > get_enc_max_pixels())
+        return NORM_TOO_LARGE;
+      if (depth != 8 || interlace != 0 || body[10] != 0 || body[11] != 0)
+        return NORM_UNSUPPORTED;
+      if (type != 0 && type != 2 && type != 3 && type != 4 && type != 6)
+        return NORM_MALFORMED;
+      for (int i = 0; i < 256; i++) {
+        palette[i][0] = palette[i][1] = palette[i][2] = 0;
+        palette[i][3] = 255;
+      }
+    } else if (!has_ihdr) {
+      return NORM_MALFORMED;
+    } else if (memcmp(chunk_type, "PLTE", 4) == 0) {
+      if (chunk_len % 3 != 0 || chunk_len > 768) return NORM_MALFORMED;
+      n_palette = chunk_len / 3;
+      for (int i = 0; i < n_palette; i++) memcpy(palette[i], body + i * 3, 3);
+    } else if (memcmp(chunk_type, "tRNS", 4) == 0) {
+      // Colour keys on grey and RGB images are rare enough to leave to libvips
+      if (type != 3) return NORM_UNSUPPORTED;
+      if (chunk_len > (uint32_t)n_palette) return NORM_MALFORMED;
+      for (int i = 0; i < (int)chunk_len; i++) palette[i][3] = body[i];
+      has_trns = true;
+    } else if (memcmp(chunk_type, "IDAT", 4) == 0) {
+      memcpy(norm_zbuf + z_len, body, chunk_len);
+      z_len += chunk_len;
+    } else if (memcmp(chunk_type, "IEND", 4) == 0) {
+      break;
+    } else if (!(chunk_type[0] & 32)) {
+      return NORM_UNSUPPORTED;  // Unknown critical chunk
+    }
+    p += 12 + chunk_len;
+  }
+  if (type == 3 && n_palette == 0) return NORM_MALFORMED;
+  if (has_trns) composite_rgba(palette[0], 256, bg);
+
+  static const int channels[7] = {1, 0, 3, 1, 2, 0, 4};
+  int bpp = channels[type];
+  int stride = w * bpp;
+  if (!zlib_inflate(norm_zbuf, z_len, norm_rows, h * (stride + 1))) return NORM_MALFORMED;
+
+  for (int y = 0; y < h; y++) {
+    uint8_t *row = norm_rows + y * (stride + 1) + 1;
+    const uint8_t *up = row - (stride + 1);
+    int filter = row[-1];
+    if (y == 0 && (filter == 2 || filter == 4)) filter = (filter == 2 ? 0 : 1);
+    if (y == 0 && filter == 3) {
+      for (int i = bpp; i < stride; i++) row[i] += row[i - bpp] >> 1;
+    } else if (filter == 1) {
+      for (int i = bpp; i < stride; i++) row[i] += row[i - bpp];
+    } else if (filter == 2) {
+      for (int i = 0; i < stride; i++) row[i] += up[i];
+    } else if (filter == 3) {
+      for (int i = 0; i < bpp; i++) row[i] += up[i] >> 1;
+      for (int i = bpp; i < stride; i++) row[i] += (row[i - bpp] + up[i]) >> 1;
+    } else if (filter == 4) {
+      for (int i = 0; i < bpp; i++) row[i] += up[i];
+      for (int i = bpp; i < stride; i++) row[i] += paeth(row[i - bpp], up[i], up[i - bpp]);
+    } else if (filter != 0) {
+      return NORM_MALFORMED;
+    }
+
+    uint8_t *o = out + y * w * 4;
+    switch (type) {
+    case 0:
+      for (int x = 0; x < w; x++) {
+        o[x * 4 + 0] = o[x * 4 + 1] = o[x * 4 + 2] = row[x];
+        o[x * 4 + 3] = 255;
+      }
+      break;
+    case 2:
+      for (int x = 0; x < w; x++) {
+        memcpy(o + x * 4, row + x * 3, 3);
+        o[x * 4 + 3] = 255;
+      }
+      break;
+    case 3:
+      for (int x = 0; x < w; x++) memcpy(o + x * 4, palette[row[x]], 4);
+      break;
+    case 4:
+      for (int x = 0; x < w; x++) {
+        o[x * 4 + 0] = o[x * 4 + 1] = o[x * 4 + 2] = row[x * 2];
+        o[x * 4 + 3] = row[x * 2 + 1];
+      }
+      composite_rgba(o, w, bg);
+      break;
+    case 6:
+      memcpy(o, row, w * 4);
+      composite_rgba(o, w, bg);
+      break;
+    }
+  }
+  *out_w = w;
+  *out_h = h;
+  return 0;
+}
+
+// Decodes an upload into `get_enc_buf()`, opaque over the background colour
+// 0xRRGGBB: a drawing rendered at `drawing_scale` times its canvas size, or a
+// PNG of up to `max_side` pixels a side. Leaves it for `upload_phash` and
+// `upload_features` without encoding it, for the server's start, which only
+// needs those. Returns 0, or one of `NORM_MALFORMED`, `NORM_TOO_LARGE`,
+// `NORM_UNSUPPORTED`
+/*
+  decode_upload: { parameters: ['buffer', 'i32', 'i32', 'i32', 'u32'], result: 'i32' }
+*/
+_export int decode_upload(const uint8_t *data, int len, int max_side, int drawing_scale,
+  uint32_t background)
+{
+  if (len > NORM_MAX_BYTES || max_side > NORM_MAX_SIDE) return NORM_TOO_LARGE;
+  const uint8_t bg[3] = { background >> 16, background >> 8, background };
+  uint8_t *pix = get_enc_buf();
+  int w, h;
+  if (len >= 4 && memcmp(data, "BSD1", 4) == 0) {
+    // Canvas size, the first two varints
+    uint32_t size[2] = { 0, 0 };
+    int p = 4;
+    for (int k = 0; k < 2; k++)
+      for (int shift = 0; ; shift += 7) {
+        if (p >= len || shift > 28) return NORM_MALFORMED;
+        size[k] |= (uint32_t)(data[p] & 127) << shift;
+        if (!(data[p++] & 128)) break;
+      }
+    if (size[0] > (uint32_t)max_side || size[1] > (uint32_t)max_side) return NORM_TOO_LARGE;
+    w = size[0] * drawing_scale;
+    h = size[1] * drawing_scale;
+    if (w > max_side || h > max_side || w * h > get_enc_max_pixels()) return NORM_TOO_LARGE;
+    if (render_drawing(data, len, w, h, pix) != 0) return NORM_MALFORMED;
+    composite_rgba(pix, w * h, bg);
+  } else {
+    int ret = decode_png(data, len, max_side, bg, pix, &w, &h);
+    if (ret != 0) return ret;
+  }
+  norm_w = w;
+  norm_h = h;
+  memcpy(norm_bg, bg, 3);
+  return 0;
+}
+
+// Turns an upload into the opaque PNG sent to the recognizer, in `get_enc_out()`,
+// decoded as by `decode_upload`. Returns the size of the PNG, or one of
+// `NORM_MALFORMED`, `NORM_TOO_LARGE`, `NORM_UNSUPPORTED`
+/*
+  normalize_upload: { parameters: ['buffer', 'i32', 'i32', 'i32', 'u32'], result: 'i32' }
+*/
+_export int normalize_upload(const uint8_t *data, int len, int max_side, int drawing_scale,
+  uint32_t background)
+{
+  int ret = decode_upload(data, len, max_side, drawing_scale, background);
+  if (ret != 0) return ret;
+  return encode_png(norm_w, norm_h, 0, 1);
+}
+
+// ======== Perceptual hash ======== //
+
+#define PHASH_N 32
+
+static inline uint32_t load32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+// Ink of each pixel, its distance from the background, on a 32 x 32 grid over
+// the square around the drawing's bounding box, so that the same shape drawn
+// smaller or elsewhere on the canvas lands on the same grid
+static bool phash_grid(const uint8_t *pix, int w, int h, const uint8_t *bg,
+  float grid[PHASH_N][PHASH_N])
+{
+  static int cell_of[NORM_MAX_SIDE];
+  // Bounding box, trimming each row of background from both ends
+  const uint8_t bg_pixel[4] = { bg[0], bg[1], bg[2], 255 };
+  uint32_t bg_word;
+  memcpy(&bg_word, bg_pixel, 4);
+  int x0 = w, x1 = -1, y0 = h, y1 = -1;
+  for (int y = 0; y < h; y++) {
+    int l = 0, r = w - 1;
+    while (l < w && load32(pix + (y * w + l) * 4) == bg_word) l++;
+    if (l == w) continue;
+    while (load32(pix + (y * w + r) * 4) == bg_word) r--;
+    x0 = min(x0, l); x1 = max(x1, r);
+    y0 = min(y0, y); y1 = y;
+  }
+  if (x1 < 0) return false;
+
+  // Each pixel goes to the cell its centre falls in
+  int side = max(x1 - x0, y1 - y0) + 1;
+  float ox = (x0 + x1 + 1) * 0.5f - side * 0.5f;
+  float oy = (y0 + y1 + 1) * 0.5f - side * 0.5f;
+  float to_grid = (float)PHASH_N / side;
+  memset(grid, 0, sizeof(float) * PHASH_N * PHASH_N);
+  for (int x = x0; x <= x1; x++) cell_of[x] = min((int)((x + 0.5f - ox) * to_grid), PHASH_N - 1);
+  for (int y = y0; y <= y1; y++) {
+    const uint8_t *row = pix + y * w * 4;
+    uint32_t acc[PHASH_N] = { 0 };
+    for (int x = x0; x <= x1; x++) {
+      const uint8_t *p = row + x * 4;
+      acc[cell_of[x]] += abs(p[0] - bg[0]) + abs(p[1] - bg[1]) + abs(p[2] - bg[2]);
+    }
+    float *g = grid[min((int)((y + 0.5f - oy) * to_grid), PHASH_N - 1)];
+    for (int i = 0; i < PHASH_N; i++) g[i] += acc[i];
+  }
+  // Mean ink per pixel, whatever the size
+  float scale = to_grid * to_grid;
+  for (int i = 0; i < PHASH_N; i++)
+    for (int j = 0; j < PHASH_N; j++) grid[i][j] *= scale;
+  return true;
+}
+
+// 64-bit hash of the last image decoded (`decode_upload`, `normalize_upload`), as two
+// 32-bit halves, low first: the signs of the 8 x 8 lowest frequencies of the
+// grid's DCT (DC left out, the top bit is always 0) against their median.
+// Near-duplicates differ in a few bits; a blank image hashes to 0
+/*
+  upload_phash: { parameters: ['buffer'], result: 'void' }
+*/
+_export void upload_phash(uint32_t *out)
+{
+  static float cos_table[8][PHASH_N];
+  static bool cos_ready = false;
+  if (!cos_ready) {
+    for (int u = 0; u < 8; u++)
+      for (int x = 0; x < PHASH_N; x++)
+        cos_table[u][x] = cosf((float)M_PI * (2 * x + 1) * u / (2 * PHASH_N));
+    cos_ready = true;
+  }
+
+  out[0] = out[1] = 0;
+  static float grid[PHASH_N][PHASH_N];
+  if (norm_w == 0 || !phash_grid(get_enc_buf(), norm_w, norm_h, norm_bg, grid)) return;
+
+  // Separable DCT-II, only the low frequencies
+  float rows[PHASH_N][8], coeff[64];
+  for (int y = 0; y < PHASH_N; y++)
+    for (int u = 0; u < 8; u++) {
+      float s = 0;
+      for (int x = 0; x < PHASH_N; x++) s += grid[y][x] * cos_table[u][x];
+      rows[y][u] = s;
+    }
+  for (int v = 0; v < 8; v++)
+    for (int u = 0; u < 8; u++) {
+      float s = 0;
+      for (int y = 0; y < PHASH_N; y++) s += rows[y][u] * cos_table[v][y];
+      coeff[v * 8 + u] = s;
+    }
+
+  // Median of the 63 without DC, by insertion sort
+  float sorted[63];
+  for (int i = 0; i < 63; i++) {
+    float c = coeff[i + 1];
+    int j = i;
+    for (; j > 0 && sorted[j - 1] > c; j--) sorted[j] = sorted[j - 1];
+    sorted[j] = c;
+  }
+  float median = sorted[31];
+  for (int i = 0; i < 63; i++)
+    if (coeff[i + 1] > median) out[i / 32] |= 1u << (i % 32);
+}
+#undef PHASH_N
+
+// Shape descriptors of the last image decoded (`decode_upload`, `normalize_upload`), for the
+// local classifier (see `shape_features`). Returns their number, or 0 if the
+// image is blank
+/*
+  upload_features: { parameters: ['buffer'], result: 'i32' }
+*/
+_export int upload_features(float *out)
+{
+  if (norm_w == 0) return 0;
+  return shape_features(get_enc_buf(), norm_w, norm_h,
+    norm_bg[0] << 16 | norm_bg[1] << 8 | norm_bg[2], out);
+}
+
+#ifdef TESTRUN
+#include <stdio.h>
+#include <time.h>
+
+// Reads back what `normalize_upload` wrote
+static bool read_back(int size, int w, int h, uint8_t *rgba)
+{
+  const uint8_t *png = get_enc_out();
+  int rw, rh;
+  static uint8_t copy[NORM_MAX_BYTES];
+  memcpy(copy, png, size);
+  const uint8_t bg[3] = {0, 0, 0};
+  if (decode_png(copy, size, NORM_MAX_SIDE, bg, rgba, &rw, &rh) != 0) return false;
+  return rw == w && rh == h;
+}
+
+// A drawing on a 144 x 180 canvas of one closed stroke around (cx, cy), at
+// radius `radius(angle)`, in quarter pixels
+static int make_drawing(uint8_t *data, float cx, float cy, float (*radius)(float))
+{
+  int len = 0;
+  #define PUT_VARINT(_v) do { \
+    uint32_t v = (_v); \
+    while (v >= 128) { data[len++] = (v & 127) | 128; v >>= 7; } \
+    data[len++] = v; \
+  } while (0)
+  #define PUT_ZIGZAG(_v) PUT_VARINT((_v) >= 0 ? (uint32_t)(_v) * 2 : (uint32_t)-(_v) * 2 - 1)
+  memcpy(data, "BSD1", 4);
+  len = 4;
+  PUT_VARINT(144); PUT_VARINT(180);
+  data[len++] = 4;
+  PUT_VARINT(1);
+  data[len++] = 1;
+  data[len++] = 12;
+  const int n = 120;
+  PUT_VARINT(n);
+  int qx = 0, qy = 0;
+  for (int i = 0; i < n; i++) {
+    float a = (float)M_PI * 2 * i / n;
+    int x = (int)((cx + radius(a) * cosf(a)) * 4), y = (int)((cy + radius(a) * sinf(a)) * 4);
+    PUT_ZIGZAG(x - qx); PUT_ZIGZAG(y - qy);
+    qx = x; qy = y;
+  }
+  #undef PUT_VARINT
+  #undef PUT_ZIGZAG
+  return len;
+}
+static float apple(float a) { return 36 + 6 * cosf(a) + 5 * sinf(2 * a) - 4 * cosf(3 * a); }
+static float apple_redrawn(float a) { return 0.7f * apple(a) + 0.8f * sinf(a * 7); }
+static float star(float a) { return 30 + 12 * cosf(a * 5); }
+static float square(float a) { return 40 / fmaxf(fabsf(cosf(a)), fabsf(sinf(a))); }
+
+static float test_rng()
+{
+  static uint32_t state = 2463534242u;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return (state >> 8) / 16777216.0f;
+}
+
+static int phash_distance(const uint32_t *a, const uint32_t *b)
+{
+  return __builtin_popcount(a[0] ^ b[0]) + __builtin_popcount(a[1] ^ b[1]);
+}
+
+int main()
+{
+  static uint8_t img[NORM_MAX_SIDE * NORM_MAX_SIDE * 4], back[NORM_MAX_SIDE * NORM_MAX_SIDE * 4];
+  static uint8_t file[NORM_MAX_BYTES];
+  const uint32_t bg = 0x101010;
+
+  // RGBA with a gradient of alpha, through our own encoder, against a direct blend
+  int w = 144, h = 180;
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      uint8_t *p = &img[(y * w + x) * 4];
+      p[0] = x * 255 / w; p[1] = y * 255 / h; p[2] = 200; p[3] = (x + y) % 256;
+    }
+  memcpy(get_enc_buf(), img, w * h * 4);
+  int size = encode_png(w, h, 0, 1);
+  memcpy(file, get_enc_out(), size);
+  int out = normalize_upload(file, size, 512, 2, bg);
+  bool ok = (out > 0 && read_back(out, w, h, back));
+  int max_diff = 0;
+  for (int i = 0; ok && i < w * h * 4; i++) {
+    int a = img[(i & ~3) + 3];
+    double expected = ((i & 3) == 3 ? 255 : (img[i] * a + 0x10 * (255 - a)) / 255.0);
+    int d = abs(back[i] - (int)(expected + 0.5));
+    if (max_diff < d) max_diff = d;
+  }
+  printf("rgba png, composited, %s\n", ok && max_diff == 0 ? "exact" : "DIFFERS");
+
+  // Truncations of it are rejected, not read past
+  int n_rejected = 0;
+  for (int cut = 8; cut < size; cut += 97)
+    if (normalize_upload(file, cut, 512, 2, bg) == NORM_MALFORMED) n_rejected++;
+  printf("truncated pngs rejected %d of %d\n", n_rejected, (size - 8 + 96) / 97);
+
+  // A 3x1 palette image with transparency, written by hand with a stored block
+  static const uint8_t pal[] = {
+    137, 'P', 'N', 'G', '\r', '\n', 26, '\n',
+    0, 0, 0, 13, 'I', 'H', 'D', 'R', 0, 0, 0, 3, 0, 0, 0, 1, 8, 3, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 6, 'P', 'L', 'T', 'E', 255, 0, 0, 0, 0, 255, 0, 0, 0, 0,
+    0, 0, 0, 2, 't', 'R', 'N', 'S', 0, 128, 0, 0, 0, 0,
+    0, 0, 0, 15, 'I', 'D', 'A', 'T', 0x78, 0x01, 1, 4, 0, 0xfb, 0xff, 0, 0, 1, 1, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 'I', 'E', 'N', 'D', 0, 0, 0, 0,
+  };
+  out = normalize_upload(pal, sizeof pal, 512, 2, bg);
+  static const uint8_t pal_expected[] = {0x10, 0x10, 0x10, 255, 0x08, 0x08, 0x88, 255, 0x08, 0x08, 0x88, 255};
+  ok = (out > 0 && read_back(out, 3, 1, back) && memcmp(back, pal_expected, 12) == 0);
+  printf("palette png, stored, %s\n", ok ? "exact" : "DIFFERS");
+
+  // Perceptual hashes: a shape against the same drawn smaller, shakier and
+  // elsewhere on the canvas, and against other shapes
+  {
+    static float (*const shapes[])(float) = {apple, apple_redrawn, star, square};
+    static const char *names[] = {"apple", "apple redrawn", "star", "square"};
+    static const float centres[][2] = {{72, 90}, {50, 120}, {72, 90}, {72, 90}};
+    uint32_t hashes[4][2];
+    for (int i = 0; i < 4; i++) {
+      int len = make_drawing(file, centres[i][0], centres[i][1], shapes[i]);
+      out = normalize_upload(file, len, 512, 2, bg);
+      upload_phash(hashes[i]);
+      if (out <= 0) printf("%s NOT NORMALIZED\n", names[i]);
+    }
+    for (int i = 1; i < 4; i++)
+      printf("phash distance, apple to %s: %d\n", names[i], phash_distance(hashes[0], hashes[i]));
+
+    // Decoding alone leaves the same image to hash, and no PNG
+    int len = make_drawing(file, centres[0][0], centres[0][1], shapes[0]);
+    get_enc_out()[0] = 0;
+    uint32_t decoded[2];
+    ok = (decode_upload(file, len, 512, 2, bg) == 0);
+    upload_phash(decoded);
+    ok = ok && decoded[0] == hashes[0][0] && decoded[1] == hashes[0][1] && get_enc_out()[0] == 0;
+    printf("decode only, same hash, not encoded: %s\n", ok ? "ok" : "FAILED");
+  }
+
+  // Shape features of drawings of six made-up classes, each drawn 8 times at
+  // random sizes, places, tilts and colours with a shaky hand; every drawing
+  // should have its nearest neighbour (on standardized features) in its class
+  {
+    enum { N_CLASSES = 6, N_EACH = 8, N = N_CLASSES * N_EACH, CW = 144, CH = 180 };
+    static const char *names[N_CLASSES] = {"sun", "moon", "star", "snowman", "tree", "fish"};
+    static uint8_t data[4096];
+    static float feat[N][64];
+    int n_features = 0;
+    int len;
+    #define PUT_VARINT(_v) do { \
+      uint32_t v = (_v); \
+      while (v >= 128) { data[len++] = (v & 127) | 128; v >>= 7; } \
+      data[len++] = v; \
+    } while (0)
+    #define PUT_ZIGZAG(_v) PUT_VARINT((_v) >= 0 ? (uint32_t)(_v) * 2 : (uint32_t)-(_v) * 2 - 1)
+    double feature_ms = 0;
+    for (int k = 0; k < N; k++) {
+      int cls = k / N_EACH;
+      float scale = 0.5f + test_rng() * 0.5f, tilt = (test_rng() - 0.5f) * 0.4f;
+      float cx = CW / 2 + (test_rng() - 0.5f) * 40, cy = CH / 2 + (test_rng() - 0.5f) * 40;
+      float phase = test_rng() * 6.28f;
+      // Strokes as (centre x, centre y, radius x, radius y) ellipses, shaped below
+      float strokes[3][4];
+      int n_strokes = 0;
+      #define STROKE(_x, _y, _rx, _ry) do { \
+        float *e = strokes[n_strokes++]; e[0] = _x; e[1] = _y; e[2] = _rx; e[3] = _ry; \
+      } while (0)
+      if (cls == 0 || cls == 1 || cls == 2) STROKE(0, 0, 40, 40);
+      if (cls == 3) { STROKE(0, -38, 22, 22); STROKE(0, 20, 34, 34); }
+      if (cls == 4) { STROKE(0, -20, 38, 36); STROKE(0, 40, 8, 24); }
+      if (cls == 5) { STROKE(-8, 0, 40, 22); STROKE(42, 0, 14, 18); }
+      #undef STROKE
+      memcpy(data, "BSD1", 4);
+      len = 4;
+      PUT_VARINT(CW); PUT_VARINT(CH);
+      data[len++] = 4;
+      PUT_VARINT(n_strokes);
+      for (int i = 0; i < n_strokes; i++) {
+        data[len++] = (int)(test_rng() * 6);
+        data[len++] = 12;
+        const int n = 96;
+        PUT_VARINT(n);
+        int qx = 0, qy = 0;
+        for (int j = 0; j < n; j++) {
+          float a = 6.2831853f * j / n;
+          float r = 1 + 0.03f * sinf(a * 5 + phase);
+          if (cls == 0) r += 0.12f * cosf(a * 10);
+          if (cls == 2) r = 0.7f + 0.3f * cosf(a * 5);
+          float x = strokes[i][2] * r * cosf(a), y = strokes[i][3] * r * sinf(a);
+          // The moon is its circle less a circle shifted to the right
+          if (cls == 1 && x > -8) x = -8 + (x + 8) * -0.4f;
+          x += strokes[i][0];
+          y += strokes[i][1];
+          float rx = x * cosf(tilt) - y * sinf(tilt), ry = x * sinf(tilt) + y * cosf(tilt);
+          int px = (int)((cx + rx * scale) * 4), py = (int)((cy + ry * scale) * 4);
+          PUT_ZIGZAG(px - qx); PUT_ZIGZAG(py - qy);
+          qx = px; qy = py;
+        }
+      }
+      normalize_upload(data, len, 512, 2, bg);
+      clock_t t0 = clock();
+      n_features = upload_features(feat[k]);
+      feature_ms += (double)(clock() - t0) * 1000 / CLOCKS_PER_SEC;
+    }
+    #undef PUT_VARINT
+    #undef PUT_ZIGZAG
+
+    // Colour carries no information here, and is left out
+    const int n_used = n_features - 7;
+    float mean[64] = { 0 }, sd[64] = { 0 };
+    for (int i = 0; i < n_used; i++) {
+      for (int k = 0; k < N; k++) mean[i] += feat[k][i] / N;
+      for (int k = 0; k < N; k++) sd[i] += (feat[k][i] - mean[i]) * (feat[k][i] - mean[i]) / N;
+      sd[i] = (sd[i] > 1e-12f ? sqrtf(sd[i]) : 1);
+    }
+    int n_right[N_CLASSES] = { 0 };
+    for (int k = 0; k < N; k++) {
+      int best = -1;
+      float best_d = 1e30f;
+      for (int l = 0; l < N; l++) {
+        if (l == k) continue;
+        float d = 0;
+        for (int i = 0; i < n_used; i++) {
+          float t = (feat[k][i] - feat[l][i]) / sd[i];
+          d += t * t;
+        }
+        if (d < best_d) { best_d = d; best = l; }
+      }
+      if (best / N_EACH == k / N_EACH) n_right[k / N_EACH]++;
+    }
+    printf("shape features, nearest neighbour in class:");
+    for (int c = 0; c < N_CLASSES; c++) printf(" %s %d/%d", names[c], n_right[c], N_EACH);
+    printf("\n");
+    printf("shape features %d, %.3f ms each\n", n_features, feature_ms / N);
+  }
+
+  // Off the background but nowhere dark or bright enough to be ink: blank
+  {
+    static uint8_t faint[64 * 64 * 4];
+    for (int i = 0; i < 64 * 64; i++) memcpy(faint + i * 4, (uint8_t[4]){0x10, 0x10, 0x10, 255}, 4);
+    memset(faint + (20 * 64 + 30) * 4, 0x18, 3);
+    float feat[64];
+    printf("faint pixel only, shape features %d\n", shape_features(faint, 64, 64, bg, feat));
+  }
+
+  // The corpus, if run from `misc`
+  static const char *paths[] = {"test_images/banana-1.png", "test_images/elephant-1.png", "test_images/peach-1.png"};
+  for (int i = 0; i < 3; i++) {
+    FILE *f = fopen(paths[i], "rb");
+    if (!f) continue;
+    int n = fread(file, 1, sizeof file, f);
+    fclose(f);
+    out = normalize_upload(file, n, 512, 2, bg);
+    printf("%s: %d bytes\n", paths[i], out);
+  }
+  return 0;
+}
+#endif
+
+#ifdef BENCHRUN
+#include <stdio.h>
+#include <time.h>
+
+static double bench_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+#ifdef BENCH_LIBPNG
+// What sharp does for /look underneath, with libvips and the round trips through
+// JavaScript left out: libpng decodes to RGBA, the image is flattened over the
+// background, and libpng encodes it with sharp's defaults (zlib level 6, no
+// filtering). Its rate bounds sharp's from above
+#include <png.h>
+
+struct bench_png_io { const uint8_t *in; size_t pos, len; uint8_t *out; size_t out_len; };
+static void bench_png_read(png_structp png, png_bytep p, png_size_t n)
+{
+  struct bench_png_io *io = png_get_io_ptr(png);
+  if (io->pos + n > io->len) png_error(png, "truncated");
+  memcpy(p, io->in + io->pos, n);
+  io->pos += n;
+}
+static void bench_png_write(png_structp png, png_bytep p, png_size_t n)
+{
+  struct bench_png_io *io = png_get_io_ptr(png);
+  memcpy(io->out + io->out_len, p, n);
+  io->out_len += n;
+}
+static void bench_png_flush(png_structp png) { }
+
+static int libpng_normalize(const uint8_t *data, int len, uint32_t background)
+{
+  static uint8_t rgba[NORM_MAX_SIDE * NORM_MAX_SIDE * 4], out[NORM_MAX_SIDE * NORM_MAX_SIDE * 4 + 4096];
+  static png_bytep rows[NORM_MAX_SIDE];
+  struct bench_png_io io = { data, 0, len, out, 0 };
+
+  png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info = png_create_info_struct(png);
+  if (setjmp(png_jmpbuf(png))) { png_destroy_read_struct(&png, &info, NULL); return -1; }
+  png_set_read_fn(png, &io, bench_png_read);
+  png_read_info(png, info);
+  int w = png_get_image_width(png, info), h = png_get_image_height(png, info);
+  if (w > NORM_MAX_SIDE || h > NORM_MAX_SIDE) png_error(png, "too large");
+  png_set_expand(png);
+  png_set_strip_16(png);
+  png_set_gray_to_rgb(png);
+  png_set_add_alpha(png, 0xff, PNG_FILLER_AFTER);
+  png_read_update_info(png, info);
+  for (int y = 0; y < h; y++) rows[y] = rgba + y * w * 4;
+  png_read_image(png, rows);
+  png_destroy_read_struct(&png, &info, NULL);
+
+  int bg[3] = { background >> 16 & 255, background >> 8 & 255, background & 255 };
+  for (int i = 0; i < w * h; i++) {
+    uint8_t *p = rgba + i * 4;
+    for (int c = 0; c < 3; c++) p[c] = (p[c] * p[3] + bg[c] * (255 - p[3]) + 127) / 255;
+    p[3] = 255;
+  }
+
+  png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  info = png_create_info_struct(png);
+  if (setjmp(png_jmpbuf(png))) { png_destroy_write_struct(&png, &info); return -1; }
+  png_set_write_fn(png, &io, bench_png_write, bench_png_flush);
+  png_set_IHDR(png, info, w, h, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+    PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_set_compression_level(png, 6);
+  png_set_filter(png, 0, PNG_FILTER_NONE);
+  png_write_info(png, info);
+  png_write_image(png, rows);
+  png_write_end(png, NULL);
+  png_destroy_write_struct(&png, &info);
+  return io.out_len;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+  static uint8_t file[NORM_MAX_BYTES];
+  printf("upload                       bytes   out bytes   req/s   phash (ms)   features (ms)"
+#ifdef BENCH_LIBPNG
+    "   libpng (req/s, out bytes)"
+#endif
+    "\n");
+  for (int i = 1; i < argc; i++) {
+    FILE *f = fopen(argv[i], "rb");
+    if (!f) continue;
+    int n = fread(file, 1, sizeof file, f);
+    fclose(f);
+    int out = 0, reps = 0;
+    double t0 = bench_ms(), t;
+    while ((t = bench_ms() - t0) < 1000) {
+      out = normalize_upload(file, n, 512, 2, 0x101010);
+      reps++;
+    }
+    int hash_reps = 0;
+    uint32_t hash[2];
+    t0 = bench_ms();
+    double th;
+    while ((th = bench_ms() - t0) < 200) {
+      upload_phash(hash);
+      hash_reps++;
+    }
+    int feature_reps = 0;
+    float features[64];
+    t0 = bench_ms();
+    double tf;
+    while ((tf = bench_ms() - t0) < 200) {
+      upload_features(features);
+      feature_reps++;
+    }
+    printf("%-26s %7d %11d %7.0f %12.4f %15.4f", argv[i], n, out, reps / t * 1000,
+      th / hash_reps, tf / feature_reps);
+#ifdef BENCH_LIBPNG
+    int png_reps = 0, png_out = 0;
+    t0 = bench_ms();
+    while ((t = bench_ms() - t0) < 1000) {
+      png_out = libpng_normalize(file, n, 0x101010);
+      png_reps++;
+    }
+    printf("   %8.0f %10d", png_reps / t * 1000, png_out);
+#endif
+    printf("\n");
+  }
+  return 0;
+}
+#endif
@@ -1,4 +1,8 @@
-// emcc -O3 -DNDEBUG --no-entry -s TOTAL_STACK=65536 -s INITIAL_MEMORY=2097152 -o polygon_rast.wasm polygon_rast.c
+// emcc -O3 -DNDEBUG --no-entry -s TOTAL_STACK=65536 -s INITIAL_MEMORY=4194304 -o polygon_rast.wasm polygon_rast.c image_encode.c
+// Compact build (see `COMPACT_MEMORY` below):
+// emcc -O3 -DNDEBUG -DCOMPACT_MEMORY --no-entry -s TOTAL_STACK=16384 -s INITIAL_MEMORY=524288 -o polygon_rast.wasm polygon_rast.c
+// Desktop, loaded through LuaJIT's FFI by `native.lua` from next to the game (`build_native.sh`):
+// cc -O3 -DNDEBUG -shared -fPIC -o libpolygon_rast.so polygon_rast.c image_encode.c audio_mix.c -lm
 
 #define _export
 
@@ -8,10 +12,12 @@
 #define _export EMSCRIPTEN_KEEPALIVE
 #endif
 
+#include <assert.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define JC_VORONOI_IMPLEMENTATION
 #include "jc_voronoi/jc_voronoi.h"
@@ -19,6 +25,20 @@
 #define MAX_SIDE 200
 #define N_PIXELS (180 * 200)
 
+// COMPACT_MEMORY keeps everything under 512 KiB, so that several instances
+// fit side by side: masks are bitsets, the smoothed highlight is quantized
+// to 8 bits and the Voronoi scratch only covers polygons of up to
+// `MAX_FIELD_POINTS` points. Static data comes to 496,808 bytes (in a 64-bit
+// host build), which with the 16 KiB stack above leaves about 11 KB for the
+// runtime; state added across frames belongs in `scratch_reserve`
+#ifdef COMPACT_MEMORY
+#define SCRATCH_SIZE (128 * 1024)
+#define MAX_FIELD_POINTS 128
+#else
+#define SCRATCH_SIZE (1024 * 1024)
+#define MAX_FIELD_POINTS 256
+#endif
+
 #define PIX_BUF_SIZE (N_PIXELS * 4)
 static uint8_t pix_buf[PIX_BUF_SIZE];
 _export uint8_t *get_pix_buf() { return pix_buf; }
@@ -37,280 +57,2116 @@ static inline float snoise3(float x, float y, float z);
 
 #ifdef TESTRUN
 #include <stdio.h>
-#define debug(...) printf(__VA_ARGS__)
+// Off for tests that run many frames
+static bool debug_on = true;
+#define debug(...) (debug_on ? printf(__VA_ARGS__) : 0)
 #else
 #define debug(...)
 #endif
 
+#if __EMSCRIPTEN__
+// Supplied by the page at instantiation, see `web_index.html`
+__attribute__((import_module("env"), import_name("now_ms"))) double now_ms();
+#else
+#include <time.h>
+static inline double now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+#endif
+
 static inline void normalize3(float *x, float *y, float *z)
 {
   float d = sqrtf(*x * *x + *y * *y + *z * *z);
   *x /= d; *y /= d; *z /= d;
 }
 
-static uint8_t jcv_myalloc_buf[131072 * 8];
-static size_t jcv_myalloc_ptr;
+// Scratch memory for a single stage of a frame. Stages take from it in order
+// and give back everything after their mark on return, so buffers of
+// stages that do not overlap in time share the same bytes.
+// Returns NULL, taking nothing, if `n` bytes do not fit; callers then do
+// without the stage (the compact build has no asserts to stop them).
+// State kept across frames is reserved off the top, below `scratch_end`
+static uint8_t scratch_buf[SCRATCH_SIZE] __attribute__((aligned(8)));
+static size_t scratch_ptr, scratch_peak, scratch_end = SCRATCH_SIZE;
+static int n_scratch_failures;
+static void *scratch_alloc(size_t n)
+{
+  size_t size = (n + 7) & ~(size_t)7;
+  if (size < n || size > scratch_end - scratch_ptr) {
+    n_scratch_failures++;
+    return NULL;
+  }
+  void *p = scratch_buf + scratch_ptr;
+  scratch_ptr += size;
+  if (scratch_peak < scratch_ptr) scratch_peak = scratch_ptr;
+  return p;
+}
+static inline size_t scratch_left() { return scratch_end - scratch_ptr; }
+// Takes `n` bytes off the top of the scratch space for good, or returns NULL
+static void *scratch_reserve(size_t n)
+{
+  size_t size = (n + 7) & ~(size_t)7;
+  if (size < n || size > scratch_end - scratch_ptr) return NULL;
+  scratch_end -= size;
+  return scratch_buf + scratch_end;
+}
+
 static void *jcv_myalloc(void *_unused, size_t n)
 {
-  void *p = jcv_myalloc_buf + jcv_myalloc_ptr;
+  (void)_unused;
+  void *p = scratch_alloc(n);
   debug("alloc %p %zu\n", p, n);
-  jcv_myalloc_ptr += n;
   return p;
 }
 static void jcv_myfree(void *_unused, void *p)
 {
+  (void)_unused, (void)p;
   debug("free  %p\n", p);
 }
 
+// Spans of row `y` covered by the polygon, as inclusive pairs [x_start, x_end]
+// Returns the number of spans, or -1 if there are too many crossings
+// http://alienryderflex.com/polygon_fill/
+#define MAX_CROSSINGS 36
+static int row_spans(const float *pt, int n, int w, int y, int16_t *spans)
+{
+  float xs[MAX_CROSSINGS];
+  int n_xs = 0;
+  float x1 = pt[(n - 1) * 2 + 0];
+  float y1 = pt[(n - 1) * 2 + 1];
+  for (int i = 0; i < n; i++) {
+    float x0 = pt[i * 2 + 0];
+    float y0 = pt[i * 2 + 1];
+    if ((y0 < y && y1 >= y) || (y1 < y && y0 >= y)) {
+      if (n_xs >= MAX_CROSSINGS) return -1;
+      xs[n_xs++] = x0 + (y - y0) / (y1 - y0) * (x1 - x0);
+    }
+    x1 = x0;
+    y1 = y0;
+  }
+  qsort(xs, n_xs, sizeof(float), cmp_float);
+  int n_spans = 0;
+  for (int i = 0; i < n_xs - 1; i += 2) {
+    if (xs[i] >= w) break;
+    if (xs[i + 1] >= 0) {
+      spans[n_spans * 2 + 0] = (xs[i] < 0 ? 0 : (int)(xs[i] + 0.5f));
+      spans[n_spans * 2 + 1] = (xs[i + 1] > w - 1 ? w - 1 : (int)(xs[i + 1] + 0.5f));
+      n_spans++;
+    }
+  }
+  return n_spans;
+}
+
+#define min(_a, _b) ((_a) < (_b) ? (_a) : (_b))
+#define max(_a, _b) ((_a) > (_b) ? (_a) : (_b))
+// Number of elements of array `_a`
+#define LENGTH(_a) ((int)(sizeof (_a) / sizeof (_a)[0]))
+
+// Pixel masks
+#ifdef COMPACT_MEMORY
+#define MASK_BYTES(_n) (((_n) + 7) / 8)
+#define MASK_BYTE_OF(_i) ((_i) >> 3)
+#define MASK_GET(_m, _i) (((_m)[(_i) >> 3] >> ((_i) & 7)) & 1)
+#define MASK_SET(_m, _i) ((_m)[(_i) >> 3] |= 1 << ((_i) & 7))
+#else
+#define MASK_BYTES(_n) (_n)
+#define MASK_BYTE_OF(_i) (_i)
+#define MASK_GET(_m, _i) ((_m)[_i])
+#define MASK_SET(_m, _i) ((_m)[_i] = 1)
+#endif
+
+// Interior mask
+static uint8_t M[MASK_BYTES(N_PIXELS)];
+// Height field
+static float F[N_PIXELS];
+// Indices of `F` between which it may be nonzero, so that only those are cleared
+static int F_dirty_lo = 0, F_dirty_hi = 0;
+
+// Voronoi edges can be clipped to the polygon itself while the diagram is generated,
+// keeping the parts of edges that are inside; otherwise edges are clipped to the
+// bounding box and only those with both ends in the mask are taken
+static bool clip_to_polygon = true;
+_export void set_polygon_clip(bool on) { clip_to_polygon = on; }
+// Only the global edge list of the diagram is read, so the per-site cells
+// need not be built
+static bool voronoi_edges_only = true;
+_export void set_voronoi_edges_only(bool on) { voronoi_edges_only = on; }
+// Pixels on the medial axis, and sites, scratch bytes and milliseconds taken by
+// the Voronoi diagram in the last field, for statistics
+static int n_axis_pixels, n_voronoi_sites, n_voronoi_bytes;
+static double voronoi_ms;
+
+typedef struct {
+  const float *pt;
+  int n;
+  const uint8_t *M;
+  int w, h;
+} ring_clip_ctx;
+
+// Even-odd rule
+static bool ring_contains(const float *pt, int n, float x, float y)
+{
+  bool inside = false;
+  float x1 = pt[(n - 1) * 2 + 0];
+  float y1 = pt[(n - 1) * 2 + 1];
+  for (int i = 0; i < n; i++) {
+    float x0 = pt[i * 2 + 0];
+    float y0 = pt[i * 2 + 1];
+    if (((y0 < y && y1 >= y) || (y1 < y && y0 >= y)) &&
+        x0 + (y - y0) / (y1 - y0) * (x1 - x0) < x)
+      inside = !inside;
+    x1 = x0;
+    y1 = y0;
+  }
+  return inside;
+}
+
+// Trims the edge to between its first entry into the ring and its last exit.
+// Returns 0 (with a zero-length edge, so that it is skipped) if nothing is inside
+static int ring_clip_edge(const jcv_clipper *clipper, jcv_edge *e)
+{
+  const ring_clip_ctx *ring = (const ring_clip_ctx *)clipper->ctx;
+  const float *pt = ring->pt;
+  int n = ring->n;
+
+  // Bisectors of neighbouring vertices cross the boundary between them;
+  // they are not part of the medial axis
+  int d = abs(e->sites[0]->index - e->sites[1]->index);
+  if (d == 1 || d == n - 1) goto reject;
+  if (!jcv_boxshape_clip(clipper, e)) goto reject;
+
+  // Most edges are well inside; only look for crossings if an end is not
+  #define INSIDE(_x, _y) \
+    ((_x) >= 0 && (_x) < ring->w && (_y) >= 0 && (_y) < ring->h && \
+     MASK_GET(ring->M, (int)(_y) * ring->w + (int)(_x)))
+  bool ends_inside = INSIDE(e->pos[0].x, e->pos[0].y) && INSIDE(e->pos[1].x, e->pos[1].y);
+  #undef INSIDE
+  if (ends_inside) return 1;
+
+  float px = e->pos[0].x, py = e->pos[0].y;
+  float dx = e->pos[1].x - px, dy = e->pos[1].y - py;
+  float t_first = 2, t_last = -1;
+  int n_crossings = 0;
+  float x1 = pt[(n - 1) * 2 + 0];
+  float y1 = pt[(n - 1) * 2 + 1];
+  for (int i = 0; i < n; i++) {
+    float x0 = pt[i * 2 + 0];
+    float y0 = pt[i * 2 + 1];
+    // Segment of the ring from (x1, y1) to (x0, y0), excluding (x0, y0)
+    float ex = x0 - x1, ey = y0 - y1;
+    float denom = dx * ey - dy * ex;
+    if (denom != 0) {
+      float ax = x1 - px, ay = y1 - py;
+      float t = (ax * ey - ay * ex) / denom;
+      float u = (ax * dy - ay * dx) / denom;
+      if (t >= 0 && t <= 1 && u >= 0 && u < 1) {
+        n_crossings++;
+        if (t_first > t) t_first = t;
+        if (t_last < t) t_last = t;
+      }
+    }
+    x1 = x0;
+    y1 = y0;
+  }
+
+  bool start_inside = ring_contains(pt, n, px, py);
+  bool end_inside = start_inside ^ (n_crossings & 1);
+  float t0 = (start_inside ? 0 : t_first);
+  float t1 = (end_inside ? 1 : t_last);
+  if (n_crossings == 0 && !start_inside) goto reject;
+  if (t0 >= t1) goto reject;
+  e->pos[0].x = px + dx * t0;
+  e->pos[0].y = py + dy * t0;
+  e->pos[1].x = px + dx * t1;
+  e->pos[1].y = py + dy * t1;
+  return 1;
+
+reject:
+  e->pos[1] = e->pos[0];
+  return 0;
+}
+
+// Squared distance from (x, y) to the two sides of the ring at vertex `i`
+static float ring_vertex_dist2(const float *pt, int n, int i, float x, float y)
+{
+  float d = INFINITY;
+  float x0 = pt[i * 2 + 0], y0 = pt[i * 2 + 1];
+  for (int k = 0; k < 2; k++) {
+    int j = (k == 0 ? (i + n - 1) % n : (i + 1) % n);
+    float ex = pt[j * 2 + 0] - x0, ey = pt[j * 2 + 1] - y0;
+    float ax = x - x0, ay = y - y0;
+    float l = ex * ex + ey * ey;
+    float t = (l > 0 ? (ax * ex + ay * ey) / l : 0);
+    if (t < 0) t = 0; else if (t > 1) t = 1;
+    ax -= ex * t;
+    ay -= ey * t;
+    d = min(d, ax * ax + ay * ay);
+  }
+  return d;
+}
+
+// When set, `highlight_splat` only traces the medial axis: it marks its pixels
+// here, one byte each, and leaves the squared radius there in `F` without
+// lifting the rest (see `shape_features`)
+static uint8_t *splat_axis = NULL;
+// When set, the sides from vertex `i` flagged here replace vertices taken out by
+// `decimate`, and are not split again (see `highlight_splat`)
+static const bool *splat_merged = NULL;
+
+// Bound on the scratch taken by the Voronoi diagram of `n` sites, as the
+// library does not check its allocations. A diagram has at most 3n edges and
+// 2n + 2 arcs on the beach line (arcs are reused once freed); without
+// `edges_only` each edge is finished into 2 graph edges, and with `fill_gaps`
+// the cells at the box are closed with an edge each, split at its corners
+// (taken as 2n + 8, for margin)
+static size_t voronoi_scratch_bound(int n, bool edges_only, bool fill_gaps)
+{
+  size_t fixed = sizeof(jcv_context_internal) + sizeof(jcv_priorityqueue) +
+    n * (sizeof(jcv_site) + 2 * sizeof(void *)) + 64;
+#ifdef JCV_BEACHLINE_HASH
+  fixed += (2 * (int)sqrtf(n) + 2) * sizeof(void *) + 8;
+#endif
+  size_t pad = sizeof(void *), gaps = (fill_gaps && !edges_only ? 2 * (size_t)n + 8 : 0);
+  size_t items =
+    (3 * (size_t)n + gaps) * (sizeof(jcv_edge) + pad) +
+    (2 * (size_t)n + 2) * (sizeof(jcv_halfedge) + pad) +
+    (edges_only ? 0 : 6 * (size_t)n + gaps) * (sizeof(jcv_graphedge) + pad);
+  // Blocks of 16 KiB, each of which may leave an item's worth unused
+  size_t block = 16 * 1024, usable = block - sizeof(jcv_memoryblock) - 2 * pad -
+    max(sizeof(jcv_edge), max(sizeof(jcv_halfedge), sizeof(jcv_graphedge)));
+  return ((fixed + 7) & ~(size_t)7) + (items / usable + 1) * block;
+}
+
+// Squared height field over the interior `M`, before the square root and the blur.
+// Each pixel is lifted onto the tallest sphere centred on the medial axis that covers it.
+// `pt` and `M` are in the field's own pixel grid (`w` x `h`). With `bbox` (x0, y0,
+// x1, y1, inclusive, covering the polygon), `F` must be zero on entry, and only
+// the rows of the box are gone over; otherwise all of `F` is cleared first
+static void highlight_splat(const float *pt, int n, int w, int h,
+  const uint8_t *M, float *F, const int *bbox)
+{
+  size_t scratch_mark = scratch_ptr;
+  // Medial axis deduplication
+  uint8_t *MA = scratch_alloc(MASK_BYTES(w * h));
+  int bx0 = 0, by0 = 0, bx1 = w - 1, by1 = h - 1;
+  n_axis_pixels = n_voronoi_sites = 0;
+  if (bbox != NULL) {
+    bx0 = bbox[0]; by0 = bbox[1];
+    bx1 = bbox[2]; by1 = bbox[3];
+  }
+
+  #define F(_x, _y) (F[(_x) + (_y) * w])
+  #define INSIDE(_x, _y) \
+    ((_x) >= 0 && (_x) < w && (_y) >= 0 && (_y) < h && \
+     MASK_GET(M, (int)(_y) * w + (int)(_x)))
+
+  if (bbox == NULL)
+    for (int y = 0; y < h; y++)
+      for (int x = 0; x < w; x++) F(x, y) = 0;
+  // Out of scratch, the field stays flat
+  if (MA == NULL) goto out_of_scratch;
+
+  // Radii are taken from the sites of each Voronoi edge and their two sides,
+  // which misses a long side passing between two far-away vertices. Long sides
+  // are split so that sites are at most `SITE_SPACING` apart, which bounds the
+  // error at the medial axis to spacing^2 / 8r, within the limit on sites.
+  // Sides left by decimation are not, as that would put its sites back
+  #define SITE_SPACING 8
+  #define SPLIT(_i) (splat_merged == NULL || !splat_merged[_i])
+  if (n < MAX_FIELD_POINTS) {
+    float perimeter = 0;
+    for (int i = 0; i < n; i++) {
+      int j = (i + 1) % n;
+      if (SPLIT(i))
+        perimeter += hypotf(pt[j * 2 + 0] - pt[i * 2 + 0], pt[j * 2 + 1] - pt[i * 2 + 1]);
+    }
+    float spacing = max(SITE_SPACING, perimeter / (MAX_FIELD_POINTS - n));
+    int n_dense = 0;
+    for (int i = 0; i < n; i++) {
+      int j = (i + 1) % n;
+      float len = hypotf(pt[j * 2 + 0] - pt[i * 2 + 0], pt[j * 2 + 1] - pt[i * 2 + 1]);
+      n_dense += (SPLIT(i) ? max(1, (int)ceilf(len / spacing)) : 1);
+    }
+    float *dense = (n_dense > n ? scratch_alloc(n_dense * 2 * sizeof(float)) : NULL);
+    if (dense != NULL) {
+      int k = 0;
+      for (int i = 0; i < n; i++) {
+        int j = (i + 1) % n;
+        float x0 = pt[i * 2 + 0], y0 = pt[i * 2 + 1];
+        float dx = pt[j * 2 + 0] - x0, dy = pt[j * 2 + 1] - y0;
+        int m = (SPLIT(i) ? max(1, (int)ceilf(hypotf(dx, dy) / spacing)) : 1);
+        for (int l = 0; l < m; l++) {
+          dense[k * 2 + 0] = x0 + dx * l / m;
+          dense[k * 2 + 1] = y0 + dy * l / m;
+          k++;
+        }
+      }
+      pt = dense;
+      n = n_dense;
+    }
+  }
+  #undef SPLIT
+  #undef SITE_SPACING
+  n_voronoi_sites = n;
+
+  // Medial axis from Voronoi diagram
+  if (by1 >= by0)
+    memset(MA + MASK_BYTE_OF(by0 * w), 0, MASK_BYTES((by1 + 1) * w) - MASK_BYTE_OF(by0 * w));
+  if (scratch_left() < voronoi_scratch_bound(n, voronoi_edges_only, !clip_to_polygon)) {
+    n_scratch_failures++;
+    goto out_of_scratch;
+  }
+
+  // Cells of the polygon's vertices are not needed, so there are no gaps to fill
+  ring_clip_ctx ring = {pt, n, M, w, h};
+  jcv_clipper clipper = {.test_fn = jcv_boxshape_test, .clip_fn = ring_clip_edge, .ctx = &ring};
+
+  static jcv_diagram diagram;
+  diagram = (jcv_diagram){0};
+  size_t voronoi_mark = scratch_ptr;
+  double voronoi_start = now_ms();
+  jcv_diagram_generate_useralloc_flags(
+    n, (const jcv_point *)pt, &(jcv_rect){{-10, -10}, {10 + w, 10 + h}},
+    clip_to_polygon ? &clipper : NULL,
+    NULL, jcv_myalloc, jcv_myfree,
+    voronoi_edges_only ? JCV_GENERATE_EDGES_ONLY : 0, &diagram);
+  n_voronoi_bytes = scratch_ptr - voronoi_mark;
+  voronoi_ms = now_ms() - voronoi_start;
+
+  // NOTE: Edge filtering can also be done in total O(n log n) time by
+  // building the node-edge graph of the Voronoi diagram and removing
+  // all vertices connected to the infinite vertices. See `backups/highlight_test/main.c`
+  // However as we already have the polygon's mask, we can just look it up!
+  for (const jcv_edge* edge = jcv_diagram_get_edges(&diagram);
+      edge != NULL;
+      edge = jcv_diagram_get_next_edge(edge)
+  ) {
+    float x1 = edge->pos[0].x, y1 = edge->pos[0].y;
+    float x2 = edge->pos[1].x, y2 = edge->pos[1].y;
+    // Border edges from gap filling have no second site
+    if (edge->sites[1] == NULL) continue;
+    int s0 = edge->sites[0]->index, s1 = edge->sites[1]->index;
+
+    if (clip_to_polygon || (INSIDE(x1, y1) && INSIDE(x2, y2))) {
+      // Trace line with Bresenham's Algorithm, working in fixed-point
+      const int SUBPX = 4;
+      int x1_fixed = (int)(x1 * (1 << SUBPX) + 0.5);
+      int y1_fixed = (int)(y1 * (1 << SUBPX) + 0.5);
+      int x2_fixed = (int)(x2 * (1 << SUBPX) + 0.5);
+      int y2_fixed = (int)(y2 * (1 << SUBPX) + 0.5);
+
+      int dx = abs(x2_fixed - x1_fixed);
+      int dy = abs(y2_fixed - y1_fixed);
+      int sx = (x2_fixed > x1_fixed) ? 1 : -1;
+      int sy = (y2_fixed > y1_fixed) ? 1 : -1;
+
+      int x = x1_fixed;
+      int y = y1_fixed;
+      int err = dx - dy;
+      while (1) {
+        int pixel_x = x >> SUBPX;
+        int pixel_y = y >> SUBPX;
+        if (pixel_x >= bx0 && pixel_x <= bx1 && pixel_y >= by0 && pixel_y <= by1) {
+          if (!MASK_GET(MA, pixel_y * w + pixel_x)) {
+            MASK_SET(MA, pixel_y * w + pixel_x);
+            n_axis_pixels++;
+            int x = pixel_x, y = pixel_y;   // Shorter names for clarity
+            // Radius of the inscribed circle. The two sites are the nearest
+            // vertices of the ring, as the centre lies on their bisector, but
+            // a side next to either of them can pass closer than both ends
+            float d = min(ring_vertex_dist2(pt, n, s0, x, y),
+                          ring_vertex_dist2(pt, n, s1, x, y));
+            debug("%d %d %.2f\n", pixel_x, pixel_y, d);
+            if (splat_axis != NULL) {
+              splat_axis[pixel_y * w + pixel_x] = 1;
+              F(x, y) = d;
+            } else {
+              // Update F in the bounding box, with current centre C(x, y)
+              // F(P) = max_C (sqrt(D(C)^2 - (P-C)^2))
+              int sqrtd = (int)sqrtf(d);
+              for (int py = y - sqrtd; py <= y + sqrtd; py++)
+              if (py >= 0 && py < h)
+                for (int px = x - sqrtd; px <= x + sqrtd; px++)
+                if (px >= 0 && px < w && INSIDE(px, py)) {
+                  float f = d - (px-x)*(px-x) - (py-y)*(py-y);
+                  if (F(px, py) < f) F(px, py) = f;
+                }
+            }
+          }
+        }
+        if (x == x2_fixed && y == y2_fixed) break;
+        int e2 = 2 * err;
+        if (e2 > -dy) { err -= dy; x += sx; }
+        if (e2 <  dx) { err += dx; y += sy; }
+      }
+    }
+  }
+
+  jcv_diagram_free(&diagram);
+out_of_scratch:
+  scratch_ptr = scratch_mark;
+
+  #undef F
+  #undef INSIDE
+}
+
+// 2-D Gaussian blur on F
+/*
+sigma = 1
+n = 3
+sum = 0
+for i = 0, 3 do
+  sum = sum + math.exp(-i * i / (2 * sigma * sigma)) * (i == 0 and 1 or 2)
+end
+for i = 0, 3 do
+  print(math.exp(-i * i / (2 * sigma * sigma)) / sum)
+end
+*/
+#define BLUR_0 0.399050279652450f
+#define BLUR_1 0.242036229376110f
+#define BLUR_2 0.054005582622414f
+
+// Horizontal blur of the row starting at `_f` at column `_x`, in a row of
+// `_w` pixels with zeros beyond; and away from the ends of the row
+#define BLUR_ROW_AT_END(_f, _x, _w) ( \
+  BLUR_0 * (_f)[_x] + \
+  BLUR_1 * (((_x) < 1 ? 0 : (_f)[(_x)-1]) + ((_x) >= (_w)-1 ? 0 : (_f)[(_x)+1])) + \
+  BLUR_2 * (((_x) < 2 ? 0 : (_f)[(_x)-2]) + ((_x) >= (_w)-2 ? 0 : (_f)[(_x)+2])))
+#define BLUR_ROW(_f, _x) ( \
+  BLUR_0 * (_f)[_x] + \
+  BLUR_1 * ((_f)[(_x)-1] + (_f)[(_x)+1]) + \
+  BLUR_2 * ((_f)[(_x)-2] + (_f)[(_x)+2]))
+
+// Blurs of the field for sigmas other than the game's, for textures rendered at
+// a higher scale, where the 5-tap kernel is too narrow and a direct one grows
+// with sigma. Sigma is in pixels of the field's grid, so a coarser level of
+// detail widens the blur on the texture, as it does with the 5-tap kernel
+enum {
+  BLUR_AUTO,      // By sigma
+  BLUR_DIRECT,    // The 5-tap kernel, at sigma 1 whatever `blur_sigma`
+  BLUR_IIR,       // Recursive Gaussian (Young, van Vliet & van Ginkel 2002)
+  BLUR_BOX,       // Three box passes (Kovesi 2010)
+};
+static float blur_sigma = 1;
+static int blur_kernel_setting = BLUR_AUTO;
+_export void set_blur_sigma(float sigma) { blur_sigma = max(sigma, 0.5f); }
+_export void set_blur_kernel(int kernel) { blur_kernel_setting = kernel; }
+
+// Chosen by mean error against the Gaussian (see the tests). From this sigma on,
+// three box passes come closer than the recursive filter, whose error grows with
+// sigma, at their worst and on average. Below it, how close they come depends on
+// how well their widths, odd integers, fit the sigma: their mean error is up to
+// 0.07% of the peak, against at most 0.06% for the recursive filter
+#define BLUR_BOX_SIGMA 3.25f
+
+static int blur_kernel()
+{
+  if (blur_kernel_setting != BLUR_AUTO) return blur_kernel_setting;
+  if (blur_sigma == 1) return BLUR_DIRECT;
+  return (blur_sigma < BLUR_BOX_SIGMA ? BLUR_IIR : BLUR_BOX);
+}
+
+// Columns taken at a time by the vertical passes, which go down and back up
+// (or three times down) a block while its rows are still in cache
+#define BLUR_BLOCK 16
+
+// Coefficients of the recursive Gaussian, for sigma >= 0.5:
+// out[n] = c[0] in[n] + c[1] out[n-1] + c[2] out[n-2] + c[3] out[n-3],
+// forwards and then backwards. The poles are those of Young & van Vliet (1995),
+// scaled so that the variance is exactly sigma^2; their own fit of the scale
+// comes out 10% to 17% wide
+static void iir_coeffs(float sigma, float c[4])
+{
+  const float m0 = 1.16680f, m1 = 1.10783f, m2 = 1.40586f;
+  float q = 1.31564f * (sqrtf(1 + 0.490811f * sigma * sigma) - 1);
+  float scale = (m0 + q) * (m1 * m1 + m2 * m2 + 2 * m1 * q + q * q);
+  c[1] = q * (2 * m0 * m1 + m1 * m1 + m2 * m2 + (2 * m0 + 4 * m1) * q + 3 * q * q) / scale;
+  c[2] = -q * q * (m0 + 2 * m1 + 3 * q) / scale;
+  c[3] = q * q * q / scale;
+  c[0] = m0 * (m1 * m1 + m2 * m2) / scale;
+}
+
+// In place, with zeros beyond the edges. Starting the backward pass from zero
+// is not quite that, but the field is zero around the bubble anyway
+static void blur_iir(float *F, int w, int h, float sigma)
+{
+  float c[4];
+  iir_coeffs(sigma, c);
+
+  for (int y = 0; y < h; y++) {
+    float *f = F + y * w;
+    float p1 = 0, p2 = 0, p3 = 0;
+    for (int x = 0; x < w; x++) {
+      float v = c[0] * f[x] + c[1] * p1 + c[2] * p2 + c[3] * p3;
+      p3 = p2; p2 = p1; p1 = f[x] = v;
+    }
+    p1 = p2 = p3 = 0;
+    for (int x = w - 1; x >= 0; x--) {
+      float v = c[0] * f[x] + c[1] * p1 + c[2] * p2 + c[3] * p3;
+      p3 = p2; p2 = p1; p1 = f[x] = v;
+    }
+  }
+
+  for (int x0 = 0; x0 < w; x0 += BLUR_BLOCK) {
+    int bw = min(BLUR_BLOCK, w - x0);
+    float p1[BLUR_BLOCK] = {0}, p2[BLUR_BLOCK] = {0}, p3[BLUR_BLOCK] = {0};
+    for (int y = 0; y < h; y++) {
+      float *f = F + y * w + x0;
+      for (int i = 0; i < bw; i++) {
+        float v = c[0] * f[i] + c[1] * p1[i] + c[2] * p2[i] + c[3] * p3[i];
+        p3[i] = p2[i]; p2[i] = p1[i]; p1[i] = f[i] = v;
+      }
+    }
+    for (int i = 0; i < bw; i++) p1[i] = p2[i] = p3[i] = 0;
+    for (int y = h - 1; y >= 0; y--) {
+      float *f = F + y * w + x0;
+      for (int i = 0; i < bw; i++) {
+        float v = c[0] * f[i] + c[1] * p1[i] + c[2] * p2[i] + c[3] * p3[i];
+        p3[i] = p2[i]; p2[i] = p1[i]; p1[i] = f[i] = v;
+      }
+    }
+  }
+}
+
+// Odd widths of three box passes whose cascade has a variance of sigma^2
+static void box_widths(float sigma, int widths[3])
+{
+  float var = 12 * sigma * sigma;
+  int wl = (int)sqrtf(var / 3 + 1);
+  if (wl % 2 == 0) wl--;
+  int m = (int)roundf((var - 3 * wl * wl - 12 * wl - 9) / (-4.f * wl - 4));
+  for (int i = 0; i < 3; i++) widths[i] = (i < m ? wl : wl + 2);
+}
+
+// Box of radius `r` over `n` values `stride` apart, `lanes` side by side
+// (contiguous), as a running sum with zeros beyond the ends
+static inline void box_pass(const float *in, float *out, int n, int stride, int lanes, int r)
+{
+  float s[BLUR_BLOCK] = {0};
+  float inv = 1.f / (2 * r + 1);
+  for (int k = 0; k < min(r, n); k++)
+    for (int i = 0; i < lanes; i++) s[i] += in[k * stride + i];
+  for (int k = 0; k < n; k++) {
+    if (k + r < n)
+      for (int i = 0; i < lanes; i++) s[i] += in[(k + r) * stride + i];
+    for (int i = 0; i < lanes; i++) out[k * stride + i] = s[i] * inv;
+    if (k - r >= 0)
+      for (int i = 0; i < lanes; i++) s[i] -= in[(k - r) * stride + i];
+  }
+}
+
+static void blur_box(float *F, int w, int h, float sigma)
+{
+  int widths[3];
+  box_widths(sigma, widths);
+
+  size_t scratch_mark = scratch_ptr;
+  float *a = scratch_alloc(max(w, BLUR_BLOCK * h) * sizeof(float));
+  float *b = scratch_alloc(max(w, BLUR_BLOCK * h) * sizeof(float));
+  if (a == NULL || b == NULL) {
+    // The recursive filter needs no scratch
+    scratch_ptr = scratch_mark;
+    blur_iir(F, w, h, sigma);
+    return;
+  }
+
+  for (int y = 0; y < h; y++) {
+    float *f = F + y * w;
+    box_pass(f, a, w, 1, 1, widths[0] / 2);
+    box_pass(a, b, w, 1, 1, widths[1] / 2);
+    box_pass(b, f, w, 1, 1, widths[2] / 2);
+  }
+
+  // A block of columns at a time, copied out so that the passes can run
+  // from one copy into the other
+  for (int x0 = 0; x0 < w; x0 += BLUR_BLOCK) {
+    int bw = min(BLUR_BLOCK, w - x0);
+    for (int y = 0; y < h; y++)
+      for (int i = 0; i < bw; i++) a[y * BLUR_BLOCK + i] = F[y * w + x0 + i];
+    box_pass(a, b, h, BLUR_BLOCK, bw, widths[0] / 2);
+    box_pass(b, a, h, BLUR_BLOCK, bw, widths[1] / 2);
+    box_pass(a, b, h, BLUR_BLOCK, bw, widths[2] / 2);
+    for (int y = 0; y < h; y++)
+      for (int i = 0; i < bw; i++) F[y * w + x0 + i] = b[y * BLUR_BLOCK + i];
+  }
+
+  scratch_ptr = scratch_mark;
+}
+
+// The 5-tap kernel, in place
+static void blur_direct(float *F, int w, int h)
+{
+  #define F(_x, _y) (F[(_x) + (_y) * w])
+
+  static float FF[MAX_SIDE];
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) FF[x] = BLUR_ROW_AT_END(&F(0, y), x, w);
+    for (int x = 0; x < w; x++) F(x, y) = FF[x];
+  }
+  for (int x = 0; x < w; x++) {
+    for (int y = 0; y < h; y++) {
+      FF[y] =
+        BLUR_0 * F(x, y) +
+        BLUR_1 * ((y < 1 ? 0 : F(x, y-1)) + (y >= h-1 ? 0 : F(x, y+1))) +
+        BLUR_2 * ((y < 2 ? 0 : F(x, y-2)) + (y >= h-2 ? 0 : F(x, y+2)));
+    }
+    for (int y = 0; y < h; y++) F(x, y) = FF[y];
+  }
+
+  #undef F
+}
+
+// Blurs the field `F` (`w` x `h`, after the square root) by `blur_sigma`
+static void blur_field(float *F, int w, int h)
+{
+  switch (blur_kernel()) {
+    case BLUR_IIR: blur_iir(F, w, h, blur_sigma); break;
+    case BLUR_BOX: blur_box(F, w, h, blur_sigma); break;
+    default: blur_direct(F, w, h);
+  }
+}
+
+// Height field over the interior `M`, blurred
+static void highlight_field(const float *pt, int n, int w, int h,
+  const uint8_t *M, float *F)
+{
+  #define F(_x, _y) (F[(_x) + (_y) * w])
+
+  highlight_splat(pt, n, w, h, M, F, NULL);
+
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) F(x, y) = sqrtf(F(x, y));
+
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) debug("%5.1f", F(x, y));
+    debug("\n");
+  }
+
+  blur_field(F, w, h);
+
+  #undef F
+}
+
+// Computes the field at 1/s resolution (low-resolution pixel X covers
+// full-resolution pixels sX .. sX+s-1) and upsamples it bilinearly into `F`.
+// Returns false if the polygon cannot be filled
+static bool highlight_field_lod(int s, int w, int h, const float *pt, int n)
+{
+  int wl = (w + s - 1) / s, hl = (h + s - 1) / s;
+
+  // Reduced-resolution field, and the polygon and mask it is computed from
+  size_t scratch_mark = scratch_ptr;
+  float *Flo = scratch_alloc(wl * hl * sizeof(float));
+  uint8_t *Mlo = scratch_alloc(MASK_BYTES(wl * hl));
+  float *pt_lo = scratch_alloc(n * 2 * sizeof(float));
+  if (Flo == NULL || Mlo == NULL || pt_lo == NULL) { scratch_ptr = scratch_mark; return false; }
+
+  for (int i = 0; i < n * 2; i++) pt_lo[i] = (pt[i] - (s - 1) * 0.5f) / s;
+
+  int16_t spans[MAX_CROSSINGS];
+  for (int i = 0; i < MASK_BYTES(wl * hl); i++) Mlo[i] = 0;
+  for (int y = 0; y < hl; y++) {
+    int n_spans = row_spans(pt_lo, n, wl, y, spans);
+    if (n_spans < 0) { scratch_ptr = scratch_mark; return false; }
+    for (int i = 0; i < n_spans; i++)
+      for (int x = spans[i * 2]; x <= spans[i * 2 + 1]; x++) MASK_SET(Mlo, y * wl + x);
+  }
+
+  highlight_field(pt_lo, n, wl, hl, Mlo, Flo);
+
+  // Heights are lengths, so they scale with the grid as well
+  static int x0s[MAX_SIDE];
+  static float txs[MAX_SIDE];
+  for (int x = 0; x < w; x++) {
+    float fx = (x - (s - 1) * 0.5f) / s;
+    if (fx < 0) fx = 0;
+    int x0 = (int)fx;
+    if (x0 > wl - 2) x0 = wl - 2;
+    x0s[x] = x0;
+    txs[x] = fx - x0;
+  }
+  for (int y = 0; y < h; y++) {
+    float fy = (y - (s - 1) * 0.5f) / s;
+    if (fy < 0) fy = 0;
+    int y0 = (int)fy;
+    if (y0 > hl - 2) y0 = hl - 2;
+    float ty = fy - y0;
+    const float *r0 = Flo + y0 * wl, *r1 = r0 + wl;
+    for (int x = 0; x < w; x++) {
+      int x0 = x0s[x];
+      float tx = txs[x];
+      float a = r0[x0] + (r0[x0 + 1] - r0[x0]) * tx;
+      float b = r1[x0] + (r1[x0 + 1] - r1[x0]) * tx;
+      F[y * w + x] = s * (a + (b - a) * ty);
+    }
+  }
+
+  scratch_ptr = scratch_mark;
+  return true;
+}
+
+// Level of detail of the highlight field: 1, 2 or 4 times coarser than the texture,
+// or 0 to choose by bubble area. The field is smooth and grows with the bubble,
+// so large bubbles lose little on a coarser grid
+static int lod_setting = 0;
+static int lod_last = 1;
+_export void set_highlight_lod(int lod) { lod_setting = lod; }
+_export int get_highlight_lod() { return lod_last; }
+#define LOD_AREA_HALF     4000
+#define LOD_AREA_QUARTER 16000
+
+// Quality tiers, from best to cheapest
+enum {
+  TIER_FULL,      // Field at full resolution
+  TIER_HALF,      // Field at half resolution
+  TIER_QUARTER,   // Field at quarter resolution
+  TIER_CACHED,    // Last field, moved along with the bubble
+  TIER_FLAT,      // No highlight
+  N_TIERS
+};
+
+// Time budget for a frame in milliseconds; 0 to always follow the level of detail.
+// Each tier's cost after the fill is tracked per interior pixel from the frames that
+// used it, and the best tier predicted to fit is taken
+static float budget = 0;
+static int tier_last = TIER_FULL;
+static float tier_cost[N_TIERS];  // Milliseconds per interior pixel, moving average
+// Only the tier taken is measured, so one slow frame (a pause of the collector, a
+// tab in the background) would keep the better tiers out for good. Every so many
+// frames the next better one is tried, and its cost is taken afresh from that frame
+#define TIER_PROBE_FRAMES 120
+static int tier_probe_in = TIER_PROBE_FRAMES;
+static bool tier_probing = false;
+_export void set_frame_budget(float ms) { budget = ms; }
+_export int get_last_tier() { return tier_last; }
+
+// The cached field is only reused for a few frames before the shape drifts too far
+#define CACHED_MAX_FRAMES 8
+static int field_w, field_h, field_age = -1;
+static float field_cx, field_cy;
+
+// Moves the field in `F` by whole pixels, filling in zeros
+static void translate_field(int w, int h, int dx, int dy)
+{
+  if (dx <= -w || dx >= w || dy <= -h || dy >= h) {
+    for (int i = 0; i < w * h; i++) F[i] = 0;
+    return;
+  }
+  int xs = (dx > 0 ? 0 : -dx), xd = (dx > 0 ? dx : 0), len = w - abs(dx);
+  for (int k = 0; k < h; k++) {
+    // Rows are visited away from the direction of movement so sources are read first
+    int y = (dy > 0 ? h - 1 - k : k);
+    float *row = F + y * w;
+    if (y - dy < 0 || y - dy >= h) {
+      for (int x = 0; x < w; x++) row[x] = 0;
+      continue;
+    }
+    memmove(row + xd, F + (y - dy) * w + xs, len * sizeof(float));
+    for (int x = 0; x < xd; x++) row[x] = 0;
+    for (int x = xd + len; x < w; x++) row[x] = 0;
+  }
+}
+
+static int choose_tier(int area, int w, int h, double spent)
+{
+  int lod = lod_setting;
+  if (lod == 0)
+    lod = (area >= LOD_AREA_QUARTER ? 4 : area >= LOD_AREA_HALF ? 2 : 1);
+  int tier = (lod == 4 ? TIER_QUARTER : lod == 2 ? TIER_HALF : TIER_FULL);
+  if (budget <= 0) return tier;
+
+  bool cached_valid = (field_age >= 0 && field_age < CACHED_MAX_FRAMES &&
+    field_w == w && field_h == h);
+  // Start from full resolution even when the level of detail would not;
+  // the budget decides here
+  for (tier = TIER_FULL; tier < TIER_FLAT; tier++) {
+    if (tier == TIER_CACHED && !cached_valid) continue;
+    if (spent + tier_cost[tier] * area <= budget) break;
+  }
+  if (--tier_probe_in <= 0) {
+    tier_probe_in = TIER_PROBE_FRAMES;
+    if (tier > TIER_FULL) {
+      tier--;
+      if (tier == TIER_CACHED && !cached_valid) tier--;
+      tier_probing = true;
+    }
+  }
+  return tier;
+}
+
+// Polygon decimation (Visvalingam–Whyatt). Vertices are removed in order of
+// their distance to the chord between their neighbours, while it is below the
+// tolerance in pixels; 0 disables. To keep the medial axis from jumping between
+// frames, a vertex kept in the last frame counts as twice as far from its chord
+static float decimate_tol = 0;
+_export void set_decimation(float tol) { decimate_tol = tol; }
+
+#define MAX_POINTS (PT_BUF_SIZE / 2)
+static float pt_dec[PT_BUF_SIZE];
+static int dec_n_last;
+static bool dec_kept[MAX_POINTS];
+// Whether the side from each vertex of `pt_dec` replaces vertices taken out
+static bool dec_merged[MAX_POINTS];
+static int dec_prev[MAX_POINTS], dec_next[MAX_POINTS];
+static float dec_cost[MAX_POINTS];
+// Binary min-heap of vertices by cost, with each vertex's position in it
+static int dec_heap[MAX_POINTS], dec_pos[MAX_POINTS], dec_heap_n;
+
+static float dec_vertex_cost(const float *pt, int i)
+{
+  float x0 = pt[dec_prev[i] * 2 + 0], y0 = pt[dec_prev[i] * 2 + 1];
+  float x1 = pt[i * 2 + 0], y1 = pt[i * 2 + 1];
+  float x2 = pt[dec_next[i] * 2 + 0], y2 = pt[dec_next[i] * 2 + 1];
+  float cross = fabsf((x1 - x0) * (y2 - y0) - (x2 - x0) * (y1 - y0));
+  float chord = sqrtf((x2 - x0) * (x2 - x0) + (y2 - y0) * (y2 - y0));
+  float d = (chord > 1e-6f ? cross / chord : 0);
+  return dec_kept[i] ? d * 2 : d;
+}
+
+static void dec_heap_swap(int a, int b)
+{
+  int t = dec_heap[a]; dec_heap[a] = dec_heap[b]; dec_heap[b] = t;
+  dec_pos[dec_heap[a]] = a;
+  dec_pos[dec_heap[b]] = b;
+}
+static void dec_heap_fix(int k)
+{
+  while (k > 0 && dec_cost[dec_heap[k]] < dec_cost[dec_heap[(k - 1) / 2]]) {
+    dec_heap_swap(k, (k - 1) / 2);
+    k = (k - 1) / 2;
+  }
+  while (1) {
+    int l = k * 2 + 1, r = l + 1, m = k;
+    if (l < dec_heap_n && dec_cost[dec_heap[l]] < dec_cost[dec_heap[m]]) m = l;
+    if (r < dec_heap_n && dec_cost[dec_heap[r]] < dec_cost[dec_heap[m]]) m = r;
+    if (m == k) break;
+    dec_heap_swap(k, m);
+    k = m;
+  }
+}
+
+// Writes the decimated ring of `pt` into `pt_dec` and returns its length
+static int decimate(const float *pt, int n, float tol)
+{
+  if (n != dec_n_last) {
+    for (int i = 0; i < n; i++) dec_kept[i] = false;
+    dec_n_last = n;
+  }
+
+  for (int i = 0; i < n; i++) {
+    dec_prev[i] = (i + n - 1) % n;
+    dec_next[i] = (i + 1) % n;
+  }
+  dec_heap_n = n;
+  for (int i = 0; i < n; i++) {
+    dec_cost[i] = dec_vertex_cost(pt, i);
+    dec_heap[i] = i;
+    dec_pos[i] = i;
+  }
+  for (int k = n / 2 - 1; k >= 0; k--) dec_heap_fix(k);
+
+  int m = n;
+  while (m > 4 && dec_cost[dec_heap[0]] < tol) {
+    int i = dec_heap[0];
+    dec_heap_swap(0, --dec_heap_n);
+    dec_heap_fix(0);
+    dec_pos[i] = -1;
+    m--;
+
+    int a = dec_prev[i], b = dec_next[i];
+    dec_next[a] = b;
+    dec_prev[b] = a;
+    dec_cost[a] = dec_vertex_cost(pt, a);
+    dec_heap_fix(dec_pos[a]);
+    dec_cost[b] = dec_vertex_cost(pt, b);
+    dec_heap_fix(dec_pos[b]);
+  }
+
+  int k = 0;
+  for (int i = 0; i < n; i++) {
+    dec_kept[i] = (dec_pos[i] >= 0);
+    if (dec_kept[i]) {
+      pt_dec[k * 2 + 0] = pt[i * 2 + 0];
+      pt_dec[k * 2 + 1] = pt[i * 2 + 1];
+      dec_merged[k] = (dec_next[i] != (i + 1) % n);
+      k++;
+    }
+  }
+  return k;
+}
+
+// Previous record for smoothing and hysteresis
+#ifdef COMPACT_MEMORY
+// Quantized to 1/127; levels are 2 bits each
+static int8_t Clast[N_PIXELS];
+static uint8_t Hlast[N_PIXELS / 4];
+static inline float clast_get(int i) { return Clast[i] * (1.f / 127); }
+static inline void clast_set(int i, float c)
+{
+  Clast[i] = (int8_t)(c * 127 + (c < 0 ? -0.5f : 0.5f));
+}
+static inline int hlast_get(int i) { return (Hlast[i >> 2] >> ((i & 3) * 2)) & 3; }
+static inline void hlast_set(int i, int h)
+{
+  Hlast[i >> 2] = (Hlast[i >> 2] & ~(3 << ((i & 3) * 2))) | (h << ((i & 3) * 2));
+}
+#else
+static float Clast[N_PIXELS];
+static unsigned char Hlast[N_PIXELS];
+static inline float clast_get(int i) { return Clast[i]; }
+static inline void clast_set(int i, float c) { Clast[i] = c; }
+static inline int hlast_get(int i) { return Hlast[i]; }
+static inline void hlast_set(int i, int h) { Hlast[i] = h; }
+#endif
+// Spans of each row when it was last lit, after their number. Lighting goes
+// over these and the current ones: a pixel's record decays on its first frame
+// outside the bubble, where its level settles, and is then left as it is until
+// the bubble is back. Reserved in the scratch space, as the compact build has
+// no room for them beside it; until they are, whole rows are lit
+static int16_t (*light_spans)[1 + MAX_CROSSINGS];
+static int light_w, light_h;
+static void clear_light_records()
+{
+  memset(Clast, 0, sizeof Clast);
+  memset(Hlast, 0, sizeof Hlast);
+  if (light_spans == NULL) light_spans = scratch_reserve(MAX_SIDE * sizeof light_spans[0]);
+  if (light_spans != NULL)
+    for (int y = 0; y < MAX_SIDE; y++) light_spans[y][0] = 0;
+}
+_export void reset_highlight()
+{
+  clear_light_records();
+  dec_n_last = 0;
+}
+
+// Row-streaming pipeline: the texture fill, square root, blur and lighting are done
+// a few rows apart in one sweep, so each row is produced and consumed while still in
+// cache. The full-frame path makes one pass over the whole frame per stage.
+// Both produce identical textures
+static bool fused = true;
+_export void set_fused_pipeline(bool on) { fused = on; }
+
+// Outline stroke width in pixels
+static float outline_width = 1;
+_export void set_outline_width(float width) { outline_width = width; }
+// Curve samples taken by the last outline, for statistics
+static int n_outline_samples;
+
+// Longest step along the curve between samples, in pixels. Coverage is taken
+// from the distance to the polyline through the samples, so longer steps
+// leave no gaps, but cut corners by up to step^2 / 8r on a curve of radius r
+#define OUTLINE_STEP 1.5f
+
+// Coordinate and its derivative on the uniform Catmull-Rom span from p1 to p2 at
+// s in [0, 1], the same curve as `CatmullRomSpline` in `scene_game.lua` with its
+// evenly spaced knots
+static inline float catmull_rom(float p0, float p1, float p2, float p3, float s, float *dv)
+{
+  float b = p2 - p0;
+  float c = 2 * p0 - 5 * p1 + 4 * p2 - p3;
+  float d = -p0 + 3 * p1 - 3 * p2 + p3;
+  *dv = 0.5f * (b + s * (2 * c + s * 3 * d));
+  return 0.5f * (2 * p1 + s * (b + s * (c + s * d)));
+}
+
+// Coverage of a stroke of half width `hw` along the segment, kept as the maximum
+// over segments so that joints are not blended twice
+static void stroke_segment(uint8_t *cov, int w, int h, float hw,
+  float x0, float y0, float x1, float y1, int *bbox)
+{
+  int xmin = max(0, (int)floorf(min(x0, x1) - hw - 0.5f));
+  int xmax = min(w - 1, (int)ceilf(max(x0, x1) + hw + 0.5f));
+  int ymin = max(0, (int)floorf(min(y0, y1) - hw - 0.5f));
+  int ymax = min(h - 1, (int)ceilf(max(y0, y1) + hw + 0.5f));
+  if (xmin > xmax || ymin > ymax) return;
+  bbox[0] = min(bbox[0], xmin);
+  bbox[1] = min(bbox[1], ymin);
+  bbox[2] = max(bbox[2], xmax);
+  bbox[3] = max(bbox[3], ymax);
+
+  float ex = x1 - x0, ey = y1 - y0;
+  float l = ex * ex + ey * ey;
+  for (int y = ymin; y <= ymax; y++)
+    for (int x = xmin; x <= xmax; x++) {
+      // Pixel centres are on integer coordinates, as in `row_spans`
+      float ax = x - x0, ay = y - y0;
+      float t = (l > 0 ? (ax * ex + ay * ey) / l : 0);
+      if (t < 0) t = 0; else if (t > 1) t = 1;
+      ax -= ex * t;
+      ay -= ey * t;
+      float c = hw + 0.5f - sqrtf(ax * ax + ay * ay);
+      if (c <= 0) continue;
+      uint8_t v = (c >= 1 ? 255 : (uint8_t)(c * 255 + 0.5f));
+      if (cov[y * w + x] < v) cov[y * w + x] = v;
+    }
+}
+
+// Coverage of the stroke along the closed Catmull-Rom curve through `pt`, into `cov`
+// (`w` x `h`, cleared). `bbox` receives the pixels touched as x0, y0, x1, y1
+static void outline_coverage(const float *pt, int n, int w, int h, float width,
+  uint8_t *cov, int *bbox)
+{
+  bbox[0] = w;
+  bbox[1] = h;
+  bbox[2] = bbox[3] = -1;
+  n_outline_samples = 0;
+  if (n < 2) return;
+  float hw = width / 2;
+
+  for (int i = 0; i < n; i++) {
+    const float *p0 = &pt[((i + n - 1) % n) * 2];
+    const float *p1 = &pt[i * 2];
+    const float *p2 = &pt[((i + 1) % n) * 2];
+    const float *p3 = &pt[((i + 2) % n) * 2];
+    #define SPAN_X(_s, _dv) catmull_rom(p0[0], p1[0], p2[0], p3[0], (_s), (_dv))
+    #define SPAN_Y(_s, _dv) catmull_rom(p0[1], p1[1], p2[1], p3[1], (_s), (_dv))
+    // Step by arc length, estimated from the tangent at the start of each step
+    float dx, dy;
+    float x0 = SPAN_X(0, &dx), y0 = SPAN_Y(0, &dy);
+    float s = 0;
+    while (s < 1) {
+      float speed = sqrtf(dx * dx + dy * dy);
+      s = (speed * (1 - s) <= OUTLINE_STEP ? 1 : s + OUTLINE_STEP / speed);
+      float x1 = SPAN_X(s, &dx), y1 = SPAN_Y(s, &dy);
+      stroke_segment(cov, w, h, hw, x0, y0, x1, y1, bbox);
+      n_outline_samples++;
+      x0 = x1;
+      y0 = y1;
+    }
+    #undef SPAN_X
+    #undef SPAN_Y
+  }
+}
+
+// Composites the stroke over columns `x0` to `x1` of row `y` of the texture
+// `pix` (usually `pix_buf`), source-over with straight alpha
+static inline void outline_row(uint8_t *pix, int y, int w, int x0, int x1,
+  const uint8_t *cov, float r, float g, float b)
+{
+  for (int x = x0; x <= x1; x++) {
+    int c = cov[y * w + x];
+    if (c == 0) continue;
+    uint8_t *p = &pix[(y * w + x) * 4];
+    if (c == 255) {
+      p[0] = (int)(r * 255);
+      p[1] = (int)(g * 255);
+      p[2] = (int)(b * 255);
+      p[3] = 255;
+      continue;
+    }
+    float a = c / 255.0f;
+    float da = p[3] / 255.0f * (1 - a);
+    float oa = a + da;
+    p[0] = (int)((r * 255 * a + p[0] * da) / oa + 0.5f);
+    p[1] = (int)((g * 255 * a + p[1] * da) / oa + 0.5f);
+    p[2] = (int)((b * 255 * a + p[2] * da) / oa + 0.5f);
+    p[3] = (int)(oa * 255 + 0.5f);
+  }
+}
+
+// Anti-aliased stroke of the closed Catmull-Rom curve through the points,
+// composited over the texture in `pix_buf`
+_export void rasterize_outline(int w, int h, int n,
+  float r, float g, float b)
+{
+  size_t scratch_mark = scratch_ptr;
+  uint8_t *cov = scratch_alloc(w * h);
+  if (cov == NULL) return;
+  memset(cov, 0, w * h);
+  int bbox[4];
+  outline_coverage(pt_buf, n, w, h, outline_width, cov, bbox);
+  for (int y = bbox[1]; y <= bbox[3]; y++)
+    outline_row(pix_buf, y, w, bbox[0], bbox[2], cov, r, g, b);
+  scratch_ptr = scratch_mark;
+}
+
+// Stroke width of an outline drawn by `rasterize_fill` itself, composited onto
+// each row as soon as it is lit, so that the texture is not walked again and
+// the web build saves a call and a copy of the texture; 0 to leave it to
+// `rasterize_outline`
+static float fill_outline_width = 0;
+_export void set_fill_outline(float width) { fill_outline_width = width; }
+// Coverage of that stroke and its bounding box, while the fill is drawn
+static const uint8_t *fill_cov;
+static int fill_cov_bbox[4];
+
+// Number of polygon vertices after decimation in the last frame
+static int n_sites_last;
+_export int get_last_sites() { return n_sites_last; }
+
+// Spans of each row of the texture, from the mask pass, and their bounding box
+// (x0, y0, x1, y1, inclusive; x1 < x0 if there are none). The stages after the
+// mask pass go over these and leave the rest of the texture alone
+static int16_t row_spans_buf[MAX_SIDE][MAX_CROSSINGS];
+static int row_n_spans[MAX_SIDE];
+static int span_bbox[4];
+
+// The row stages below are inlined into the sweeps that call them per row
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+// Clears row `y` of the texture and fills the polygon's spans on it
+static ALWAYS_INLINE void fill_row(int y, int w,
+  float r, float g, float b, float opacity, int t)
+{
+  uint8_t *row = pix_buf + y * w * 4;
+  memset(row, 0, w * 4);
+  for (int i = 0; i < row_n_spans[y]; i++) {
+    int x_start = row_spans_buf[y][i * 2], x_end = row_spans_buf[y][i * 2 + 1];
+    for (int x = x_start; x <= x_end; x++) {
+      float a = opacity * (0.85f + 0.15f * snoise3(x / 100.f, t / 720.f, y / 100.f));
+      row[x * 4 + 0] = (int)(r * 255);
+      row[x * 4 + 1] = (int)(g * 255);
+      row[x * 4 + 2] = (int)(b * 255);
+      row[x * 4 + 3] = (int)(a * 255);
+    }
+  }
+}
+
+// Lights pixels `x0` to `x1` of row `y` (1 <= y < h - 1) of the texture from the
+// blurred field in `F`, which must be final on rows `y - 1` to `y + 1`
+static ALWAYS_INLINE void light_pixels(int y, int w, int x0, int x1, float opacity)
+{
+  const float *fu = F + (y - 1) * w, *fc = F + y * w, *fd = F + (y + 1) * w;
+  uint8_t *row = pix_buf + y * w * 4;
+
+  for (int x = x0; x <= x1; x++) {
+    bool inside = MASK_GET(M, x + y * w);
+    // Exterior parts are not lit, but their last record still decays
+    float c = 0;
+    if (inside) {
+      // Normal vector
+      float gx = (
+        (fu[x+1] + 2 * fc[x+1] + fd[x+1]) -
+        (fu[x-1] + 2 * fc[x-1] + fd[x-1])
+      ) / 4;
+      float gy = (
+        (fd[x-1] + 2 * fd[x] + fd[x+1]) -
+        (fu[x-1] + 2 * fu[x] + fu[x+1])
+      ) / 4;
+      float nz = 1. / sqrtf(gx * gx + gy * gy + 1);
+      float nx = -gx * nz, ny = -gy * nz;
+
+      // Blinn-Phong specular lighting
+      // Light at (-N, -N, 0.35 N), viewer at (0, 0, N) where N is very large
+      /*
+        local normalize = function (x, y, z)
+          local d = math.sqrt(x*x + y*y + z*z)
+          return x/d, y/d, z/d
+        end
+        lx, ly, lz = normalize(-1, -1, 0.35)
+        vx, vy, vz = normalize( 0,  0, 1)
+        hx, hy, hz = normalize(lx+vx, ly+vy, lz+vz)
+        print(hx, hy, hz)
+      */
+      // c = h · n
+      c = (nx + ny) * -0.43582124257856f + 0.78747678634646f * nz;
+    }
+
+    // Debug inspection
+    debug("%2c", inside ? (c > 0.95f ? '#' : '*') : '.');   // Highlight
+
+    // Smooth
+    float clast = clast_get(x + y * w);
+    c = c + (clast - c) * 0.75f;
+    clast_set(x + y * w, c);
+    // Level 2  ↑0.95 ↓0.90
+    // Level 1  ↑0.85 ↓0.80
+    int h = hlast_get(x + y * w);
+    if (h < 1 && c >= 0.01f) h = 1;
+    if (h < 2 && c >= 0.95f) h = 2;
+    if (h >= 2 && c < 0.94f) h = 1;
+    if (h >= 1 && c < 0.00f) h = 0;
+    hlast_set(x + y * w, h);
+    uint8_t *px = row + x * 4;
+    if (h == 2) {
+      px[0] = 255 - ((255 - px[0]) * 10 / 16);
+      px[1] = 255 - ((255 - px[1]) * 10 / 16);
+      px[2] = 255 - ((255 - px[2]) * 10 / 16);
+      px[3] = 255 - (int)((1 - opacity) * 0.5f * 255);
+    } else if (h == 1) {
+      px[0] = 255 - ((255 - px[0]) * 14 / 16);
+      px[1] = 255 - ((255 - px[1]) * 14 / 16);
+      px[2] = 255 - ((255 - px[2]) * 14 / 16);
+    }
+  }
+}
+
+// Lights row `y` (1 <= y < h - 1) over the union of its spans now and when it
+// was last lit (see `light_spans`), which then become the latter
+static ALWAYS_INLINE void light_row(int y, int w, float opacity)
+{
+  if (light_spans == NULL) {
+    light_pixels(y, w, 1, w - 2, opacity);
+    debug("\n");
+    return;
+  }
+  const int16_t *cur = row_spans_buf[y], *last = light_spans[y] + 1;
+  int n_cur = row_n_spans[y], n_last = light_spans[y][0];
+  // Both lists are in order; take the next span from either, and merge those
+  // that overlap or touch
+  int i = 0, j = 0, x_printed = 1;
+  while (i < n_cur || j < n_last) {
+    const int16_t *s = (j >= n_last || (i < n_cur && cur[i * 2] <= last[j * 2]) ?
+      &cur[i++ * 2] : &last[j++ * 2]);
+    int x0 = s[0], x1 = s[1];
+    while (1) {
+      if (i < n_cur && cur[i * 2] <= x1 + 1) {
+        x1 = max(x1, cur[i * 2 + 1]);
+        i++;
+      } else if (j < n_last && last[j * 2] <= x1 + 1) {
+        x1 = max(x1, last[j * 2 + 1]);
+        j++;
+      } else break;
+    }
+    x0 = max(x0, 1);
+    x1 = min(x1, w - 2);
+    for (; x_printed < x0; x_printed++) debug("%2c", '.');
+    if (x0 <= x1) {
+      light_pixels(y, w, x0, x1, opacity);
+      x_printed = x1 + 1;
+    }
+  }
+  for (; x_printed < w - 1; x_printed++) debug("%2c", '.');
+  debug("\n");
+  memcpy(light_spans[y] + 1, cur, n_cur * 2 * sizeof(int16_t));
+  light_spans[y][0] = n_cur;
+}
+
+// Lights row `y` if there is a field, then strokes the fill's own outline over it
+static ALWAYS_INLINE void finish_row(int y, int w, int h, bool lit,
+  float r, float g, float b, float opacity)
+{
+  if (lit && y >= 1 && y < h - 1) light_row(y, w, opacity);
+  if (fill_cov != NULL && y >= fill_cov_bbox[1] && y <= fill_cov_bbox[3])
+    outline_row(pix_buf, y, w, fill_cov_bbox[0], fill_cov_bbox[2], fill_cov, r, g, b);
+}
+
+// Horizontal blur of row `f` into `rr` at columns `a` to `b`
+static ALWAYS_INLINE void blur_row_span(const float *f, float *rr, int w, int a, int b)
+{
+  // The ends of the row, then the middle without bounds checks
+  int m0 = max(a, min(2, b + 1)), m1 = max(m0, min(b + 1, w - 2));
+  for (int x = a; x < m0; x++) rr[x] = BLUR_ROW_AT_END(f, x, w);
+  for (int x = m0; x < m1; x++) rr[x] = BLUR_ROW(f, x);
+  for (int x = m1; x <= b; x++) rr[x] = BLUR_ROW_AT_END(f, x, w);
+}
+
+// One sweep over the rows. At step k, row k of the squared field is rooted and
+// blurred horizontally into a ring of 5 rows, row k - 2 is blurred vertically from
+// the ring back into `F`, and row k - 3 is filled and lit.
+// Without `blur`, `F` is taken as already final. With it, the squared field
+// must be zero outside the spans, and only the spans and the 2 pixels around
+// them are blurred, as the rest of the field stays zero
+static void stream_rows(int w, int h, bool blur,
+  float r, float g, float b, float opacity, int t)
+{
+  size_t scratch_mark = scratch_ptr;
+  float *ring = scratch_alloc(5 * w * sizeof(float));
+  // Stands in for the ring's rows outside the spans
+  float *zero = scratch_alloc(w * sizeof(float));
+  if (ring == NULL || zero == NULL) {
+    // Out of scratch: the fill without the highlight
+    for (int y = 0; y < h; y++) {
+      fill_row(y, w, r, g, b, opacity, t);
+      finish_row(y, w, h, false, r, g, b, opacity);
+    }
+    scratch_ptr = scratch_mark;
+    return;
+  }
+  memset(ring, 0, 5 * w * sizeof(float));
+  memset(zero, 0, w * sizeof(float));
+  // Columns written on each of the ring's rows, which are zero elsewhere
+  int ring_x0[5] = {w, w, w, w, w}, ring_x1[5] = {-1, -1, -1, -1, -1};
+  #define IN_SPANS(_y) ((_y) >= span_bbox[1] && (_y) <= span_bbox[3])
+  #define R(_y) (!IN_SPANS(_y) ? zero : ring + (_y) % 5 * w)
+
+  for (int k = 0; k < h + 3; k++) {
+    if (blur && IN_SPANS(k)) {
+      int y = k;
+      float *f = F + y * w, *rr = R(y);
+      const int16_t *spans = row_spans_buf[y];
+      int n_spans = row_n_spans[y];
+      int *rx0 = &ring_x0[y % 5], *rx1 = &ring_x1[y % 5];
+      if (*rx0 <= *rx1) memset(rr + *rx0, 0, (*rx1 - *rx0 + 1) * sizeof(float));
+      *rx0 = w;
+      *rx1 = -1;
+      // Adjacent spans may share a pixel, which is rooted once
+      for (int i = 0, x_next = 0; i < n_spans; i++) {
+        for (int x = max(spans[i * 2], x_next); x <= spans[i * 2 + 1]; x++) f[x] = sqrtf(f[x]);
+        x_next = max(x_next, spans[i * 2 + 1] + 1);
+      }
+      // The spans and 2 pixels around each, merged where they overlap
+      for (int i = 0; i < n_spans; ) {
+        int xa = max(0, spans[i * 2] - 2), xb = spans[i * 2 + 1] + 2;
+        for (i++; i < n_spans && spans[i * 2] - 2 <= xb + 1; i++)
+          xb = max(xb, spans[i * 2 + 1] + 2);
+        xb = min(w - 1, xb);
+        blur_row_span(f, rr, w, xa, xb);
+        *rx0 = min(*rx0, xa);
+        *rx1 = xb;
+      }
+    }
+    if (blur && k - 2 >= max(0, span_bbox[1] - 2) && k - 2 <= min(h - 1, span_bbox[3] + 2)) {
+      int y = k - 2;
+      const float *rc = R(y);
+      const float *ru1 = (y < 1 ? zero : R(y - 1)), *rd1 = (y >= h - 1 ? zero : R(y + 1));
+      const float *ru2 = (y < 2 ? zero : R(y - 2)), *rd2 = (y >= h - 2 ? zero : R(y + 2));
+      // Over the columns written on any of these rows
+      int x0 = w, x1 = -1;
+      for (int yy = max(0, y - 2); yy <= min(h - 1, y + 2); yy++)
+        if (IN_SPANS(yy)) {
+          x0 = min(x0, ring_x0[yy % 5]);
+          x1 = max(x1, ring_x1[yy % 5]);
+        }
+      float *f = F + y * w;
+      for (int x = x0; x <= x1; x++)
+        f[x] = BLUR_0 * rc[x] + BLUR_1 * (ru1[x] + rd1[x]) + BLUR_2 * (ru2[x] + rd2[x]);
+    }
+    if (k >= 3) {
+      int y = k - 3;
+      fill_row(y, w, r, g, b, opacity, t);
+      finish_row(y, w, h, true, r, g, b, opacity);
+    }
+  }
+
+  scratch_ptr = scratch_mark;
+  #undef R
+  #undef IN_SPANS
+}
+
 _export void rasterize_fill(int w, int h, int n,
   float r, float g, float b, float opacity, int t)
 {
-  // Scratch space for Meijster's algorithm
-  static unsigned G[N_PIXELS];
-  static float F[N_PIXELS];
-  #define G(_x, _y) (G[(_x) + (_y) * w])
-  #define F(_x, _y) (F[(_x) + (_y) * w])
+  double t_start = now_ms();
+
+  // The fill and the field work on the decimated ring; the outline does not
+  const float *pt = pt_buf;
+  int n_pt = n;
+  if (decimate_tol > 0) {
+    n_pt = decimate(pt_buf, n, decimate_tol);
+    pt = pt_dec;
+  }
+  n_sites_last = n_pt;
 
-  // Clear texture
-  for (int i = 0; i < w * h * 4; i++) pix_buf[i] = 0;
+  // Mask pass; the texture is filled here only on the full-frame path
+  for (int i = 0; i < MASK_BYTES(w * h); i++) M[i] = 0;
 
-  // http://alienryderflex.com/polygon_fill/
-  static float xs[36];
+  int area = 0;
+  span_bbox[0] = w; span_bbox[1] = h;
+  span_bbox[2] = span_bbox[3] = -1;
   for (int y = 0; y < h; y++) {
+    int16_t *spans = row_spans_buf[y];
+    int n_spans = row_n_spans[y] = row_spans(pt, n_pt, w, y, spans);
+    if (n_spans < 0) {
+      // Extremely unlikely case where we just give up
+      for (int i = 0; i < w * h * 4; i++) pix_buf[i] = 0;
+      return;
+    }
+    for (int i = 0; i < n_spans; i++) {
+      int x_start = spans[i * 2], x_end = spans[i * 2 + 1];
+      for (int x = x_start; x <= x_end; x++) MASK_SET(M, y * w + x);
+      area += x_end - x_start + 1;
+      span_bbox[0] = min(span_bbox[0], x_start);
+      span_bbox[2] = max(span_bbox[2], x_end);
+    }
+    if (n_spans > 0) {
+      if (span_bbox[1] > y) span_bbox[1] = y;
+      span_bbox[3] = y;
+    }
+    if (!fused) fill_row(y, w, r, g, b, opacity, t);
+  }
+  if (w != light_w || h != light_h) {
+    // The last records are laid out for another size
+    clear_light_records();
+    light_w = w;
+    light_h = h;
+  }
+
+  if (pt == pt_dec) splat_merged = dec_merged;
+
+  // The outline is taken from the curve through all the points
+  size_t scratch_mark = scratch_ptr;
+  uint8_t *cov = (fill_outline_width > 0 ? scratch_alloc(w * h) : NULL);
+  if (cov != NULL) {
+    memset(cov, 0, w * h);
+    outline_coverage(pt_buf, n, w, h, fill_outline_width, cov, fill_cov_bbox);
+    fill_cov = cov;
+  }
+
+  double t_filled = now_ms();
+  int tier = choose_tier(area, w, h, t_filled - t_start);
+  // The Voronoi diagram would not fit in the scratch space
+  if (n_pt > MAX_FIELD_POINTS && tier < TIER_CACHED) tier = TIER_FLAT;
+  tier_last = tier;
+
+  float cx = 0, cy = 0;
+  for (int i = 0; i < n; i++) {
+    cx += pt_buf[i * 2 + 0];
+    cy += pt_buf[i * 2 + 1];
+  }
+  cx /= n;
+  cy /= n;
+
+  bool blur = false;
+  if (tier == TIER_FLAT) {
+    // Nothing more to do, but the field in `F` is no longer current
+    if (field_age >= 0) field_age++;
+    goto unlit;
+  } else if (tier == TIER_CACHED) {
+    int dx = (int)floorf(cx - field_cx + 0.5f);
+    int dy = (int)floorf(cy - field_cy + 0.5f);
+    translate_field(w, h, dx, dy);
+    F_dirty_lo = 0;
+    F_dirty_hi = w * h;
+    field_cx += dx;
+    field_cy += dy;
+    field_age++;
+  } else {
+    int lod = (tier == TIER_QUARTER ? 4 : tier == TIER_HALF ? 2 : 1);
+    lod_last = lod;
+    if (lod == 1) {
+      // The streaming pipeline finishes the field itself, with the 5-tap kernel,
+      // over the spans' box
+      if (fused && blur_kernel() == BLUR_DIRECT) {
+        memset(F + F_dirty_lo, 0, (F_dirty_hi - F_dirty_lo) * sizeof(float));
+        // The polygon's box, as the medial axis may stray a pixel beyond the spans
+        int bbox[4] = {w, h, -1, -1};
+        for (int i = 0; i < n_pt; i++) {
+          bbox[0] = min(bbox[0], (int)floorf(pt[i * 2 + 0]) - 1);
+          bbox[1] = min(bbox[1], (int)floorf(pt[i * 2 + 1]) - 1);
+          bbox[2] = max(bbox[2], (int)floorf(pt[i * 2 + 0]) + 1);
+          bbox[3] = max(bbox[3], (int)floorf(pt[i * 2 + 1]) + 1);
+        }
+        bbox[0] = max(bbox[0], 0); bbox[1] = max(bbox[1], 0);
+        bbox[2] = min(bbox[2], w - 1); bbox[3] = min(bbox[3], h - 1);
+        highlight_splat(pt, n_pt, w, h, M, F, bbox);
+        blur = true;
+        if (area > 0) {
+          F_dirty_lo = max(0, span_bbox[1] - 2) * w;
+          F_dirty_hi = (min(h - 1, span_bbox[3] + 2) + 1) * w;
+        } else {
+          F_dirty_lo = F_dirty_hi = 0;
+        }
+      } else {
+        highlight_field(pt, n_pt, w, h, M, F);
+        F_dirty_lo = 0;
+        F_dirty_hi = w * h;
+      }
+    } else {
+      F_dirty_lo = 0;
+      F_dirty_hi = w * h;
+      if (!highlight_field_lod(lod, w, h, pt, n_pt)) goto unlit;
+    }
+    field_w = w;
+    field_h = h;
+    field_cx = cx;
+    field_cy = cy;
+    field_age = 0;
+  }
+
+  // The light!
+  if (fused) {
+    stream_rows(w, h, blur, r, g, b, opacity, t);
+  } else {
+    for (int y = 0; y < h; y++) finish_row(y, w, h, true, r, g, b, opacity);
+  }
+
+  if (area > 0) {
+    float cost = (now_ms() - t_filled) / area;
+    tier_cost[tier] = (tier_cost[tier] == 0 || tier_probing ? cost :
+      tier_cost[tier] * 0.9f + cost * 0.1f);
+  }
+  goto done;
+
+unlit:
+  for (int y = 0; y < h; y++) {
+    if (fused) fill_row(y, w, r, g, b, opacity, t);
+    finish_row(y, w, h, false, r, g, b, opacity);
+  }
+
+done:
+  tier_probing = false;
+  fill_cov = NULL;
+  splat_merged = NULL;
+  scratch_ptr = scratch_mark;
+}
+
+#ifndef COMPACT_MEMORY
+// Particles of bubble pops, as `particles` in `scene_game.lua`. The pool is kept as
+// separate arrays per field and compacted by moving the last particle into each
+// dead one's slot; all live particles are drawn into one texture covering the screen.
+// Left out of the compact build, as the texture alone is 225 KiB
+#define MAX_PARTICLES 8192
+#define PARTICLE_W 180
+#define PARTICLE_H 320
+
+static int n_particles;
+static float part_x0[MAX_PARTICLES], part_y0[MAX_PARTICLES];
+static float part_vx[MAX_PARTICLES], part_vy[MAX_PARTICLES];
+static float part_grav[MAX_PARTICLES];
+static float part_t[MAX_PARTICLES], part_ttl[MAX_PARTICLES];
+// exp(-t / ttl * 6), advanced by multiplying with exp(-6 / ttl) on each tick
+static float part_exp[MAX_PARTICLES], part_decay[MAX_PARTICLES];
+// Position and opacity as of the last update
+static float part_x[MAX_PARTICLES], part_y[MAX_PARTICLES], part_a[MAX_PARTICLES];
+static uint8_t part_rgb[MAX_PARTICLES][3];
+
+static uint8_t part_buf[PARTICLE_W * PARTICLE_H * 4];
+_export uint8_t *get_particle_buf() { return part_buf; }
+_export int particles_count() { return n_particles; }
+
+// xorshift32, in [0, 1)
+static uint32_t part_rng_state = 2463534242u;
+static inline float part_rng()
+{
+  part_rng_state ^= part_rng_state << 13;
+  part_rng_state ^= part_rng_state >> 17;
+  part_rng_state ^= part_rng_state << 5;
+  return (part_rng_state >> 8) / 16777216.0f;
+}
+
+// Bursts the polygon in `pt_buf` into particles, sampled on scanlines about
+// 10 units apart and clipped horizontally to [0, w). Particles beyond the
+// capacity of the pool are dropped
+_export void particles_pop(int n, int w, float grav, float r, float g, float b)
+{
+  if (n < 3) return;
+  float y_min = 1e8f, y_max = -1e8f, x_cen = 0, y_cen = 0;
+  for (int i = 0; i < n; i++) {
+    float x = pt_buf[i * 2 + 0], y = pt_buf[i * 2 + 1];
+    y_min = min(y_min, y);
+    y_max = max(y_max, y);
+    x_cen += x;
+    y_cen += y;
+  }
+  x_cen /= n;
+  y_cen /= n;
+  // http://alienryderflex.com/polygon_fill/
+  float y_step = (y_max > y_min ? max(6, (y_max - y_min) / ceilf((y_max - y_min) / 10)) : 6);
+  float x_density = y_step;
+  for (float y = y_min; y <= y_max; y += y_step) {
+    float xs[MAX_CROSSINGS];
     int n_xs = 0;
     float x1 = pt_buf[(n - 1) * 2 + 0];
     float y1 = pt_buf[(n - 1) * 2 + 1];
     for (int i = 0; i < n; i++) {
       float x0 = pt_buf[i * 2 + 0];
       float y0 = pt_buf[i * 2 + 1];
-      if ((y0 < y && y1 >= y) || (y1 < y && y0 >= y)) {
-        if (n_xs >= 36) { return; } // Extremely unlikely case where we just give up
+      if (((y0 < y && y1 >= y) || (y1 < y && y0 >= y)) && n_xs < MAX_CROSSINGS)
         xs[n_xs++] = x0 + (y - y0) / (y1 - y0) * (x1 - x0);
-      }
       x1 = x0;
       y1 = y0;
     }
     qsort(xs, n_xs, sizeof(float), cmp_float);
-    for (int i = 0; i < n_xs - 1; i += 2) {
+    for (int i = 0; i + 1 < n_xs; i += 2) {
       if (xs[i] >= w) break;
-      if (xs[i + 1] >= 0) {
-        int x_start = (xs[i] < 0 ? 0 : (int)(xs[i] + 0.5f));
-        int x_end = (xs[i + 1] > w - 1 ? w - 1 : (int)(xs[i + 1] + 0.5f));
-        for (int x = x_start; x <= x_end; x++) {
-          float a = opacity * (0.85f + 0.15f * snoise3(x / 100.f, t / 720.f, y / 100.f));
-          pix_buf[(y * w + x) * 4 + 0] = (int)(r * 255);
-          pix_buf[(y * w + x) * 4 + 1] = (int)(g * 255);
-          pix_buf[(y * w + x) * 4 + 2] = (int)(b * 255);
-          pix_buf[(y * w + x) * 4 + 3] = (int)(a * 255);
-        }
+      if (xs[i + 1] < 0) continue;
+      float x_min = max(0, xs[i]);
+      float x_max = min(w, xs[i + 1]);
+      int count = (int)ceilf((x_max - x_min) / x_density);
+      for (int k = 0; k < count && n_particles < MAX_PARTICLES; k++) {
+        int j = n_particles++;
+        float px = x_min + part_rng() * (x_max - x_min);
+        float py = y + (part_rng() - 0.5f) * y_step;
+        float v_scale = 0.2f + part_rng() * 0.2f;
+        part_x0[j] = part_x[j] = px;
+        part_y0[j] = part_y[j] = py;
+        part_vx[j] = (px - x_cen) * v_scale;
+        part_vy[j] = (py - y_cen) * v_scale;
+        part_grav[j] = grav;
+        part_t[j] = 0;
+        part_ttl[j] = 120 + part_rng() * 120;
+        part_exp[j] = 1;
+        part_decay[j] = expf(-6 / part_ttl[j]);
+        part_a[j] = 1;
+        part_rgb[j][0] = (int)(r * 255 + 0.5f);
+        part_rgb[j][1] = (int)(g * 255 + 0.5f);
+        part_rgb[j][2] = (int)(b * 255 + 0.5f);
       }
     }
   }
+}
+
+// One tick of motion
+/*
+  expProgress = exp(-t / ttl * 6)
+  alpha = expProgress * (1 - t / ttl)
+  x = x0 + vx * (1 - expProgress)
+  y = y0 + vy * (1 - expProgress) + grav * (t / 240) * (vy * 4 + (t / 240) * 100)
+  t = t + 1
+*/
+_export void particles_update()
+{
+  int n = n_particles;
+  // Straight-line arithmetic over the arrays, which the compiler vectorizes
+  for (int i = 0; i < n; i++) {
+    float e = part_exp[i];
+    float s = part_t[i] * (1.0f / 240);
+    part_a[i] = e * (1 - part_t[i] / part_ttl[i]);
+    part_x[i] = part_x0[i] + part_vx[i] * (1 - e);
+    part_y[i] = part_y0[i] + part_vy[i] * (1 - e) +
+      part_grav[i] * s * (part_vy[i] * 4 + s * 100);
+    part_exp[i] = e * part_decay[i];
+    part_t[i] += 1;
+  }
+  // Swap-remove expired ones
+  for (int i = 0; i < n; ) {
+    if (part_t[i] >= part_ttl[i]) {
+      n--;
+      #define MOVE(_a) (_a[i] = _a[n])
+      MOVE(part_x0); MOVE(part_y0); MOVE(part_vx); MOVE(part_vy);
+      MOVE(part_grav); MOVE(part_t); MOVE(part_ttl);
+      MOVE(part_exp); MOVE(part_decay);
+      MOVE(part_x); MOVE(part_y); MOVE(part_a);
+      #undef MOVE
+      memcpy(part_rgb[i], part_rgb[n], 3);
+    } else {
+      i++;
+    }
+  }
+  n_particles = n;
+}
+
+// Draws the particles as single pixels into `part_buf` (`w` x `h`, up to
+// `PARTICLE_W` x `PARTICLE_H`), blended in order over a cleared texture
+_export void particles_render(int w, int h)
+{
+  if (w > PARTICLE_W || h > PARTICLE_H) return;
+  memset(part_buf, 0, w * h * 4);
+  for (int i = 0; i < n_particles; i++) {
+    int x = (int)floorf(part_x[i] + 0.5f);
+    int y = (int)floorf(part_y[i] + 0.5f);
+    if (x < 0 || x >= w || y < 0 || y >= h) continue;
+    float a = part_a[i];
+    if (a <= 0) continue;
+    if (a > 1) a = 1;
+    // Source-over with straight alpha
+    uint8_t *p = &part_buf[(y * w + x) * 4];
+    float da = p[3] / 255.0f * (1 - a);
+    float oa = a + da;
+    p[0] = (int)((part_rgb[i][0] * a + p[0] * da) / oa + 0.5f);
+    p[1] = (int)((part_rgb[i][1] * a + p[1] * da) / oa + 0.5f);
+    p[2] = (int)((part_rgb[i][2] * a + p[2] * da) / oa + 0.5f);
+    p[3] = (int)(oa * 255 + 0.5f);
+  }
+}
+#endif
+
+// Reading of LEB128 varints, for drawings and for the session logs of `REPLAYRUN`
+struct drawing_reader { const uint8_t *p, *end; bool bad; };
+
+static inline uint32_t drawing_u8(struct drawing_reader *rd)
+{
+  if (rd->p >= rd->end) { rd->bad = true; return 0; }
+  return *rd->p++;
+}
+
+static inline uint32_t drawing_varint(struct drawing_reader *rd)
+{
+  uint32_t v = 0;
+  for (int shift = 0; shift < 32; shift += 7) {
+    uint32_t b = drawing_u8(rd);
+    v |= (b & 127) << shift;
+    if (!(b & 128)) return v;
+  }
+  rd->bad = true;
+  return 0;
+}
 
-  // Take the alpha channel as a flag because it is not sensible to set it as 0
-  #define INSIDE(_x, _y) \
-    ((_x) >= 0 && (_x) < w && (_y) >= 0 && (_y) < h && \
-     pix_buf[((int)(_y) * w + (int)(_x)) * 4 + 3] > 0)
+static inline int32_t drawing_zigzag(struct drawing_reader *rd)
+{
+  uint32_t v = drawing_varint(rd);
+  return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
 
-  #define min(_a, _b) ((_a) < (_b) ? (_a) : (_b))
+#ifndef COMPACT_MEMORY
+// Drawing sent with a recognition request in place of an image of the canvas:
+// the strokes that the pops left on it (see `encodeDrawing` in `scene_game.lua`).
+// Integers are LEB128 varints, coordinates zigzag-encoded deltas from the
+// previous point (the first one from the origin)
+//   "BSD1", w, h (canvas size), u8 units per pixel, number of strokes
+//   Each stroke: u8 colour (index into `drawing_palette`, or 255 followed by
+//   u8 r, g, b), u8 width in 1/8 pixels, number of points, (dx, dy) per point
+static const float drawing_palette[][3] = {
+  {1, .19f, .30f}, {1, .60f, .14f}, {.72f, .67f, .25f},
+  {.58f, .60f, .92f}, {1, .20f, .81f}, {.62f, .93f, .98f}, {.5f, .5f, .5f},
+};
 
-  // Distance transform, but we only need the values on the medial axis.
-  // Meijster's algorithm, but the first step is optimized enough already (O(x^2 + |MA|*x))
-  for (int x = 0; x < w; x++) {
-    for (int y = 0; y < h; y++) G(x, y) = -(unsigned)INSIDE(x, y);
-    G(x, 0) = min(G(x, 0), 1);
-    G(x, h - 1) = min(G(x, h - 1), 1);
-    for (int y = 1; y < h; y++)
-      G(x, y) = min(G(x, y), G(x, y - 1) + 1);
-    for (int y = h - 1; y >= 0; y--)
-      G(x, y) = min(G(x, y), G(x, y + 1) + 1);
-  }
+// Renders the drawing in `data` stretched to `w` x `h` into `out` (RGBA,
+// cleared first), with the same strokes as `rasterize_outline`. Returns 0,
+// or -1 if the drawing is malformed or the size too large
+/*
+  render_drawing: { parameters: ['buffer', 'i32', 'i32', 'i32', 'buffer'], result: 'i32' }
+*/
+_export int render_drawing(const uint8_t *data, int len, int w, int h, uint8_t *out)
+{
+  if (w <= 0 || h <= 0 || w * h > SCRATCH_SIZE) return -1;
+  struct drawing_reader rd = { data, data + len, false };
+  if (len < 4 || memcmp(data, "BSD1", 4) != 0) return -1;
+  rd.p += 4;
+  int canvas_w = drawing_varint(&rd);
+  int canvas_h = drawing_varint(&rd);
+  int units = drawing_u8(&rd);
+  int n_strokes = drawing_varint(&rd);
+  if (rd.bad || canvas_w == 0 || canvas_h == 0 || units == 0) return -1;
+  float sx = (float)w / canvas_w / units;
+  float sy = (float)h / canvas_h / units;
+  float s_width = ((float)w / canvas_w + (float)h / canvas_h) / 2 / 8;
 
-  for (int y = 0; y < h; y++)
-    for (int x = 0; x < w; x++) F(x, y) = 0;
+  memset(out, 0, w * h * 4);
+  size_t scratch_mark = scratch_ptr;
+  uint8_t *cov = scratch_alloc(w * h);
+  if (cov == NULL) return -1;
+  int ret = 0;
+  for (int i = 0; i < n_strokes; i++) {
+    int colour = drawing_u8(&rd);
+    float r = 0, g = 0, b = 0;
+    if (colour < LENGTH(drawing_palette)) {
+      r = drawing_palette[colour][0];
+      g = drawing_palette[colour][1];
+      b = drawing_palette[colour][2];
+    } else if (colour == 255) {
+      r = drawing_u8(&rd) / 255.0f;
+      g = drawing_u8(&rd) / 255.0f;
+      b = drawing_u8(&rd) / 255.0f;
+    } else {
+      rd.bad = true;
+    }
+    float width = drawing_u8(&rd) * s_width;
+    int n = drawing_varint(&rd);
+    if (rd.bad || n > PT_BUF_SIZE / 2) { ret = -1; break; }
+    int32_t qx = 0, qy = 0;
+    for (int k = 0; k < n; k++) {
+      qx += drawing_zigzag(&rd);
+      qy += drawing_zigzag(&rd);
+      pt_buf[k * 2 + 0] = qx * sx;
+      pt_buf[k * 2 + 1] = qy * sy;
+    }
+    if (rd.bad) { ret = -1; break; }
 
-  // Medial axis from Voronoi diagram
-  // Deduplication
-  static unsigned MA[N_PIXELS];
-  #define MA(_x, _y) (MA[(_x) + (_y) * w])
-  for (int y = 0; y < h; y++)
-    for (int x = 0; x < w; x++) MA(x, y) = 0;
+    memset(cov, 0, w * h);
+    int bbox[4];
+    outline_coverage(pt_buf, n, w, h, width, cov, bbox);
+    for (int y = bbox[1]; y <= bbox[3]; y++)
+      outline_row(out, y, w, bbox[0], bbox[2], cov, r, g, b);
+  }
+  scratch_ptr = scratch_mark;
+  return ret;
+}
 
-  static jcv_diagram diagram;
-  diagram = (jcv_diagram){0};
-  jcv_diagram_generate_useralloc(
-    n, (void *)pt_buf, &(jcv_rect){{-10, -10}, {10 + w, 10 + h}}, NULL,
-    NULL, jcv_myalloc, jcv_myfree, &diagram);
+// Shape descriptors of a drawing as rendered over an opaque background, for the
+// server's local classifier (`server/shape_classifier.js`). The ink is brought to a
+// `SHAPE_SIDE` grid around its bounding box and closed into a silhouette (all that
+// the outside cannot reach); the outer contour of its largest part then goes
+// through the same mask, height field and medial axis as a bubble's fill.
+// The features, in order:
+//   7  Hu moments of the silhouette, as -sign(h) log10|h|
+//   16 radial profile: furthest silhouette pixel from the centroid by direction,
+//      relative to the furthest overall
+//   5  medial axis, leaving out the spurs towards the contour (radius under a
+//      third of the largest): end points, junctions, length over the square
+//      root of the area, mean radius over the largest, largest radius over the
+//      square root of the area
+//   3  log of the aspect ratio, silhouette area over its bounding box, parts
+//   7  share of the ink cells in each colour of `drawing_palette`
+#define SHAPE_SIDE 64
+#define SHAPE_GRID (SHAPE_SIDE + 4)
+#define SHAPE_N_FEATURES 38
 
-  // NOTE: Edge filtering can also be done in total O(n log n) time by
-  // building the node-edge graph of the Voronoi diagram and removing
-  // all vertices connected to the infinite vertices. See `backups/highlight_test/main.c`
-  // However as we already have the polygon's mask, we can just look it up!
-  for (const jcv_edge* edge = jcv_diagram_get_edges(&diagram);
-      edge != NULL;
-      edge = jcv_diagram_get_next_edge(edge)
-  ) {
-    float x1 = edge->pos[0].x, y1 = edge->pos[0].y;
-    float x2 = edge->pos[1].x, y2 = edge->pos[1].y;
+// Returns `SHAPE_N_FEATURES`, or 0 if there is no ink
+/*
+  shape_features: { parameters: ['buffer', 'i32', 'i32', 'u32', 'buffer'], result: 'i32' }
+*/
+_export int shape_features(const uint8_t *pix, int w, int h, uint32_t background, float *out)
+{
+  const int G = SHAPE_GRID;
+  const int bg[3] = { background >> 16 & 255, background >> 8 & 255, background & 255 };
+  #define INK(_p) (abs((_p)[0] - bg[0]) + abs((_p)[1] - bg[1]) + abs((_p)[2] - bg[2]))
+  // Strokes are drawn opaque; their antialiased edges are left out
+  const int INK_MIN = 96;
 
-    if (INSIDE(x1, y1) && INSIDE(x2, y2)) {
-      // Trace line with Bresenham's Algorithm, working in fixed-point
-      const int SUBPX = 4;
-      int x1_fixed = (int)(x1 * (1 << SUBPX) + 0.5);
-      int y1_fixed = (int)(y1 * (1 << SUBPX) + 0.5);
-      int x2_fixed = (int)(x2 * (1 << SUBPX) + 0.5);
-      int y2_fixed = (int)(y2 * (1 << SUBPX) + 0.5);
+  // Bounding box of everything that is not exactly the background, trimming
+  // each row from both ends a pixel at a time
+  const uint8_t bg_pixel[4] = { bg[0], bg[1], bg[2], 255 };
+  uint32_t bg_word, v;
+  memcpy(&bg_word, bg_pixel, 4);
+  #define IS_BG(_p) (memcpy(&v, _p, 4), v == bg_word)
+  int x0 = w, x1 = -1, y0 = h, y1 = -1;
+  for (int y = 0; y < h; y++) {
+    const uint8_t *row = pix + y * w * 4;
+    int l = 0, r = w - 1;
+    while (l < w && IS_BG(row + l * 4)) l++;
+    if (l == w) continue;
+    while (IS_BG(row + r * 4)) r--;
+    x0 = min(x0, l); x1 = max(x1, r);
+    y0 = min(y0, y); y1 = y;
+  }
+  #undef IS_BG
+  if (x1 < 0) return 0;
 
-      int dx = abs(x2_fixed - x1_fixed);
-      int dy = abs(y2_fixed - y1_fixed);
-      int sx = (x2_fixed > x1_fixed) ? 1 : -1;
-      int sy = (y2_fixed > y1_fixed) ? 1 : -1;
+  size_t scratch_mark = scratch_ptr;
+  // Ink, then 0 outside, 1 silhouette, then 2 for the largest part
+  uint8_t *S = scratch_alloc(G * G);
+  int *queue = scratch_alloc(G * G * sizeof(int));
+  uint8_t *ink_row = scratch_alloc(w);
+  if (S == NULL || queue == NULL || ink_row == NULL) { scratch_ptr = scratch_mark; return 0; }
+  memset(S, 0, G * G);
 
-      int x = x1_fixed;
-      int y = y1_fixed;
-      int err = dx - dy;
-      while (1) {
-        int pixel_x = x >> SUBPX;
-        int pixel_y = y >> SUBPX;
-        if (pixel_x >= 0 && pixel_x < w && pixel_y >= 0 && pixel_y < h) {
-          if (!MA(pixel_x, pixel_y)) {
-            MA(pixel_x, pixel_y) = 1;
-            unsigned d = (w + h) * (w + h);
-            int x = pixel_x, y = pixel_y;   // Shorter names for clarity
-            for (int j = 0; j < w; j++)
-              d = min(d, (x - j) * (x - j) + G(j, y) * G(j, y));
-            debug("%d %d %u\n", pixel_x, pixel_y, d);
-            // Update F in the bounding box, with current centre C(x, y)
-            // F(P) = max_C (sqrt(D(C)^2 - (P-C)^2))
-            unsigned sqrtd = (unsigned)sqrtf(d);
-            for (int py = y - sqrtd; py <= y + sqrtd; py++)
-            if (py >= 0 && py < h)
-              for (int px = x - sqrtd; px <= x + sqrtd; px++)
-              if (px >= 0 && px < w && INSIDE(px, py)) {
-                int f = d - (px-x)*(px-x) - (py-y)*(py-y);
-                if (F(px, py) < f) F(px, py) = f;
-              }
-          }
+  // A cell is ink if any pixel it overlaps is, so that strokes stay closed. Its
+  // colour is that of the first such pixel, taken as the nearest in the palette.
+  // Rows are flagged first, without branches, then reduced cell by cell
+  int bw = x1 - x0 + 1, bh = y1 - y0 + 1;
+  int side = max(bw, bh);
+  float to_grid = (float)SHAPE_SIDE / side;
+  float ox = x0 - (side - bw) * 0.5f, oy = y0 - (side - bh) * 0.5f;
+  // Pixels overlapped by cell `_i` of a row or column, clamped to the box
+  #define PX_LO(_i, _o, _lo) max((int)floorf((_o) + (_i) / to_grid), _lo)
+  #define PX_HI(_i, _o, _hi) min((int)ceilf((_o) + ((_i) + 1) / to_grid) - 1, _hi)
+  int px_lo[SHAPE_SIDE], px_hi[SHAPE_SIDE];
+  for (int gx = 0; gx < SHAPE_SIDE; gx++) {
+    px_lo[gx] = PX_LO(gx, ox, x0);
+    px_hi[gx] = PX_HI(gx, ox, x1);
+  }
+  int colour_count[7] = { 0 }, n_ink = 0;
+  int gy = 0;
+  for (int y = y0; y <= y1; y++) {
+    const uint8_t *row = pix + y * w * 4;
+    for (int x = x0; x <= x1; x++) ink_row[x] = (INK(row + x * 4) >= INK_MIN);
+    while (gy < SHAPE_SIDE - 1 && PX_HI(gy, oy, y1) < y) gy++;
+    // Cells of this row and those below that also overlap it
+    for (int cy = gy; cy < SHAPE_SIDE && PX_LO(cy, oy, y0) <= y; cy++)
+      for (int gx = 0; gx < SHAPE_SIDE; gx++) {
+        uint8_t any = 0;
+        for (int x = px_lo[gx]; x <= px_hi[gx]; x++) any |= ink_row[x];
+        uint8_t *cell = &S[(cy + 2) * G + gx + 2];
+        if (!any || *cell) continue;
+        *cell = 1;
+        int x = px_lo[gx];
+        while (!ink_row[x]) x++;
+        const uint8_t *p = row + x * 4;
+        int best = 0;
+        float best_d = 1e9f;
+        for (int i = 0; i < 7; i++) {
+          float dr = p[0] - drawing_palette[i][0] * 255;
+          float dg = p[1] - drawing_palette[i][1] * 255;
+          float db = p[2] - drawing_palette[i][2] * 255;
+          float d = dr * dr + dg * dg + db * db;
+          if (d < best_d) { best_d = d; best = i; }
         }
-        if (x == x2_fixed && y == y2_fixed) break;
-        int e2 = 2 * err;
-        if (e2 > -dy) { err -= dy; x += sx; }
-        if (e2 <  dx) { err += dx; y += sy; }
+        colour_count[best]++;
+        n_ink++;
       }
-    }
   }
+  #undef PX_LO
+  #undef PX_HI
+  #undef INK
+  // Off the background, but too faint anywhere to count as a stroke: blank
+  if (n_ink == 0) { scratch_ptr = scratch_mark; return 0; }
 
-  jcv_diagram_free(&diagram);
-  jcv_myalloc_ptr = 0;
-
-  for (int y = 0; y < h; y++)
-    for (int x = 0; x < w; x++) F(x, y) = sqrtf(F(x, y));
-
-  for (int y = 0; y < h; y++) {
-    for (int x = 0; x < w; x++) debug("%5.1f", F(x, y));
-    debug("\n");
+  // Flood the outside from the corner, 4-connected so that diagonal steps of a
+  // stroke still hold it back; what is left is the silhouette. Stepping off
+  // one end of a row onto the other only ever joins the empty margin
+  #define FLOOD(_start, _cond, _mark) do { \
+    int head = 0, tail = 0; \
+    queue[tail++] = (_start); \
+    S[_start] = (_mark); \
+    while (head < tail) { \
+      int i = queue[head++]; \
+      const int nb[4] = { i - 1, i + 1, i - G, i + G }; \
+      for (int k = 0; k < 4; k++) { \
+        int j = nb[k]; \
+        if (j >= 0 && j < G * G && (_cond)) { S[j] = (_mark); queue[tail++] = j; } \
+      } \
+    } \
+    flood_size = tail; \
+  } while (0)
+  int flood_size;
+  FLOOD(0, S[j] == 0, 3);
+  int area = 0;
+  for (int i = 0; i < G * G; i++) {
+    S[i] = (S[i] != 3);
+    area += S[i];
   }
 
-  // 2-D Gaussian blur on F
-/*
-sigma = 1
-n = 3
-sum = 0
-for i = 0, 3 do
-  sum = sum + math.exp(-i * i / (2 * sigma * sigma)) * (i == 0 and 1 or 2)
-end
-for i = 0, 3 do
-  print(math.exp(-i * i / (2 * sigma * sigma)) / sum)
-end
-*/
-  static float FF[MAX_SIDE];
-  for (int y = 0; y < h - 0; y++) {
-    for (int x = 0; x < w - 0; x++) {
-      FF[x] =
-        0.399050279652450f * F(x, y) +
-        0.242036229376110f * ((x < 1 ? 0 : F(x-1, y)) + (x >= w-1 ? 0 : F(x+1, y))) +
-        0.054005582622414f * ((x < 2 ? 0 : F(x-2, y)) + (x >= w-2 ? 0 : F(x+2, y)));
+  // Moments
+  double m00 = area, mx = 0, my = 0;
+  for (int y = 0; y < G; y++)
+    for (int x = 0; x < G; x++)
+      if (S[y * G + x]) { mx += x; my += y; }
+  mx /= m00;
+  my /= m00;
+  double mu[4][4] = {{ 0 }};
+  float radial[16] = { 0 };
+  for (int y = 0; y < G; y++)
+    for (int x = 0; x < G; x++) {
+      if (!S[y * G + x]) continue;
+      double dx = x - mx, dy = y - my;
+      double px = 1;
+      for (int p = 0; p <= 3; p++, px *= dx) {
+        double py = 1;
+        for (int q = 0; p + q <= 3; q++, py *= dy) mu[p][q] += px * py;
+      }
+      // The furthest pixel in any direction is on the boundary
+      int i = y * G + x;
+      if (S[i - 1] && S[i + 1] && S[i - G] && S[i + G]) continue;
+      float r = sqrtf(dx * dx + dy * dy);
+      int bin = (int)((atan2f(dy, dx) + (float)M_PI) * (16 / (2 * (float)M_PI))) & 15;
+      if (radial[bin] < r) radial[bin] = r;
     }
-    for (int x = 0; x < w - 0; x++) F(x, y) = FF[x];
+  // Normalized central moments, then Hu's invariants
+  #define ETA(_p, _q) (mu[_p][_q] / pow(m00, 1 + ((_p) + (_q)) / 2.0))
+  double n20 = ETA(2, 0), n02 = ETA(0, 2), n11 = ETA(1, 1);
+  double n30 = ETA(3, 0), n03 = ETA(0, 3), n21 = ETA(2, 1), n12 = ETA(1, 2);
+  #undef ETA
+  double a = n30 + n12, b = n21 + n03;
+  double hu[7] = {
+    n20 + n02,
+    (n20 - n02) * (n20 - n02) + 4 * n11 * n11,
+    (n30 - 3 * n12) * (n30 - 3 * n12) + (3 * n21 - n03) * (3 * n21 - n03),
+    a * a + b * b,
+    (n30 - 3 * n12) * a * (a * a - 3 * b * b) + (3 * n21 - n03) * b * (3 * a * a - b * b),
+    (n20 - n02) * (a * a - b * b) + 4 * n11 * a * b,
+    (3 * n21 - n03) * a * (a * a - 3 * b * b) - (n30 - 3 * n12) * b * (3 * a * a - b * b),
+  };
+  int f = 0;
+  for (int i = 0; i < 7; i++) {
+    double m = fabs(hu[i]);
+    out[f++] = (m < 1e-30 ? 30 : -log10(m)) * (hu[i] < 0 ? -1 : 1);
   }
-  for (int x = 0; x < w - 0; x++) {
-    for (int y = 0; y < h - 0; y++) {
-      FF[y] =
-        0.399050279652450f * F(x, y) +
-        0.242036229376110f * ((y < 1 ? 0 : F(x, y-1)) + (y >= h-1 ? 0 : F(x, y+1))) +
-        0.054005582622414f * ((y < 2 ? 0 : F(x, y-2)) + (y >= h-2 ? 0 : F(x, y+2)));
-    }
-    for (int y = 0; y < h - 0; y++) F(x, y) = FF[y];
+  float r_max = 0;
+  for (int i = 0; i < 16; i++) r_max = max(r_max, radial[i]);
+  for (int i = 0; i < 16; i++) out[f++] = (r_max > 0 ? radial[i] / r_max : 0);
+
+  // Parts of the silhouette, the largest one marked 2
+  int n_parts = 0, largest = -1, largest_size = 0;
+  for (int i = 0; i < G * G; i++) {
+    if (S[i] != 1) continue;
+    FLOOD(i, S[j] == 1, 4);
+    n_parts++;
+    if (flood_size > largest_size) { largest_size = flood_size; largest = i; }
   }
+  if (largest < 0) { scratch_ptr = scratch_mark; return 0; }
+  FLOOD(largest, S[j] == 4, 2);
+  #undef FLOOD
 
-  // Previous record for smoothing and hysteresis
-  static float Clast[N_PIXELS];
-  static unsigned char Hlast[N_PIXELS];
-  #define Clast(_x, _y) (Clast[(_x) + (_y) * w])
-  #define Hlast(_x, _y) (Hlast[(_x) + (_y) * w])
+  // Its outer contour by Moore neighbour tracing, from its first pixel in
+  // raster order
+  static const int dir_x[8] = { -1, -1, 0, 1, 1, 1, 0, -1 };
+  static const int dir_y[8] = { 0, -1, -1, -1, 0, 1, 1, 1 };
+  float *ring = scratch_alloc(G * G * 2 * sizeof(float));
+  if (ring == NULL) { scratch_ptr = scratch_mark; return 0; }
+  int n_ring = 0;
+  int start = 0;
+  while (start < G * G && S[start] != 2) start++;
+  if (start == G * G) { scratch_ptr = scratch_mark; return 0; }
+  int cur = start, back = 0;  // Direction of the last outside pixel looked at
+  do {
+    ring[n_ring * 2 + 0] = cur % G;
+    ring[n_ring * 2 + 1] = cur / G;
+    n_ring++;
+    int k = 0, next = -1;
+    for (; k < 8; k++) {
+      int d = (back + k) % 8;
+      int j = cur + dir_y[d] * G + dir_x[d];
+      if (S[j] == 2) { next = j; break; }
+    }
+    if (next < 0) break;  // A single pixel
+    // The last outside pixel, seen from the next one
+    int d_prev = (back + k + 7) % 8;
+    int c = cur + dir_y[d_prev] * G + dir_x[d_prev];
+    for (int e = 0; e < 8; e++)
+      if (next + dir_y[e] * G + dir_x[e] == c) { back = e; break; }
+    cur = next;
+  } while (cur != start && n_ring < G * G);
 
-  // The light!
-  for (int y = 1; y < h - 1; y++) {
-    for (int x = 1; x < w - 1; x++) {
-      // Normal vector
-      float gx = (
-        (F(x+1, y-1) + 2 * F(x+1, y) + F(x+1, y+1)) -
-        (F(x-1, y-1) + 2 * F(x-1, y) + F(x-1, y+1))
-      ) / 4;
-      float gy = (
-        (F(x-1, y+1) + 2 * F(x, y+1) + F(x+1, y+1)) -
-        (F(x-1, y-1) + 2 * F(x, y-1) + F(x+1, y-1))
-      ) / 4;
-      float nz = 1. / sqrtf(gx * gx + gy * gy + 1);
-      float nx = -gx * nz, ny = -gy * nz;
+  float axis_features[5] = { 0 };
+  if (n_ring >= 3) {
+    // At most `MAX_POINTS` for the decimation, then down to its tolerance
+    int step = (n_ring + MAX_POINTS - 1) / MAX_POINTS;
+    int n = 0;
+    for (int i = 0; i < n_ring; i += step) {
+      ring[n * 2 + 0] = ring[i * 2 + 0];
+      ring[n * 2 + 1] = ring[i * 2 + 1];
+      n++;
+    }
+    dec_n_last = 0;  // No hysteresis: the same image gives the same features
+    n = decimate(ring, n, 0.7f);
+    const float *pt = pt_dec;
 
-      // Blinn-Phong specular lighting
-      // Light at (-N, -N, 0.35 N), viewer at (0, 0, N) where N is very large
-      /*
-        local normalize = function (x, y, z)
-          local d = math.sqrt(x*x + y*y + z*z)
-          return x/d, y/d, z/d
-        end
-        lx, ly, lz = normalize(-1, -1, 0.35)
-        vx, vy, vz = normalize( 0,  0, 1)
-        hx, hy, hz = normalize(lx+vx, ly+vy, lz+vz)
-        print(hx, hy, hz)
-      */
-      // c = h · n
-      float c = (nx + ny) * -0.43582124257856f + 0.78747678634646f * nz;
-
-      // Exclude exterior parts
-      if (!INSIDE(x, y)) c = 0;
-
-      // Debug inspection
-      debug("%2c", INSIDE(x, y) ? (c > 0.95f ? '#' : '*') : '.');   // Highlight
-      // debug("%2c", INSIDE(x, y) ? (G(x, y) ? '#' : '*') : '.');     // Medial axis
-
-      // Smooth
-      float clast = Clast(x, y);
-      Clast(x, y) = c = c + (Clast(x, y) - c) * 0.75f;
-      // Level 2  ↑0.95 ↓0.90
-      // Level 1  ↑0.85 ↓0.80
-      int h = Hlast(x, y);
-      if (h < 1 && c >= 0.01f) h = 1;
-      if (h < 2 && c >= 0.95f) h = 2;
-      if (h >= 2 && c < 0.94f) h = 1;
-      if (h >= 1 && c < 0.00f) h = 0;
-      Hlast(x, y) = h;
-      if (h == 2) {
-        pix_buf[(y * w + x) * 4 + 0] = 255 - ((255 - pix_buf[(y * w + x) * 4 + 0]) * 10 / 16);
-        pix_buf[(y * w + x) * 4 + 1] = 255 - ((255 - pix_buf[(y * w + x) * 4 + 1]) * 10 / 16);
-        pix_buf[(y * w + x) * 4 + 2] = 255 - ((255 - pix_buf[(y * w + x) * 4 + 2]) * 10 / 16);
-        pix_buf[(y * w + x) * 4 + 3] = 255 - (int)((1 - opacity) * 0.5f * 255);
-      } else if (h == 1) {
-        pix_buf[(y * w + x) * 4 + 0] = 255 - ((255 - pix_buf[(y * w + x) * 4 + 0]) * 14 / 16);
-        pix_buf[(y * w + x) * 4 + 1] = 255 - ((255 - pix_buf[(y * w + x) * 4 + 1]) * 14 / 16);
-        pix_buf[(y * w + x) * 4 + 2] = 255 - ((255 - pix_buf[(y * w + x) * 4 + 2]) * 14 / 16);
+    uint8_t *mask = scratch_alloc(G * G);
+    float *field = scratch_alloc(G * G * sizeof(float));
+    uint8_t *axis = scratch_alloc(G * G);
+    bool fits = (n >= 3 && n <= MAX_FIELD_POINTS && mask != NULL && field != NULL && axis != NULL);
+    if (mask != NULL) memset(mask, 0, G * G);
+    if (axis != NULL) memset(axis, 0, G * G);
+    for (int y = 0; y < G && fits; y++) {
+      int16_t spans[MAX_CROSSINGS];
+      int n_spans = row_spans(pt, n, G, y, spans);
+      if (n_spans < 0) fits = false;
+      for (int i = 0; i < n_spans; i++)
+        for (int x = spans[i * 2]; x <= spans[i * 2 + 1]; x++) mask[y * G + x] = 1;
+    }
+    if (fits) {
+      splat_axis = axis;
+      highlight_splat(pt, n, G, G, mask, field, NULL);
+      splat_axis = NULL;
+
+      float radius_max = 0;
+      for (int i = 0; i < G * G; i++)
+        if (axis[i]) radius_max = max(radius_max, sqrtf(field[i]));
+      // Spurs end near the contour, where the inscribed circle is small
+      float radius_min = radius_max / 3;
+      int length = 0;
+      float radius_sum = 0;
+      for (int i = 0; i < G * G; i++) {
+        if (axis[i] && sqrtf(field[i]) < radius_min) axis[i] = 0;
+        if (axis[i]) { length++; radius_sum += sqrtf(field[i]); }
       }
+      // End points have one neighbour on the axis; junctions are clusters of
+      // pixels with three or more, counted once
+      int n_ends = 0, n_junctions = 0;
+      for (int y = 1; y < G - 1; y++)
+        for (int x = 1; x < G - 1; x++) {
+          int i = y * G + x;
+          if (!axis[i]) continue;
+          int nb = 0;
+          bool junction_nearby = false;
+          for (int d = 0; d < 8; d++) {
+            int j = i + dir_y[d] * G + dir_x[d];
+            nb += (axis[j] != 0);
+            junction_nearby |= (axis[j] == 2);
+          }
+          if (nb == 1) n_ends++;
+          if (nb >= 3) {
+            if (!junction_nearby) n_junctions++;
+            axis[i] = 2;
+          }
+        }
+      float sqrt_area = sqrtf(largest_size);
+      axis_features[0] = n_ends;
+      axis_features[1] = n_junctions;
+      axis_features[2] = length / sqrt_area;
+      axis_features[3] = (length > 0 ? radius_sum / length / radius_max : 0);
+      axis_features[4] = radius_max / sqrt_area;
     }
-    debug("\n");
   }
+  for (int i = 0; i < 5; i++) out[f++] = axis_features[i];
+
+  out[f++] = logf((float)bw / bh);
+  float box = (float)bw * bh * (to_grid * to_grid);
+  out[f++] = min(area / box, 1.0f);
+  out[f++] = n_parts;
+  for (int i = 0; i < 7; i++) out[f++] = (float)colour_count[i] / n_ink;
+
+  scratch_ptr = scratch_mark;
+  return f;
 }
+#undef SHAPE_SIDE
+#undef SHAPE_GRID
+#endif
 
 #ifdef TESTRUN
 #include <string.h>
@@ -330,35 +2186,614 @@ from math import *; print(','.join('%.4f,%.4f' % (10 + 8*sin(i/24*pi*2), 10 + 8*
   int scale = 3;
   for (int i = 0; i < n; i++) pt[i] *= scale;
   memcpy(pt_buf, pt, sizeof pt);
+  set_fused_pipeline(false);
+  rasterize_fill(20 * scale, 20 * scale, n / 2, 1, 1, 1, 1, 0);
+
+  // The streaming pipeline should give the same texture
+  static uint8_t full[PIX_BUF_SIZE];
+  memcpy(full, pix_buf, sizeof full);
+  reset_highlight();
+  set_fused_pipeline(true);
   rasterize_fill(20 * scale, 20 * scale, n / 2, 1, 1, 1, 1, 0);
+  printf("fused pipeline %s\n",
+    memcmp(full, pix_buf, (20 * scale) * (20 * scale) * 4) == 0 ? "identical" : "DIFFERS");
+
+  // A fill with its own outline should match the fill followed by the outline
+  set_outline_width(1.5f);
+  for (int f = 0; f < 2; f++) {
+    set_fused_pipeline(f);
+    reset_highlight();
+    rasterize_fill(20 * scale, 20 * scale, n / 2, 1, 0.5f, 0.2f, 0.8f, 0);
+    rasterize_outline(20 * scale, 20 * scale, n / 2, 1, 0.5f, 0.2f);
+    memcpy(full, pix_buf, sizeof full);
+    reset_highlight();
+    set_fill_outline(1.5f);
+    rasterize_fill(20 * scale, 20 * scale, n / 2, 1, 0.5f, 0.2f, 0.8f, 0);
+    set_fill_outline(0);
+    printf("fill with outline, %s, %s\n", f ? "fused" : "full-frame",
+      memcmp(full, pix_buf, (20 * scale) * (20 * scale) * 4) == 0 ? "identical" : "DIFFERS");
+  }
+
+  // Lighting over the spans against whole rows, with a bubble that goes off the
+  // texture and comes back. Records outside the spans stop decaying, so pixels
+  // that come back inside start out from another one; a few are expected to differ
+  {
+    enum { SIDE = 60, FRAMES = 80 };
+    static uint8_t frames[FRAMES][SIDE * SIDE * 4];
+    int16_t (*spans)[1 + MAX_CROSSINGS] = light_spans;
+    int n_differ = 0;
+    debug_on = false;
+    for (int whole = 0; whole < 2; whole++) {
+      reset_highlight();
+      if (whole) light_spans = NULL;
+      for (int f = 0; f < FRAMES; f++) {
+        float cx = SIDE / 2 + 40 * sinf(f / 9.f), cy = SIDE / 2 + 6 * cosf(f / 5.f);
+        for (int i = 0; i < 48; i++) {
+          float phi = i / 48.f * 6.2831853f;
+          pt_buf[i * 2] = cx + cosf(phi) * 16 * (1 + 0.1f * sinf(phi * 3 + f / 7.f));
+          pt_buf[i * 2 + 1] = cy + sinf(phi) * 16;
+        }
+        rasterize_fill(SIDE, SIDE, 48, 1, 0.6f, 0.14f, 0.6f, f);
+        if (!whole) memcpy(frames[f], pix_buf, sizeof frames[f]);
+        else for (int i = 0; i < SIDE * SIDE; i++) {
+          // Colours under zero alpha are not seen
+          const uint8_t *a = frames[f] + i * 4, *b = pix_buf + i * 4;
+          n_differ += (a[3] != b[3] || (a[3] != 0 && memcmp(a, b, 3) != 0));
+        }
+      }
+    }
+    light_spans = spans;
+    reset_highlight();
+    debug_on = true;
+    memcpy(pt_buf, pt, sizeof pt);
+    printf("lit over spans, %d pixels, %s whole rows\n", n_differ,
+      n_differ == 0 ? "identical to" :
+      n_differ * 100 <= FRAMES * SIDE * SIDE ? "within 1% of" : "FAR FROM");
+  }
+
+  // Outline alone, by coverage
+  memset(pix_buf, 0, sizeof pix_buf);
+  set_outline_width(1.5f);
+  rasterize_outline(20 * scale, 20 * scale, n / 2, 1, 1, 1);
+  for (int y = 0; y < 20 * scale; y++) {
+    for (int x = 0; x < 20 * scale; x++)
+      printf(" %c", " .:*#"[(pix_buf[(y * 20 * scale + x) * 4 + 3] + 63) / 64]);
+    putchar('\n');
+  }
+  printf("outline samples %d\n", n_outline_samples);
+
+#ifndef COMPACT_MEMORY
+  // Particle motion with the decay factor against the closed form with `exp`
+  memcpy(pt_buf, pt, sizeof pt);
+  particles_pop(n / 2, PARTICLE_W, 1, 1, 0.5f, 0.2f);
+  int n_spawned = particles_count();
+  static float ttl[MAX_PARTICLES];
+  memcpy(ttl, part_ttl, sizeof ttl);
+  float max_err = 0;
+  // Until the first one expires and the pool is reordered
+  for (int tick = 0; tick < 240; tick++) {
+    particles_update();
+    if (particles_count() != n_spawned) break;
+    for (int i = 0; i < particles_count(); i++) {
+      float e = expf(-tick / ttl[i] * 6);
+      float s = tick / 240.0f;
+      float x = part_x0[i] + part_vx[i] * (1 - e);
+      float y = part_y0[i] + part_vy[i] * (1 - e) + s * (part_vy[i] * 4 + s * 100);
+      max_err = max(max_err, max(fabsf(x - part_x[i]), fabsf(y - part_y[i])));
+      max_err = max(max_err, fabsf(e * (1 - tick / ttl[i]) - part_a[i]));
+    }
+  }
+  printf("particles %d, max error %s\n", n_spawned, max_err < 1e-3f ? "< 1e-3" : "TOO LARGE");
+  while (particles_count() > 0) particles_update();
+
+  // A drawing of two strokes against the same outlines drawn directly
+  {
+    static uint8_t data[1024], out[PIX_BUF_SIZE];
+    int len = 0, side = 20 * scale;
+    #define PUT_VARINT(_v) do { \
+      uint32_t v = (_v); \
+      while (v >= 128) { data[len++] = (v & 127) | 128; v >>= 7; } \
+      data[len++] = v; \
+    } while (0)
+    #define PUT_ZIGZAG(_v) PUT_VARINT((_v) >= 0 ? (uint32_t)(_v) * 2 : (uint32_t)-(_v) * 2 - 1)
+    memcpy(data, "BSD1", 4);
+    len = 4;
+    PUT_VARINT(side); PUT_VARINT(side);
+    data[len++] = 4;
+    PUT_VARINT(2);
+    for (int k = 0; k < 2; k++) {
+      if (k == 0) {
+        data[len++] = 1;
+      } else {
+        data[len++] = 255;
+        data[len++] = 51; data[len++] = 204; data[len++] = 102;
+      }
+      data[len++] = 12;
+      PUT_VARINT(n / 2);
+      int qx = 0, qy = 0;
+      for (int i = 0; i < n / 2; i++) {
+        int x = (int)(pt[i * 2] * 4), y = (int)(pt[i * 2 + 1] * 4);
+        PUT_ZIGZAG(x - qx); PUT_ZIGZAG(y - qy);
+        qx = x; qy = y;
+      }
+    }
+    #undef PUT_VARINT
+    #undef PUT_ZIGZAG
+    int ret = render_drawing(data, len, side, side, out);
+
+    memset(pix_buf, 0, sizeof pix_buf);
+    set_outline_width(1.5f);
+    memcpy(pt_buf, pt, sizeof pt);
+    rasterize_outline(side, side, n / 2, drawing_palette[1][0], drawing_palette[1][1], drawing_palette[1][2]);
+    rasterize_outline(side, side, n / 2, 0.2f, 0.8f, 0.4f);
+    printf("drawing, %d bytes, %s\n", len,
+      ret == 0 && memcmp(out, pix_buf, side * side * 4) == 0 ? "identical" : "DIFFERS");
+    printf("truncated drawing %s\n",
+      render_drawing(data, len - 1, side, side, out) == -1 ? "rejected" : "ACCEPTED");
+  }
+#endif
+
+  // Recursive and box blurs of a field of domes against the Gaussian itself,
+  // convolved directly with radius 4 sigma. Errors relative to the highest point
+  {
+    enum { BW = 128, BH = 128 };
+    static float field[BW * BH], ref[BW * BH], tmp[BW * BH], out[BW * BH];
+    static const float domes[][3] = {{46, 56, 18}, {78, 68, 12}, {64, 42, 6}};
+    for (int y = 0; y < BH; y++)
+      for (int x = 0; x < BW; x++) {
+        float f = 0;
+        for (int i = 0; i < 3; i++) {
+          float dx = x - domes[i][0], dy = y - domes[i][1], r = domes[i][2];
+          f = max(f, sqrtf(max(0, r * r - dx * dx - dy * dy)));
+        }
+        field[y * BW + x] = f;
+      }
+    printf("blur   sigma  iir (max, mean error)  box (max, mean error)\n");
+    static const float sigmas[] = {1.25f, 1.5f, 1.75f, 2, 2.25f, 2.5f, 2.75f, 3, 3.25f, 4, 6, 8};
+    for (int k = 0; k < LENGTH(sigmas); k++) {
+      float sigma = sigmas[k];
+      int r = (int)ceilf(sigma * 4);
+      float g[2 * 32 + 1], sum = 0;  // Taps up to sigma 8
+      for (int i = -r; i <= r; i++) sum += (g[i + r] = expf(-i * i / (2 * sigma * sigma)));
+      for (int i = 0; i <= 2 * r; i++) g[i] /= sum;
+      for (int y = 0; y < BH; y++)
+        for (int x = 0; x < BW; x++) {
+          float v = 0;
+          for (int i = -r; i <= r; i++)
+            if (x + i >= 0 && x + i < BW) v += g[i + r] * field[y * BW + x + i];
+          tmp[y * BW + x] = v;
+        }
+      float peak = 0;
+      for (int y = 0; y < BH; y++)
+        for (int x = 0; x < BW; x++) {
+          float v = 0;
+          for (int i = -r; i <= r; i++)
+            if (y + i >= 0 && y + i < BH) v += g[i + r] * tmp[(y + i) * BW + x];
+          ref[y * BW + x] = v;
+          peak = max(peak, v);
+        }
+      printf("%12.2f", sigma);
+      for (int kernel = BLUR_IIR; kernel <= BLUR_BOX; kernel++) {
+        memcpy(out, field, sizeof out);
+        if (kernel == BLUR_IIR) blur_iir(out, BW, BH, sigma);
+        else blur_box(out, BW, BH, sigma);
+        double err_max = 0, err_sum = 0;
+        for (int i = 0; i < BW * BH; i++) {
+          double e = fabs(out[i] - ref[i]) / peak;
+          err_max = (e > err_max ? e : err_max);
+          err_sum += e;
+        }
+        printf("  %9.2f%% %8.3f%%  ", err_max * 100, err_sum / (BW * BH) * 100);
+      }
+      printf("\n");
+    }
+  }
+
+  // At other sigmas the sweep takes the field blurred beforehand
+  for (int k = BLUR_IIR; k <= BLUR_BOX; k++) {
+    static uint8_t full[PIX_BUF_SIZE];
+    set_blur_sigma(k == BLUR_IIR ? 1.5f : 4);
+    for (int f = 0; f < 2; f++) {
+      set_fused_pipeline(f == 1);
+      reset_highlight();
+      memcpy(pt_buf, pt, sizeof pt);
+      rasterize_fill(20 * scale, 20 * scale, n / 2, 1, 0.5f, 0.2f, 0.8f, 0);
+      if (f == 0) memcpy(full, pix_buf, sizeof full);
+    }
+    printf("fill at sigma %.1f, fused against full-frame: %s\n", blur_sigma,
+      memcmp(full, pix_buf, (20 * scale) * (20 * scale) * 4) == 0 ? "identical" : "DIFFERS");
+  }
+  set_blur_sigma(1);
+
+  // With the scratch space taken, a fill and an outline go without what does
+  // not fit instead of writing past it
+  {
+    int failures = n_scratch_failures;
+    size_t mark = scratch_ptr;
+    scratch_alloc(scratch_left() - 64);
+    reset_highlight();
+    set_blur_sigma(4);
+    set_fill_outline(1.5f);
+    memcpy(pt_buf, pt, sizeof pt);
+    debug_on = false;
+    rasterize_fill(20 * scale, 20 * scale, n / 2, 1, 0.5f, 0.2f, 0.8f, 0);
+    rasterize_outline(20 * scale, 20 * scale, n / 2, 1, 0.5f, 0.2f);
+    debug_on = true;
+    set_fill_outline(0);
+    set_blur_sigma(1);
+    scratch_ptr = mark;
+    int opaque = 0;
+    for (int i = 0; i < (20 * scale) * (20 * scale); i++) opaque += (pix_buf[i * 4 + 3] != 0);
+    printf("out of scratch: %s, %s\n", opaque > 0 ? "filled" : "NOT FILLED",
+      n_scratch_failures > failures ? "scratch refused" : "NOTHING REFUSED");
+  }
+
+  // One slow frame at full resolution should not keep it out for the rest of the
+  // session, with a budget that it fits in by far
+  {
+    set_frame_budget(1000);
+    set_highlight_lod(1);
+    for (int i = 0; i < N_TIERS; i++) tier_cost[i] = 0;
+    tier_cost[TIER_FULL] = 1e9f;
+    tier_probe_in = TIER_PROBE_FRAMES;
+    debug_on = false;
+    int frames = 0;
+    do {
+      memcpy(pt_buf, pt, sizeof pt);
+      rasterize_fill(20 * scale, 20 * scale, n / 2, 1, 0.5f, 0.2f, 0.8f, 0);
+      frames++;
+    } while (get_last_tier() != TIER_FULL && frames < 10 * TIER_PROBE_FRAMES);
+    memcpy(pt_buf, pt, sizeof pt);
+    rasterize_fill(20 * scale, 20 * scale, n / 2, 1, 0.5f, 0.2f, 0.8f, 0);
+    printf("governor back at full resolution %d frames after a slow one, %s\n", frames,
+      get_last_tier() == TIER_FULL ? "stays" : "LEAVES AGAIN");
+    set_frame_budget(0);
+    set_highlight_lod(0);
+    debug_on = true;
+  }
+
   return 0;
 }
 #endif
 
-_export void rasterize_outline(int w, int h, int n,
-  float r, float g, float b)
+#ifdef BENCHRUN
+#include <stdio.h>
+
+// cc -O2 polygon_rast.c -o /tmp/bench -DBENCHRUN -lm && /tmp/bench
+
+// Same as the bubble texture in `scene_game.lua`
+#define BENCH_W 164
+#define BENCH_H 200
+#define BENCH_N 100
+#define BENCH_FRAMES 240
+
+// A wobbling bubble of mean radius `radius`, sampled at the game's 100 points
+static void bench_bubble(float radius, int frame, float *pt)
 {
-  float x1 = pt_buf[(n - 1) * 2 + 0];
-  float y1 = pt_buf[(n - 1) * 2 + 1];
-  for (int i = 0; i < n; i++) {
-    float x0 = pt_buf[i * 2 + 0];
-    float y0 = pt_buf[i * 2 + 1];
-    float dx = (x0 - x1) / 10;
-    float dy = (y0 - y1) / 10;
-    for (int k = 0; k < 10; x1 += dx, y1 += dy, k++) {
-      int x = (int)(x1 + 0.5f);
-      int y = (int)(y1 + 0.5f);
-      if (x >= 0 && x < w && y >= 0 && y < h) {
-        pix_buf[(y * w + x) * 4 + 0] = (int)(r * 255);
-        pix_buf[(y * w + x) * 4 + 1] = (int)(g * 255);
-        pix_buf[(y * w + x) * 4 + 2] = (int)(b * 255);
-        pix_buf[(y * w + x) * 4 + 3] = 255;
+  for (int i = 0; i < BENCH_N; i++) {
+    float phi = (float)i / BENCH_N * 6.2831853f;
+    float c = cosf(phi), s = sinf(phi);
+    float r = radius * (1 + 0.15f * snoise3(c * 0.8f, s * 0.8f, frame / 90.f)
+      + 0.05f * sinf(phi * 3 + frame / 30.f));
+    pt[i * 2 + 0] = BENCH_W / 2 + 4 * sinf(frame / 45.f) + c * r;
+    pt[i * 2 + 1] = BENCH_H / 2 + 3 * cosf(frame / 60.f) + s * r;
+  }
+}
+
+// Hysteresis levels of each frame of the reference run
+static unsigned char bench_ref[BENCH_FRAMES][N_PIXELS];
+// Statistics of the last run
+static double bench_max;
+static int bench_tiers[N_TIERS];
+// Mean vertex count after decimation, mean medial axis pixels, mean sites, scratch
+// bytes and milliseconds of the Voronoi diagram, and mean fraction of interior
+// pixels whose level changed from the previous frame
+static double bench_sites, bench_axis, bench_voronoi_sites, bench_voronoi_bytes, bench_voronoi_ms,
+  bench_flicker;
+static unsigned char bench_prev[N_PIXELS];
+
+// Runs a sequence of frames and returns the time per frame in milliseconds.
+// Levels are recorded into `bench_ref` if `record`, otherwise compared against it;
+// `diff` receives the mean fraction of interior pixels whose level differs
+static double bench_run(float radius, bool record, double *diff)
+{
+  float pt[BENCH_N * 2];
+  double total = 0, diff_sum = 0;
+  bench_max = 0;
+  bench_sites = bench_axis = bench_voronoi_sites = bench_voronoi_bytes = bench_voronoi_ms =
+    bench_flicker = 0;
+  for (int i = 0; i < N_TIERS; i++) bench_tiers[i] = 0;
+  reset_highlight();
+  for (int f = 0; f < BENCH_FRAMES; f++) {
+    bench_bubble(radius, f, pt);
+    memcpy(pt_buf, pt, sizeof pt);
+    double t0 = now_ms();
+    rasterize_fill(BENCH_W, BENCH_H, BENCH_N, 1, 0.6f, 0.14f, 0.6f, f);
+    double t = now_ms() - t0;
+    total += t;
+    if (bench_max < t) bench_max = t;
+    bench_tiers[get_last_tier()]++;
+    bench_sites += (double)get_last_sites() / BENCH_FRAMES;
+    bench_axis += (double)n_axis_pixels / BENCH_FRAMES;
+    bench_voronoi_sites += (double)n_voronoi_sites / BENCH_FRAMES;
+    bench_voronoi_bytes += (double)n_voronoi_bytes / BENCH_FRAMES;
+    bench_voronoi_ms += voronoi_ms / BENCH_FRAMES;
+    int n_inside = 0, n_changed = 0;
+    for (int i = 0; i < BENCH_W * BENCH_H; i++) {
+      if (MASK_GET(M, i)) {
+        n_inside++;
+        if (f > 0 && hlast_get(i) != bench_prev[i]) n_changed++;
       }
+      bench_prev[i] = hlast_get(i);
     }
-    x1 = x0;
-    y1 = y0;
+    bench_flicker += (double)n_changed / (n_inside > 0 ? n_inside : 1) / BENCH_FRAMES;
+    if (record) {
+      for (int i = 0; i < BENCH_W * BENCH_H; i++) bench_ref[f][i] = hlast_get(i);
+    } else {
+      int n_inside = 0, n_diff = 0;
+      for (int i = 0; i < BENCH_W * BENCH_H; i++) if (MASK_GET(M, i)) {
+        n_inside++;
+        if (hlast_get(i) != bench_ref[f][i]) n_diff++;
+      }
+      diff_sum += (double)n_diff / (n_inside > 0 ? n_inside : 1);
+    }
+  }
+  if (diff) *diff = diff_sum / BENCH_FRAMES;
+  return total / BENCH_FRAMES;
+}
+
+// Separable Gaussian convolved directly with radius 3 sigma, for comparison
+static void bench_blur_direct(float *f, int w, int h, float sigma)
+{
+  static float g[128], tmp[N_PIXELS];
+  int r = min((int)ceilf(sigma * 3), 63);
+  float sum = 0;
+  for (int i = -r; i <= r; i++) sum += (g[i + r] = expf(-i * i / (2 * sigma * sigma)));
+  for (int i = 0; i <= 2 * r; i++) g[i] /= sum;
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      float v = 0;
+      for (int i = max(-r, -x); i <= min(r, w - 1 - x); i++) v += g[i + r] * f[y * w + x + i];
+      tmp[y * w + x] = v;
+    }
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      float v = 0;
+      for (int i = max(-r, -y); i <= min(r, h - 1 - y); i++) v += g[i + r] * tmp[(y + i) * w + x];
+      f[y * w + x] = v;
+    }
+}
+
+int main()
+{
+  static const float radii[] = {15, 30, 45, 60, 75};
+
+  size_t statics = sizeof pix_buf + sizeof pt_buf + sizeof M + sizeof F +
+    sizeof Clast + sizeof Hlast + sizeof row_spans_buf + sizeof row_n_spans +
+    sizeof scratch_buf;
+#ifndef COMPACT_MEMORY
+  statics += sizeof part_buf + MAX_PARTICLES * (12 * sizeof(float) + 3);
+#endif
+  printf("== Memory ==\n");
+  printf("static buffers %zu bytes, of which scratch %zu\n", statics, sizeof scratch_buf);
+
+  printf("== Highlight level of detail ==\n");
+  printf("radius   area   full (ms)  half (ms, diff)    quarter (ms, diff)  auto (lod, ms, diff)\n");
+  for (int i = 0; i < LENGTH(radii); i++) {
+    double d2, d4, da;
+    set_highlight_lod(1);
+    double t1 = bench_run(radii[i], true, NULL);
+    int area = 0;
+    for (int j = 0; j < BENCH_W * BENCH_H; j++) area += MASK_GET(M, j);
+    set_highlight_lod(2);
+    double t2 = bench_run(radii[i], false, &d2);
+    set_highlight_lod(4);
+    double t4 = bench_run(radii[i], false, &d4);
+    set_highlight_lod(0);
+    double ta = bench_run(radii[i], false, &da);
+    printf("%6.0f %6d %9.3f %9.3f %6.2f%% %9.3f %6.2f%%   %d %9.3f %6.2f%%\n",
+      radii[i], area, t1, t2, d2 * 100, t4, d4 * 100, get_highlight_lod(), ta, da * 100);
+  }
+
+  printf("\n== Full-frame vs. fused pipeline (full resolution) ==\n");
+  printf("radius  full-frame (ms)  fused (ms)   diff\n");
+  set_highlight_lod(1);
+  for (int i = 0; i < LENGTH(radii); i++) {
+    double d;
+    set_fused_pipeline(false);
+    double t0 = bench_run(radii[i], true, NULL);
+    set_fused_pipeline(true);
+    double t1 = bench_run(radii[i], false, &d);
+    printf("%6.0f %16.3f %11.3f %6.2f%%\n", radii[i], t0, t1, d * 100);
   }
+
+  printf("\n== Voronoi edges clipped to the polygon vs. to the box (full resolution) ==\n");
+  printf("radius  box (ms, axis px)  polygon (ms, axis px, diff)\n");
+  set_highlight_lod(1);
+  for (int i = 0; i < LENGTH(radii); i++) {
+    double d;
+    set_polygon_clip(false);
+    double t0 = bench_run(radii[i], true, NULL);
+    double a0 = bench_axis;
+    set_polygon_clip(true);
+    double t1 = bench_run(radii[i], false, &d);
+    printf("%6.0f %9.3f %7.0f %10.3f %7.0f %6.2f%%\n",
+      radii[i], t0, a0, t1, bench_axis, d * 100);
+  }
+
+  printf("\n== Voronoi diagram with and without cells (full resolution) ==\n");
+  printf("radius  clip     cells (Voronoi ms, bytes)  edges only (Voronoi ms, bytes, diff)\n");
+  set_highlight_lod(1);
+  for (int c = 0; c < 2; c++)
+  for (int i = 0; i < LENGTH(radii); i += 2) {
+    double d;
+    set_polygon_clip(c == 1);
+    set_voronoi_edges_only(false);
+    bench_run(radii[i], true, NULL);
+    double t0 = bench_voronoi_ms, b0 = bench_voronoi_bytes;
+    set_voronoi_edges_only(true);
+    bench_run(radii[i], false, &d);
+    printf("%6.0f  %-7s %12.4f %8.0f %16.4f %8.0f %6.2f%%\n",
+      radii[i], c == 1 ? "polygon" : "box", t0, b0, bench_voronoi_ms, bench_voronoi_bytes, d * 100);
+  }
+
+  printf("\n== Decimation (full resolution) ==\n");
+  printf("radius  tol (px)  sites  (Voronoi, ms)     ms  saved (ms)   diff  flicker\n");
+  static const float tols[] = {0, 0.1f, 0.25f, 0.5f, 1};
+  set_highlight_lod(1);
+  for (int i = 1; i < LENGTH(radii); i += 2) {
+    double t0 = 0;
+    for (int j = 0; j < LENGTH(tols); j++) {
+      double d;
+      set_decimation(tols[j]);
+      double t = bench_run(radii[i], j == 0, &d), flicker = bench_flicker;
+      // The best of 3 runs, as the savings are a small part of the frame
+      double t_voronoi = bench_voronoi_ms;
+      for (int k = 0; k < 2; k++) {
+        t = min(t, bench_run(radii[i], false, NULL));
+        t_voronoi = min(t_voronoi, bench_voronoi_ms);
+      }
+      if (j == 0) t0 = t;
+      printf("%6.0f %9.2f %6.1f %8.1f %6.3f %6.3f %8.3f %7.2f%% %6.2f%%\n",
+        radii[i], tols[j], bench_sites, bench_voronoi_sites, t_voronoi, t, t0 - t,
+        d * 100, flicker * 100);
+    }
+  }
+  set_decimation(0);
+
+  printf("\n== Frame budget governor (radius 75) ==\n");
+  printf("budget (ms)  mean (ms)  max (ms)   diff   frames per tier (full half quarter cached flat)\n");
+  static const float budgets[] = {0, 4, 2, 1, 0.5f};
+  set_highlight_lod(1);
+  bench_run(75, true, NULL);
+  set_highlight_lod(0);
+  for (int i = 0; i < LENGTH(budgets); i++) {
+    double d;
+    set_frame_budget(budgets[i]);
+    for (int j = 0; j < N_TIERS; j++) tier_cost[j] = 0;
+    tier_probe_in = TIER_PROBE_FRAMES;
+    double t = bench_run(75, false, &d);
+    printf("%11.1f %10.3f %9.3f %6.2f%%  ", budgets[i], t, bench_max, d * 100);
+    for (int j = 0; j < N_TIERS; j++) printf(" %4d", bench_tiers[j]);
+    printf("\n");
+  }
+  set_frame_budget(0);
+
+  printf("\n== Blur of the field at radius 75 by sigma (ms) ==\n");
+  printf("sigma  5-tap  direct    iir    box   auto\n");
+  {
+    static float field[N_PIXELS];
+    float pt[BENCH_N * 2];
+    set_highlight_lod(1);
+    set_fused_pipeline(false);
+    bench_bubble(75, 0, pt);
+    memcpy(pt_buf, pt, sizeof pt);
+    rasterize_fill(BENCH_W, BENCH_H, BENCH_N, 1, 0.6f, 0.14f, 0.6f, 0);
+    set_fused_pipeline(true);
+    memcpy(field, F, sizeof field);
+    static const float sigmas[] = {1, 2, 4, 8, 16};
+    for (int i = 0; i < LENGTH(sigmas); i++) {
+      const int reps = 50;
+      double ms[5];
+      for (int k = 0; k < 5; k++) {
+        set_blur_sigma(sigmas[i]);
+        set_blur_kernel(k == 0 ? BLUR_DIRECT : k == 2 ? BLUR_IIR : k == 3 ? BLUR_BOX : BLUR_AUTO);
+        double t0 = now_ms();
+        for (int r = 0; r < reps; r++) {
+          memcpy(F, field, sizeof field);
+          if (k == 1) bench_blur_direct(F, BENCH_W, BENCH_H, sigmas[i]);
+          else blur_field(F, BENCH_W, BENCH_H);
+        }
+        ms[k] = (now_ms() - t0) / reps;
+      }
+      printf("%5.0f %6.3f %7.3f %6.3f %6.3f %6.3f\n",
+        sigmas[i], ms[0], ms[1], ms[2], ms[3], ms[4]);
+    }
+    set_blur_sigma(1);
+    set_blur_kernel(BLUR_AUTO);
+    // Written over here, not by the fill
+    F_dirty_lo = 0;
+    F_dirty_hi = N_PIXELS;
+  }
+
+  printf("\n== Outline (mean of %d frames) ==\n", BENCH_FRAMES);
+  printf("radius  width  samples  ms\n");
+  static const float widths[] = {1, 1.5f, 3};
+  for (int i = 0; i < LENGTH(radii); i += 2)
+    for (int j = 0; j < LENGTH(widths); j++) {
+      float pt[BENCH_N * 2];
+      double total = 0, samples = 0;
+      set_outline_width(widths[j]);
+      for (int f = 0; f < BENCH_FRAMES; f++) {
+        bench_bubble(radii[i], f, pt);
+        memcpy(pt_buf, pt, sizeof pt);
+        double t0 = now_ms();
+        rasterize_outline(BENCH_W, BENCH_H, BENCH_N, 1, 0.6f, 0.14f);
+        total += now_ms() - t0;
+        samples += n_outline_samples;
+      }
+      printf("%6.0f %6.1f %8.0f %6.3f\n",
+        radii[i], widths[j], samples / BENCH_FRAMES, total / BENCH_FRAMES);
+    }
+  set_outline_width(1);
+
+  printf("\n== Fill, then outline vs. fill with its own outline (width 1.5, auto LOD) ==\n");
+  printf("radius  separate (ms)  combined (ms)\n");
+  set_highlight_lod(0);
+  for (int i = 0; i < LENGTH(radii); i += 2) {
+    float pt[BENCH_N * 2];
+    double t_sep = 0, t_comb = 0;
+    for (int c = 0; c < 2; c++) {
+      reset_highlight();
+      set_outline_width(1.5f);
+      set_fill_outline(c == 1 ? 1.5f : 0);
+      for (int f = 0; f < BENCH_FRAMES; f++) {
+        bench_bubble(radii[i], f, pt);
+        memcpy(pt_buf, pt, sizeof pt);
+        double t0 = now_ms();
+        rasterize_fill(BENCH_W, BENCH_H, BENCH_N, 1, 0.6f, 0.14f, 0.6f, f);
+        if (c == 0) rasterize_outline(BENCH_W, BENCH_H, BENCH_N, 1, 0.6f, 0.14f);
+        *(c == 0 ? &t_sep : &t_comb) += (now_ms() - t0) / BENCH_FRAMES;
+      }
+    }
+    printf("%6.0f %14.3f %14.3f\n", radii[i], t_sep, t_comb);
+  }
+  set_fill_outline(0);
+  set_outline_width(1);
+
+#ifndef COMPACT_MEMORY
+  printf("\n== Particles (update and render per tick, ms) ==\n");
+  printf("particles  update  render\n");
+  static const int counts[] = {1000, 4000, 8000};
+  for (int i = 0; i < LENGTH(counts); i++) {
+    float pt[BENCH_N * 2];
+    n_particles = 0;
+    for (int f = 0; particles_count() < counts[i]; f++) {
+      bench_bubble(75, f, pt);
+      memcpy(pt_buf, pt, sizeof pt);
+      particles_pop(BENCH_N, PARTICLE_W, 1, 1, 0.6f, 0.14f);
+    }
+    int n = particles_count();
+    double t_update = 0, t_render = 0;
+    for (int tick = 0; tick < 100; tick++) {
+      double t0 = now_ms();
+      particles_update();
+      double t1 = now_ms();
+      particles_render(PARTICLE_W, PARTICLE_H);
+      t_update += (t1 - t0) / 100;
+      t_render += (now_ms() - t1) / 100;
+    }
+    printf("%9d %7.4f %7.4f\n", n, t_update, t_render);
+  }
+  n_particles = 0;
+#endif
+
+  printf("\npeak scratch use %zu bytes (pointers are %zu bytes here)\n",
+    scratch_peak, sizeof(void *));
+
+  return 0;
 }
+#endif
 
 // https://github.com/stegu/perlin-noise/blob/a624f5a/src/simplexnoise1234.c
 
@@ -560,3 +2995,140 @@ static inline float snoise3(float x, float y, float z) {
   // The result is scaled to stay just inside [-1,1]
   return 72.0f * (n0 + n1 + n2 + n3);
 }
+
+#ifdef REPLAYRUN
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Replays the bubble frames of session logs (see `session.lua`) through
+// `rasterize_fill` as fast as it goes, so that real sessions serve as the
+// benchmark. `-b <ms>` sets the frame budget (the web page uses 4, its worker 12)
+// cc -O2 polygon_rast.c -o /tmp/replay -DREPLAYRUN -lm && /tmp/replay [-b ms] sessions/*.bss
+
+static int cmp_double(const void *_a, const void *_b)
+{
+  double a = *(double *)_a, b = *(double *)_b;
+  return a < b ? -1 : a > b ? 1 : 0;
+}
+
+static void skip_bytes(struct drawing_reader *rd, uint32_t n)
+{
+  if (rd->end - rd->p < n) rd->bad = true;
+  else rd->p += n;
+}
+
+// Replays one log, with the frame times in `times` (grown as needed). Returns
+// the number of frames, or -1 if it is not a log; `*bad` is set if it breaks
+// off, and the frames up to there are kept
+static int replay_log(const uint8_t *data, size_t len,
+  double **times, int *cap, int *tiers, bool *bad)
+{
+  struct drawing_reader rd = { data, data + len, false };
+  if (len < 4 || memcmp(data, "BSS1", 4) != 0) return -1;
+  rd.p += 4;
+  drawing_varint(&rd);  // Seed
+  float units = drawing_u8(&rd);
+  if (units == 0) return -1;
+
+  reset_highlight();
+  int n_frames = 0;
+  while (rd.p < rd.end && !rd.bad) {
+    switch (drawing_u8(&rd)) {
+    case 'U': drawing_varint(&rd); break;
+    case 'P': case 'M': case 'R': drawing_zigzag(&rd); drawing_zigzag(&rd); break;
+    case 'K': skip_bytes(&rd, drawing_varint(&rd)); break;
+    case 'N': drawing_varint(&rd); skip_bytes(&rd, drawing_varint(&rd)); break;
+    case 'F': {
+      int w = drawing_varint(&rd), h = drawing_varint(&rd);
+      float r = drawing_u8(&rd) / 255.0f;
+      float g = drawing_u8(&rd) / 255.0f;
+      float b = drawing_u8(&rd) / 255.0f;
+      float opacity = drawing_u8(&rd) / 255.0f;
+      int t = drawing_varint(&rd);
+      float width = drawing_u8(&rd) / 8.0f;
+      int n = drawing_varint(&rd);
+      if (w <= 0 || h <= 0 || w > MAX_SIDE || w * h > N_PIXELS ||
+          n > PT_BUF_SIZE / 2) {
+        rd.bad = true;
+        break;
+      }
+      int32_t qx = 0, qy = 0;
+      for (int i = 0; i < n; i++) {
+        qx += drawing_zigzag(&rd);
+        qy += drawing_zigzag(&rd);
+        pt_buf[i * 2 + 0] = qx / units;
+        pt_buf[i * 2 + 1] = qy / units;
+      }
+      if (rd.bad) break;
+      if (n_frames == *cap) {
+        *cap = (*cap == 0 ? 4096 : *cap * 2);
+        *times = realloc(*times, *cap * sizeof(double));
+      }
+      set_fill_outline(width);
+      double t0 = now_ms();
+      rasterize_fill(w, h, n, r, g, b, opacity, t);
+      (*times)[n_frames++] = now_ms() - t0;
+      tiers[get_last_tier()]++;
+      break;
+    }
+    default: rd.bad = true;
+    }
+  }
+  set_fill_outline(0);
+  *bad = rd.bad;
+  return n_frames;
+}
+
+int main(int argc, char *argv[])
+{
+  double *times = NULL;
+  int cap = 0;
+
+  printf("session                      frames  mean (ms)  p50 (ms)  p99 (ms)  max (ms)"
+    "   frames per tier (full half quarter cached flat)\n");
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      set_frame_budget(atof(argv[++i]));
+      continue;
+    }
+    int fd = open(argv[i], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      fprintf(stderr, "%s: cannot open\n", argv[i]);
+      if (fd >= 0) close(fd);
+      continue;
+    }
+    const uint8_t *data = (st.st_size > 0 ?
+      mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED);
+    close(fd);
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "%s: cannot map\n", argv[i]);
+      continue;
+    }
+
+    int tiers[N_TIERS] = { 0 };
+    bool bad;
+    int n = replay_log(data, st.st_size, &times, &cap, tiers, &bad);
+    munmap((void *)data, st.st_size);
+    if (n < 0) {
+      fprintf(stderr, "%s: not a session log\n", argv[i]);
+      continue;
+    }
+    if (bad) fprintf(stderr, "%s: breaks off after %d frames\n", argv[i], n);
+    double total = 0;
+    for (int j = 0; j < n; j++) total += times[j];
+    qsort(times, n, sizeof(double), cmp_double);
+    printf("%-28s %6d %10.4f %9.4f %9.4f %9.4f  ",
+      argv[i], n, n > 0 ? total / n : 0, n > 0 ? times[n / 2] : 0,
+      n > 0 ? times[n * 99 / 100] : 0, n > 0 ? times[n - 1] : 0);
+    for (int j = 0; j < N_TIERS; j++) printf(" %5d", tiers[j]);
+    printf("\n");
+  }
+
+  free(times);
+  return 0;
+}
+#endif
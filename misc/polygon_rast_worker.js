@@ -0,0 +1,48 @@
+// Runs `rasterize_fill` off the main thread. See `processPrintedText` in `web_index.html`
+//
+// Shared memory layout (all offsets in bytes):
+//   ctrl    Int32Array    [requested seq, completed seq, (w, h) of slot 0, (w, h) of slot 1]
+//   params  Float32Array  [w, h, n, r, g, b, opacity, t, outline?, r, g, b, width,
+//                          width of the fill's own outline, ...points]
+//   slots   Uint8Array    2 * pixBufSize, result of frame `seq` is in slot `seq % 2`
+// The main thread writes a job only when the worker is idle (completed == requested),
+// so the parameter block needs no double buffering; the pixels do, as the main thread
+// keeps uploading the last completed frame while the next one is being rasterized.
+// Each completed frame is also posted back, so that a job held back meanwhile goes out.
+
+onmessage = (e) => {
+  const { module, shared, layout } = e.data
+  const rast = new WebAssembly.Instance(module,
+    { env: { now_ms: () => performance.now() } }).exports
+  // Only the exports of the checked-in module, see `web_index.html`
+
+  const ctrl = new Int32Array(shared, layout.ctrl, layout.ctrlLen)
+  const params = new Float32Array(shared, layout.params, layout.paramsLen)
+  const slots = new Uint8Array(shared, layout.slots, layout.pixBufSize * 2)
+
+  const ptBuf = new Float32Array(rast.memory.buffer, rast.get_pt_buf(), layout.ptBufSize)
+  const pixBuf = new Uint8Array(rast.memory.buffer, rast.get_pix_buf(), layout.pixBufSize)
+
+  let done = 0
+  postMessage('ready')
+  while (true) {
+    Atomics.wait(ctrl, 0, done)
+    const seq = Atomics.load(ctrl, 0)
+
+    const w = params[0], h = params[1], n = params[2]
+    ptBuf.set(params.subarray(14, 14 + n * 2))
+    rast.rasterize_fill(w, h, n, params[3], params[4], params[5], params[6], params[7])
+    // The fill's own outline is drawn after it, in the same colour
+    if (params[13] > 0) rast.rasterize_outline(w, h, n, params[3], params[4], params[5])
+    if (params[8]) rast.rasterize_outline(w, h, n, params[9], params[10], params[11])
+
+    const slot = seq % 2
+    slots.set(pixBuf.subarray(0, w * h * 4), slot * layout.pixBufSize)
+    ctrl[2 + slot * 2] = w
+    ctrl[3 + slot * 2] = h
+
+    done = seq
+    Atomics.store(ctrl, 1, seq)
+    postMessage(seq)
+  }
+}
@@ -0,0 +1,65 @@
+// Times the handoff of a recognition request from the game to the page on the web
+// build, before and after passing the body through MEMFS instead of `print`
+// (see `enqueueRequest` in `scene_game.lua` and the `^` case of `processPrintedText`
+// in `web_index.html`). The Lua side is stood in for by the same steps in JS, and
+// MEMFS by a Map holding copies, as the game's file writes do
+// node misc/request_channel_bench.js
+
+const fs = require('fs')
+const path = require('path')
+
+const dir = path.join(__dirname, 'test_images')
+const payloads = fs.readdirSync(dir).filter((f) => f.endsWith('.png')).map((f) => {
+  const png = fs.readFileSync(path.join(dir, f))
+  const words = Buffer.from('香蕉,腰果,月亮/', 'utf8')
+  return { name: f, body: new Uint8Array(Buffer.concat([words, png])) }
+})
+
+const hexChannel = (body) => {
+  // Lua: one `string.format('%02x')` per byte, then `table.concat`
+  const encoded = ['^', '/tmp/1700000000001', '^']
+  for (let i = 0; i < body.length; i++)
+    encoded.push(body[i].toString(16).padStart(2, '0'))
+  let text = encoded.join('')
+  // Page
+  text = text.substring(1).trim()
+  const splitAt = text.indexOf('^')
+  text = text.substring(splitAt + 1)
+  const payload = new Uint8Array(text.length / 2)
+  for (let i = 0; i < payload.length; i++)
+    payload[i] = parseInt(text.substring(i * 2, i * 2 + 2), 16)
+  return { payload, printed: encoded.reduce((n, s) => n + s.length, 0) }
+}
+
+const memfs = new Map()
+const fileChannel = (body) => {
+  // Lua: `f:write(s)`
+  memfs.set('/tmp/1700000000001.req', body.slice())
+  const text = '^/tmp/1700000000001^/tmp/1700000000001.req'
+  // Page: `FS.readFile`, `FS.unlink`
+  const paths = text.substring(1).trim().split('^')
+  const payload = memfs.get(paths[1]).slice()
+  memfs.delete(paths[1])
+  return { payload, printed: text.length }
+}
+
+const time = (fn, body) => {
+  for (let i = 0; i < 20; i++) fn(body)
+  const reps = 200
+  const t0 = performance.now()
+  let r
+  for (let i = 0; i < reps; i++) r = fn(body)
+  const ms = (performance.now() - t0) / reps
+  if (Buffer.compare(Buffer.from(r.payload), Buffer.from(body)) !== 0)
+    throw new Error('payload mismatch')
+  return { ms, printed: r.printed }
+}
+
+console.log('payload            bytes   hex (ms, printed)     MEMFS (ms, printed)')
+for (const { name, body } of payloads) {
+  const a = time(hexChannel, body)
+  const b = time(fileChannel, body)
+  console.log(`${name.padEnd(16)} ${String(body.length).padStart(7)}` +
+    `  ${a.ms.toFixed(3).padStart(7)} ${String(a.printed).padStart(8)}` +
+    `      ${b.ms.toFixed(4).padStart(7)} ${String(b.printed).padStart(4)}`)
+}
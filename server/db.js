@@ -27,12 +27,17 @@ export const logNetwork = async (url, payload, response, time) => {
     target TEXT,
     hints TEXT,
     recognized TEXT,
-    time INTEGER
+    time INTEGER,
+    local INTEGER DEFAULT 0
   );
 `.split(/;\n\n+/).map((s) => db.prepare(s).run())
-export const logGame = async (target, image, hints, recognized) => {
-  stmt(`INSERT INTO game_record (image, target, hints, recognized, time) VALUES (?, ?, ?, ?, ?)`)
-    .run(image, target, hints, recognized, Date.now())
+// Databases from before answers of the local classifier were told apart
+if (!db.prepare(`PRAGMA table_info(game_record)`).all().some((c) => c.name === 'local'))
+  db.prepare(`ALTER TABLE game_record ADD COLUMN local INTEGER DEFAULT 0`).run()
+// `local` is true for answers of the local classifier rather than the LLM
+export const logGame = async (target, image, hints, recognized, local) => {
+  stmt(`INSERT INTO game_record (image, target, hints, recognized, time, local) VALUES (?, ?, ?, ?, ?, ?)`)
+    .run(image, target, hints, recognized, Date.now(), local ? 1 : 0)
 }
 
 import { wordBingo } from './words.js'
@@ -48,23 +53,37 @@ export const recentSuccessfulGames = async () => {
       )
       .slice(0, 50)
   const values =
-    stmt(`SELECT image, target, hints, recognized FROM game_record WHERE rowid IN (${rowids.join(',')}) ORDER BY rowid DESC`)
+    stmt(`SELECT image, target, hints, recognized, local FROM game_record WHERE rowid IN (${rowids.join(',')}) ORDER BY rowid DESC`)
       .all()
       .map((rowFields) => [
         rowFields['image'], rowFields['target'],
         rowFields['hints'], rowFields['recognized'],
-        wordBingo(rowFields['target'], rowFields['recognized'])
+        wordBingo(rowFields['target'], rowFields['recognized']),
+        rowFields['local'] !== 0,
       ])
   return values
 }
 export const recentGames = async () => {
   const values =
-    stmt(`SELECT image, target, hints, recognized FROM game_record ORDER BY rowid DESC LIMIT 50`)
+    stmt(`SELECT image, target, hints, recognized, local FROM game_record ORDER BY rowid DESC LIMIT 50`)
       .all()
       .map((rowFields) => [
         rowFields['image'], rowFields['target'],
         rowFields['hints'], rowFields['recognized'],
-        wordBingo(rowFields['target'], rowFields['recognized'])
+        wordBingo(rowFields['target'], rowFields['recognized']),
+        rowFields['local'] !== 0,
+      ])
+  return values
+}
+// Games to fill the recognition cache and train the local classifier with, newest first
+export const loggedGames = async (limit) => {
+  const values =
+    stmt(`SELECT image, target, hints, recognized, local FROM game_record ORDER BY rowid DESC LIMIT ?`)
+      .all(limit)
+      .map((rowFields) => [
+        rowFields['image'], rowFields['target'],
+        rowFields['hints'], rowFields['recognized'],
+        rowFields['local'] !== 0,
       ])
   return values
 }
@@ -1,5 +1,8 @@
 import * as db from './db.js'
 import * as llm from './llm.js'
+import * as rast from './rast.js'
+import * as recognitionCache from './recognition_cache.js'
+import * as shapeClassifier from './shape_classifier.js'
 
 import { serveFile } from 'jsr:@std/http/file-server'
 import { encodeBase64 } from 'jsr:@std/encoding/base64'
@@ -25,10 +28,31 @@ const extractParams = (payload, keys) => {
   return params
 }
 
+// Size at which drawings are rendered, relative to the canvas in the game
+const DRAWING_SCALE = 2
+
+// Games logged before this start fill the recognition cache (with the LLM's
+// answers only) and train the local classifier, re-read from their images as
+// logged (decoded only: the hash and features do not need them re-encoded)
+const LOGGED_GAMES = 5000
+for (const [image, target, hints, recognized, local] of await db.loggedGames(LOGGED_GAMES)) {
+  if (!rast.decodeUpload(image, 512, 1, 0x101010)) continue
+  if (!local) recognitionCache.store(target, hints, rast.uploadHash(), recognized)
+  shapeClassifier.add(rast.uploadFeatures(), target)
+}
+shapeClassifier.fit()
+
+// RECOGNIZER=local answers with the local classifier alone, without an API key
+// (for the game run with LOCAL_SERVER=1, and for tests); otherwise it answers
+// only when the LLM fails
+const localOnly = (Deno.env.get('RECOGNIZER') === 'local')
+
 const serveReq = async (req) => {
   const url = new URL(req.url)
   if (req.method === 'GET' && (url.pathname === '/log' || url.pathname === '/log/bingo')) {
     const games = (url.pathname === '/log/bingo') ? (await db.recentSuccessfulGames()) : (await db.recentGames())
+    const cache = recognitionCache.summary()
+    const local = shapeClassifier.summary()
     const html = `
 <!DOCTYPE html>
 <html><head>
@@ -38,9 +62,11 @@ const serveReq = async (req) => {
   .bingo { background: #e0ffe0; }
   </style>
 </head><body>
+<p>缓存命中 ${cache.hits} / ${cache.hits + cache.misses} (${(cache.hitRate * 100).toFixed(1)}%)，命中 ${cache.hitMs.toFixed(2)} ms，未命中 ${cache.missMs.toFixed(0)} ms，共 ${cache.entries} 条</p>
+<p>本地识别 ${local.examples} 个样本，与模型一致 ${local.agreed} / ${local.compared}</p>
 <table>
 <tr><th></th><th>猜</th><th>目标</th><th>提示</th></tr>
-${games.map(([image, target, hints, recognized, bingo]) => `<tr class='${bingo ? 'bingo' : 'miss'}''><td><img src='data:image/png;base64,${encodeBase64(image)}'></td><td>${recognized}</td><td>${target}</td><td>${hints}</td></tr>`).join('\n')}
+${games.map(([image, target, hints, recognized, bingo, local]) => `<tr class='${bingo ? 'bingo' : 'miss'}''><td><img src='data:image/png;base64,${encodeBase64(image)}'></td><td>${recognized}${local ? ' (local)' : ''}</td><td>${target}</td><td>${hints}</td></tr>`).join('\n')}
 </table>
 </body></html>
 `
@@ -67,15 +93,39 @@ ${games.map(([image, target, hints, recognized, bingo]) => `<tr class='${bingo ?
       const words = new TextDecoder().decode(u8View.slice(0, p)).split(',')
       const targetWord = words[0]
       const prevAttempts = words.slice(1)
-      const img = await sharp(payload.slice(p + 1))
-      const meta = await img.metadata()
-      if (meta.size > 1048576 || meta.width > 512 || meta.height > 512)
-        throw new Error('Image too big')
-      const composite = await img.flatten({ background: '#101010' })
-      const reencode = await composite.png().toBuffer()
-      const result = await llm.askForRecognition(reencode, targetWord, prevAttempts)
-      await db.logGame(targetWord, reencode, llm.getHint(targetWord, prevAttempts), result)
-      return new Response(result)
+      const body = u8View.subarray(p + 1)
+      // Decoded, composited over the background and re-encoded natively;
+      // sharp only sees PNGs the native decoder does not take
+      let reencode = rast.normalizeUpload(body, 512, DRAWING_SCALE, 0x101010)
+      const hash = (reencode !== null ? rast.uploadHash() : null)
+      const features = (reencode !== null ? rast.uploadFeatures() : null)
+      if (reencode === null) {
+        const img = await sharp(payload.slice(p + 1))
+        const meta = await img.metadata()
+        if (meta.size > 1048576 || meta.width > 512 || meta.height > 512)
+          throw new Error('Image too big')
+        reencode = await img.flatten({ background: '#101010' }).png().toBuffer()
+      }
+      const hints = llm.getHint(targetWord, prevAttempts)
+      const localGuess = shapeClassifier.guess(features, targetWord, prevAttempts)
+      const ask = async () => {
+        if (localOnly) {
+          if (localGuess === null) throw new Error('Nothing for the local classifier to go by')
+          return { answer: localGuess, local: true }
+        }
+        try {
+          const answer = await llm.askForRecognition(reencode, targetWord, prevAttempts)
+          shapeClassifier.compare(localGuess, answer)
+          return { answer, local: false }
+        } catch (e) {
+          if (localGuess === null) throw e
+          console.log('Answering with the local classifier:', e.message)
+          return { answer: localGuess, local: true }
+        }
+      }
+      const { answer, local } = await recognitionCache.recognize(targetWord, hints, hash, ask)
+      await db.logGame(targetWord, reencode, hints, answer, local)
+      return new Response(answer)
     } catch (e) {
       console.log(e.message, e.stack)
       throw new ErrorHttpCoded(400, e.message)
@@ -0,0 +1,44 @@
+// Throughput of the image stage of /look on the test images, in requests per
+// second: sharp (flatten over the background, re-encode as PNG) against the
+// native `normalize_upload` (see `rast.js` for building the library)
+// deno run --allow-read --allow-env --allow-ffi normalize_bench.js
+// Without Deno, the BENCHRUN of `misc/image_normalize.c` built with -DBENCH_LIBPNG
+// times the libpng path under sharp alongside the native one
+
+import * as rast from './rast.js'
+import sharp from 'npm:sharp@0.33.5'
+
+const dir = new URL('../misc/test_images/', import.meta.url)
+
+const viaSharp = async (body) => {
+  const img = sharp(body)
+  const meta = await img.metadata()
+  if (meta.size > 1048576 || meta.width > 512 || meta.height > 512)
+    throw new Error('Image too big')
+  return await img.flatten({ background: '#101010' }).png().toBuffer()
+}
+
+const viaNative = async (body) => rast.normalizeUpload(body, 512, 2, 0x101010)
+
+// Requests one after another, as a single server isolate serves them
+const rate = async (fn, body) => {
+  for (let i = 0; i < 20; i++) await fn(body)
+  let n = 0, out
+  const t0 = performance.now()
+  while (performance.now() - t0 < 2000) {
+    out = await fn(body)
+    n++
+  }
+  return { rate: n * 1000 / (performance.now() - t0), size: out.length }
+}
+
+console.log('image              bytes   sharp (req/s, bytes)   native (req/s, bytes)')
+for await (const entry of Deno.readDir(dir)) {
+  if (!entry.name.endsWith('.png')) continue
+  const body = await Deno.readFile(new URL(entry.name, dir))
+  const a = await rate(viaSharp, body)
+  const b = await rate(viaNative, body)
+  console.log(`${entry.name.padEnd(16)} ${String(body.length).padStart(7)}` +
+    `  ${a.rate.toFixed(0).padStart(8)} ${String(a.size).padStart(8)}` +
+    `      ${b.rate.toFixed(0).padStart(8)} ${String(b.size).padStart(8)}`)
+}
@@ -0,0 +1,80 @@
+// Native rasterizer and image normalization (`misc/polygon_rast.c`, `misc/image_normalize.c`),
+// the desktop build with room for 512 x 512 images, placed next to this file by
+// `sh misc/build_native.sh server` (run by `misc/deploy_web.sh` and `run.sh.example`)
+
+const libPath = Deno.env.get('POLYGON_RAST_LIB') ||
+  new URL('libpolygon_rast.so', import.meta.url).pathname
+
+// Opened on first use, so that the server starts without it; PNG uploads then
+// go to sharp, and only drawings fail. null once it could not be opened
+let lib
+const openLib = () => {
+  if (lib !== undefined) return lib
+  try {
+    lib = Deno.dlopen(libPath, {
+      normalize_upload: { parameters: ['buffer', 'i32', 'i32', 'i32', 'u32'], result: 'i32' },
+      decode_upload: { parameters: ['buffer', 'i32', 'i32', 'i32', 'u32'], result: 'i32' },
+      get_enc_out: { parameters: [], result: 'pointer' },
+      upload_phash: { parameters: ['buffer'], result: 'void' },
+      upload_features: { parameters: ['buffer'], result: 'i32' },
+    })
+  } catch (e) {
+    console.log(`Native rasterizer not available (${libPath}): ${e.message}`)
+    lib = null
+  }
+  return lib
+}
+
+// Drawings as sent by the game (see `render_drawing`), which only the library renders
+const isDrawing = (payload) =>
+  payload.length >= 4 && payload[0] === 0x42 && payload[1] === 0x53 &&
+  payload[2] === 0x44 && payload[3] === 0x31   // "BSD1"
+
+// Return values of `normalize_upload` other than a size (or -1, malformed)
+const NORM_TOO_LARGE = -2
+const NORM_UNSUPPORTED = -3
+
+// Turns an upload (a drawing, or a PNG from earlier versions of the game) into
+// an opaque PNG over `background` (0xRRGGBB). Drawings are rendered at `scale`
+// times their canvas size. Returns null for PNGs the native decoder does not
+// handle (16-bit, interlaced), which are left to sharp, and for all PNGs if the
+// library is missing
+export const normalizeUpload = (payload, maxSide, scale, background) => {
+  if (openLib() === null) {
+    if (isDrawing(payload))
+      throw new Error(`Drawings need the native rasterizer, which is missing (${libPath})`)
+    return null
+  }
+  const size = lib.symbols.normalize_upload(payload, payload.length, maxSide, scale, background)
+  if (size === NORM_UNSUPPORTED) return null
+  if (size === NORM_TOO_LARGE) throw new Error('Image too big')
+  if (size <= 0) throw new Error('Malformed image')
+  // The library's buffer is reused by the next call
+  const ptr = lib.symbols.get_enc_out()
+  return new Uint8Array(Deno.UnsafePointerView.getArrayBuffer(ptr, size).slice(0))
+}
+
+// Decodes an upload as `normalizeUpload` does, without encoding the PNG, for
+// `uploadHash` and `uploadFeatures` alone. Returns false where `normalizeUpload`
+// would return null or throw
+export const decodeUpload = (payload, maxSide, scale, background) => {
+  if (openLib() === null) return false
+  return lib.symbols.decode_upload(payload, payload.length, maxSide, scale, background) === 0
+}
+
+// Perceptual hash of the image from the last successful `normalizeUpload` or
+// `decodeUpload`, as two 32-bit halves; near-duplicates differ in few bits
+// (see `upload_phash`)
+export const uploadHash = () => {
+  const hash = new Uint32Array(2)
+  lib.symbols.upload_phash(hash)
+  return hash
+}
+
+// Shape descriptors of the same image for the local classifier (see
+// `shape_features`), or null if it is blank
+export const uploadFeatures = () => {
+  const features = new Float32Array(64)
+  const n = lib.symbols.upload_features(features)
+  return (n > 0 ? features.slice(0, n) : null)
+}
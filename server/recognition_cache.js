@@ -0,0 +1,109 @@
+// Answers recognition requests for drawings that nearly duplicate one already
+// sent to the LLM, for the same target word and previous attempts. Drawings are
+// compared by perceptual hash (`rast.uploadHash`), held in a BK-tree per key
+
+// Largest Hamming distance between the hashes of two drawings taken as the
+// same. Redrawing a shape smaller and shakier elsewhere on the canvas moves a
+// few bits; different shapes are 30 or so apart
+const MAX_DISTANCE = 6
+
+const popcount32 = (x) => {
+  x -= (x >>> 1) & 0x55555555
+  x = (x & 0x33333333) + ((x >>> 2) & 0x33333333)
+  x = (x + (x >>> 4)) & 0x0f0f0f0f
+  return Math.imul(x, 0x01010101) >>> 24
+}
+const distance = (a, b) => popcount32(a[0] ^ b[0]) + popcount32(a[1] ^ b[1])
+
+// Children of a node are keyed by their distance to it, so a search within `d`
+// of `hash` only descends into children at distance k - d .. k + d
+class BKTree {
+  constructor() {
+    this.root = null
+    this.size = 0
+  }
+
+  add(hash, value) {
+    this.size++
+    const node = { hash, value, children: new Map() }
+    if (this.root === null) {
+      this.root = node
+      return
+    }
+    for (let cur = this.root; ; ) {
+      const d = distance(hash, cur.hash)
+      const next = cur.children.get(d)
+      if (next === undefined) {
+        cur.children.set(d, node)
+        return
+      }
+      cur = next
+    }
+  }
+
+  // The value stored with the closest hash within `maxDistance`, or undefined
+  nearest(hash, maxDistance) {
+    let best, bestDistance = maxDistance + 1
+    const stack = (this.root ? [this.root] : [])
+    while (stack.length > 0) {
+      const node = stack.pop()
+      const d = distance(hash, node.hash)
+      if (d < bestDistance) {
+        best = node.value
+        bestDistance = d
+      }
+      for (const [k, child] of node.children)
+        if (k > d - bestDistance && k < d + bestDistance) stack.push(child)
+    }
+    return best
+  }
+}
+
+// Hints as they are logged with the game, which determine the prompt along
+// with the target word
+const trees = new Map()
+const treeFor = (target, hints) => {
+  const key = target + '\n' + hints
+  let tree = trees.get(key)
+  if (tree === undefined) trees.set(key, tree = new BKTree())
+  return tree
+}
+
+const stats = { hits: 0, misses: 0, hitMs: 0, missMs: 0 }
+
+export const lookup = (target, hints, hash) => treeFor(target, hints).nearest(hash, MAX_DISTANCE)
+export const store = (target, hints, hash, recognized) => treeFor(target, hints).add(hash, recognized)
+
+// Recognizes through the cache, `ask` being the call to the LLM, which resolves
+// to `{ answer, local }`: `local` when the local classifier answered instead,
+// which is not kept, so that the LLM is asked again for the next near-duplicate.
+// Resolves to the same, from the cache with `local` false. `hash` is null for
+// images that were not normalized natively, which always go to `ask`
+export const recognize = async (target, hints, hash, ask) => {
+  const t0 = performance.now()
+  const cached = (hash !== null ? lookup(target, hints, hash) : undefined)
+  if (cached !== undefined) {
+    stats.hits++
+    stats.hitMs += performance.now() - t0
+    return { answer: cached, local: false }
+  }
+  const result = await ask()
+  if (hash !== null && !result.local) store(target, hints, hash, result.answer)
+  stats.misses++
+  stats.missMs += performance.now() - t0
+  return result
+}
+
+export const summary = () => {
+  let entries = 0
+  for (const tree of trees.values()) entries += tree.size
+  const total = stats.hits + stats.misses
+  return {
+    entries,
+    hits: stats.hits,
+    misses: stats.misses,
+    hitRate: (total > 0 ? stats.hits / total : 0),
+    hitMs: (stats.hits > 0 ? stats.hitMs / stats.hits : 0),
+    missMs: (stats.misses > 0 ? stats.missMs / stats.misses : 0),
+  }
+}
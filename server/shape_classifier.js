@@ -0,0 +1,108 @@
+// Local recognizer: k nearest neighbours over the shape features of logged
+// drawings (`rast.uploadFeatures`), each labelled with the word the player was
+// asked to draw. Stands in for the LLM when it fails or is not wanted
+
+import { words, wordLookup } from './words.js'
+
+const K = 7
+
+// Feature groups in the order of `shape_features`, with their weights once each
+// feature is standardized, so that the 16 directions of the radial profile do
+// not outvote the rest
+const GROUPS = [
+  [7, 1],       // Hu moments
+  [16, 0.5],    // Radial profile
+  [5, 1],       // Medial axis
+  [3, 1],       // Aspect, fill, parts
+  [7, 0.75],    // Colours
+]
+
+const examples = []      // [features, index into `words`]
+let weights = null       // Per feature, 1 / standard deviation times the group weight
+let dims = 0
+let matrix = null        // Features of `examples` times `weights`, one row each
+let labels = null
+
+export const add = (features, target) => {
+  const w = wordLookup[target]
+  if (features !== null && w) examples.push([features, words.indexOf(w.origEntry)])
+}
+
+// Computes the weights from the examples added so far
+export const fit = () => {
+  if (examples.length === 0) return
+  dims = examples[0][0].length
+  const mean = new Float64Array(dims), sq = new Float64Array(dims)
+  for (const [f] of examples)
+    for (let i = 0; i < dims; i++) { mean[i] += f[i]; sq[i] += f[i] * f[i] }
+  weights = new Float32Array(dims)
+  let i = 0
+  for (const [count, groupWeight] of GROUPS)
+    for (let k = 0; k < count; k++, i++) {
+      const m = mean[i] / examples.length
+      const sd = Math.sqrt(Math.max(sq[i] / examples.length - m * m, 0))
+      weights[i] = (sd > 1e-6 ? groupWeight / sd : 0)
+    }
+  matrix = new Float64Array(examples.length * dims)
+  labels = new Int32Array(examples.length)
+  examples.forEach(([f, label], j) => {
+    for (let i = 0; i < dims; i++) matrix[j * dims + i] = f[i] * weights[i]
+    labels[j] = label
+  })
+}
+
+export const size = () => examples.length
+
+// Indices into `words` by score, best first: votes of the `K` nearest examples,
+// weighted by inverse distance. Words flagged in `exclude` are left out
+export const rank = (features, exclude = new Uint8Array(words.length)) => {
+  if (weights === null || features === null) return []
+  const q = new Float64Array(dims)
+  for (let i = 0; i < dims; i++) q[i] = features[i] * weights[i]
+  const nearest = []  // [distance, index], sorted, at most K
+  let worst = Infinity
+  for (let j = 0, row = 0; j < labels.length; j++, row += dims) {
+    if (exclude[labels[j]]) continue
+    // Stops adding up once the example is out of the running
+    let d = 0
+    for (let i = 0; i < dims && d < worst; i++) {
+      const t = q[i] - matrix[row + i]
+      d += t * t
+    }
+    if (d >= worst) continue
+    let k = Math.min(nearest.length, K - 1)
+    while (k > 0 && nearest[k - 1][0] > d) { nearest[k] = nearest[k - 1]; k-- }
+    nearest[k] = [d, j]
+    if (nearest.length === K) worst = nearest[K - 1][0]
+  }
+  const scores = new Map()
+  for (const [d, j] of nearest)
+    scores.set(labels[j], (scores.get(labels[j]) || 0) + 1 / (Math.sqrt(d) + 1e-3))
+  return [...scores].sort((a, b) => b[1] - a[1]).map(([word, score]) => ({ word, score }))
+}
+
+// The best guess as the LLM would answer it: the target itself if that is the
+// guess, otherwise the first name of the guessed word in the target's language.
+// Words already guessed are not guessed again. Null if there is nothing to go by
+export const guess = (features, target, prevAttempts) => {
+  if (!wordLookup[target]) return null
+  const lang = wordLookup[target].lang
+  const exclude = new Uint8Array(words.length)
+  for (const s of prevAttempts)
+    if (wordLookup[s]) exclude[words.indexOf(wordLookup[s].origEntry)] = 1
+  const ranked = rank(features, exclude)
+  if (ranked.length === 0) return null
+  const entry = words[ranked[0].word]
+  if (entry === wordLookup[target].origEntry) return target
+  return entry.word[lang].split('/')[0]
+}
+
+// How often the local guess names the same word as the LLM's answer
+const stats = { agreed: 0, compared: 0 }
+export const compare = (localGuess, llmAnswer) => {
+  if (localGuess === null) return
+  const a = wordLookup[localGuess], b = wordLookup[llmAnswer]
+  stats.compared++
+  if (a && b && a.origEntry === b.origEntry) stats.agreed++
+}
+export const summary = () => ({ examples: examples.length, ...stats })
@@ -1,5 +1,17 @@
 local sources = { }
 
+-- Native mixer (`misc/audio_mix.c`), if the library is there (see `native.lua`)
+local native = require 'native'
+if native.lib ~= nil then
+  native.ffi.cdef [[
+    int audio_mix(int16_t *out, int n, int channels, int n_in,
+      const int16_t *const *in, const int *lens,
+      const float *gain_from, const float *gain_to);
+  ]]
+end
+-- Most packets mixed at once
+local MIX_MAX_INPUTS = 4
+
 local function load_audio(path)
   local files = love.filesystem.getDirectoryItems('aud' .. path)
   for i = 1, #files do
@@ -90,6 +102,23 @@ local loop = function (introPath, introLen, loopPath, loopLen, bufSize)
   local pktSamples = math.floor(bufSize / (ch * bd / 8))
 
   local source = love.audio.newQueueableSource(sr, bd, ch, 64)
+  -- Packets where the streams overlap are mixed into this; queueing copies it
+  local mix = love.sound.newSoundData(pktSamples, sr, bd, ch)
+  -- Mixes natively if it can; returns whether it did
+  local mixNative = function () return false end
+  if native.lib ~= nil and bd == 16 then
+    local mixIn = native.ffi.new('const int16_t *[?]', MIX_MAX_INPUTS)
+    local mixLens = native.ffi.new('int[?]', MIX_MAX_INPUTS)
+    mixNative = function (data)
+      if #data > MIX_MAX_INPUTS then return false end
+      for k, d in ipairs(data) do
+        mixIn[k - 1] = d:getPointer()
+        mixLens[k - 1] = d:getSampleCount() * ch
+      end
+      return native.lib.audio_mix(mix:getPointer(), pktSamples * ch, ch, #data,
+        mixIn, mixLens, nil, nil) >= 0
+    end
+  end
 
   local introRunning = (introPath ~= nil)
   local altRunning = false
@@ -131,8 +160,9 @@ local loop = function (introPath, introLen, loopPath, loopLen, bufSize)
     print('!data', #data, curSample)
     if #data == 1 then
       source:queue(data[1])
+    elseif #data >= 2 and mixNative(data) then
+      source:queue(mix)
     elseif #data >= 2 then
-      local mix = love.sound.newSoundData(pktSamples, sr, bd, ch)
       for i = 1, pktSamples do
         for c = 1, ch do
           local mixSample = 0
@@ -54,6 +54,21 @@ end
 _G['global_font'] = fontSizeFactory('fnt/WenQuanYi_Bitmap_Song_14px.ttf', {15})
 love.graphics.setFont(_G['global_font'](15))
 
+local session = require 'session'
+-- `love . --replay <path>` replays a session log (see `session.lua`) as fast
+-- as it goes, instead of playing; `--record` writes one while playing
+local replayPath
+local record = false
+for i, a in ipairs(arg or {}) do
+  if a == '--replay' then replayPath = arg[i + 1] end
+  if a == '--record' then record = not isWeb end
+end
+if replayPath then
+  session.replay(replayPath)
+else
+  session.start(record)
+end
+
 local audio = require 'audio'
 local bgm, bgm_update = audio.loop(
   nil, 0,
@@ -107,28 +122,58 @@ _G['replaceScene'] = function (newScene, transition)
   currentTransition = transition or transitions['fade'](0.9, 0.9, 0.9)
 end
 
+-- Input, in screen coordinates, as logged
 local mouseScene = nil
-function love.mousepressed(x, y, button, istouch, presses)
-  if button ~= 1 then return end
+local pointerPress = function (x, y)
   if lastScene ~= nil then return end
   mouseScene = curScene
-  curScene.press((x - offsX) / globalScale, (y - offsY) / globalScale)
+  curScene.press(x, y)
 end
-function love.mousemoved(x, y, button, istouch)
-  curScene.hover((x - offsX) / globalScale, (y - offsY) / globalScale)
+local pointerMove = function (x, y)
+  curScene.hover(x, y)
   if mouseScene ~= curScene then return end
-  curScene.move((x - offsX) / globalScale, (y - offsY) / globalScale)
+  curScene.move(x, y)
 end
-function love.mousereleased(x, y, button, istouch, presses)
-  if button ~= 1 then return end
+local pointerRelease = function (x, y)
   if mouseScene ~= curScene then return end
-  curScene.release((x - offsX) / globalScale, (y - offsY) / globalScale)
+  curScene.release(x, y)
   mouseScene = nil
 end
+local keyPress = function (key)
+  if curScene.key then curScene.key(key) end
+end
+
+function love.mousepressed(x, y, button, istouch, presses)
+  if button ~= 1 then return end
+  pointerPress(session.pointer('P', (x - offsX) / globalScale, (y - offsY) / globalScale))
+end
+function love.mousemoved(x, y, button, istouch)
+  pointerMove(session.pointer('M', (x - offsX) / globalScale, (y - offsY) / globalScale))
+end
+function love.mousereleased(x, y, button, istouch, presses)
+  if button ~= 1 then return end
+  pointerRelease(session.pointer('R', (x - offsX) / globalScale, (y - offsY) / globalScale))
+end
 
 local T = 0
 local timeStep = 1 / 240
 
+-- Runs the ticks of one update
+local runTicks = function (count)
+  for i = 1, count do
+    session.tick = i - 1
+    if lastScene ~= nil then
+      lastScene:update()
+      -- At most 8 ticks per update for transitions
+      if i <= 8 then
+        transitionTimer = transitionTimer + 1
+      end
+    else
+      curScene:update()
+    end
+  end
+end
+
 function love.update(dt)
   if dt >= 0.5 then dt = 0 end
   T = T + dt
@@ -139,16 +184,13 @@ function love.update(dt)
   while T > timeStep and count < 12 do
     T = T - timeStep
     count = count + 1
-    if lastScene ~= nil then
-      lastScene:update()
-      -- At most 8 ticks per update for transitions
-      if count <= 8 then
-        transitionTimer = transitionTimer + 1
-      end
-    else
-      curScene:update()
-    end
   end
+  session.update(count)
+  runTicks(count)
+end
+
+function love.quit()
+  if session.recording then session.flush() end
 end
 
 transitions['fade'] = function (r, g, b)
@@ -169,7 +211,7 @@ transitions['fade'] = function (r, g, b)
   }
 end
 
-function love.draw()
+local drawFrame = function ()
   love.graphics.scale(globalScale)
   love.graphics.setColor(1, 1, 1)
   love.graphics.push()
@@ -191,11 +233,15 @@ function love.draw()
   love.graphics.pop()
 end
 
+love.draw = drawFrame
+
 function love.keypressed(key)
   if love.system.getOS() ~= 'Web' and key == 'escape' then
     love.event.quit()
   end
-  if curScene.key then curScene.key(key) end
+  if replayPath then return end
+  session.key(key)
+  keyPress(key)
   if true then return end
   if key == 'lshift' then
     if not isMobile and not isWeb then
@@ -204,3 +250,25 @@ function love.keypressed(key)
     end
   end
 end
+
+if replayPath then
+  local handlers = {
+    tick = runTicks,
+    draw = function ()
+      love.graphics.push('all')
+      drawFrame()
+      love.graphics.pop()
+    end,
+    press = pointerPress,
+    move = pointerMove,
+    release = pointerRelease,
+    key = keyPress,
+  }
+  love.audio.setVolume(0)
+  love.mousepressed, love.mousemoved, love.mousereleased = nil, nil, nil
+  -- Frames are drawn as the log goes, not by `love.run`
+  love.draw = function () end
+  love.update = function ()
+    if not session.replayStep(0.1, handlers) then love.event.quit() end
+  end
+end
@@ -0,0 +1,29 @@
+-- Native module (`misc/polygon_rast.c` and the files built with it, see the
+-- build lines at its top) through LuaJIT's FFI: {ffi = ffi, lib = lib}, where
+-- `lib` is nil unless the shared library is found next to the game or on the
+-- library path. Each user declares the functions it calls with `ffi.cdef`
+local native = {}
+
+if love.system.getOS() ~= 'Web' then
+  local ok, ffi = pcall(require, 'ffi')
+  if ok then
+    local libName = ({
+      Windows = 'polygon_rast.dll',
+      ['OS X'] = 'libpolygon_rast.dylib',
+    })[love.system.getOS()] or 'libpolygon_rast.so'
+    local paths = {
+      love.filesystem.getSource() .. '/' .. libName,
+      love.filesystem.getSourceBaseDirectory() .. '/' .. libName,
+      'polygon_rast',
+    }
+    for _, path in ipairs(paths) do
+      local ok, lib = pcall(ffi.load, path)
+      if ok then
+        native.ffi, native.lib = ffi, lib
+        break
+      end
+    end
+  end
+end
+
+return native
@@ -1,6 +1,7 @@
 local draw = require 'draw_utils'
 local button = require 'button'
 local audio = require 'audio'
+local session = require 'session'
 local unpack = unpack or table.unpack
 
 local isWeb = love.system.getOS() == 'Web'
@@ -14,14 +15,14 @@ if isWeb then
     local idStr = string.format('%10d%03d', os.time(), id)
     -- https://emscripten.org/docs/api_reference/Filesystem-API.html
     -- `/tmp` is autmoatically mounted as an MEMFS
+    -- The page reads the request body from one file and writes the response
+    -- into the other, so only the paths go through `print`
     local fetchFile = '/tmp/' .. idStr
-    local encoded = {'^'}
-    encoded[#encoded + 1] = fetchFile
-    encoded[#encoded + 1] = '^'
-    for i = 1, #s do
-      encoded[#encoded + 1] = string.format('%02x', string.byte(s, i))
-    end
-    print(table.concat(encoded))
+    local reqFile = fetchFile .. '.req'
+    local f = io.open(reqFile, 'wb')
+    f:write(s)
+    f:close()
+    print('^' .. fetchFile .. '^' .. reqFile)
     fetchFiles[#fetchFiles + 1] = fetchFile
   end
   fetchResponse = function ()
@@ -49,11 +50,117 @@ else
   fetchResponse = function () return chResp:pop() end
 end
 
+-- Responses come from the log when replaying a session (see `session.lua`)
+local fetchNetworkResponse = fetchResponse
+fetchResponse = function () return session.response(fetchNetworkResponse) end
+if session.replaying then enqueueRequest = function (s) end end
+
+-- Native rasterizer (`misc/polygon_rast.c`), or nil without the library (see `native.lua`)
+local rast = require 'native'
+if rast.lib == nil then
+  rast = nil
+else
+  rast.ffi.cdef [[
+    uint8_t *get_pix_buf();
+    float *get_pt_buf();
+    void set_outline_width(float width);
+    void rasterize_outline(int w, int h, int n, float r, float g, float b);
+    uint8_t *get_particle_buf();
+    void particles_pop(int n, int w, float grav, float r, float g, float b);
+    void particles_update();
+    void particles_render(int w, int h);
+    void set_fill_outline(float width);
+    void rasterize_fill(int w, int h, int n,
+      float r, float g, float b, float opacity, int t);
+    uint8_t *get_enc_buf();
+    uint8_t *get_enc_out();
+    int encode_png(int w, int h, int format, int level);
+  ]]
+end
+-- Size of `pix_buf`
+local RAST_MAX_PIXELS = 180 * 200
+
+-- Image formats understood by `encode_png` (`misc/image_encode.c`),
+-- with their sizes in bytes per pixel
+local ENC_FORMATS = { rgba8 = {0, 4}, rgba16f = {1, 8}, rgba4 = {2, 2} }
+-- Size of `enc_buf`, in pixels
+local ENC_MAX_PIXELS = 180 * 320
+
+-- Returns the image encoded as a PNG, as a string
+local encodePng = function (imgData)
+  local w, h = imgData:getDimensions()
+  local format = ENC_FORMATS[imgData:getFormat()]
+  if rast ~= nil and format ~= nil and w * h <= ENC_MAX_PIXELS then
+    rast.ffi.copy(rast.lib.get_enc_buf(), imgData:getPointer(), w * h * format[2])
+    local size = rast.lib.encode_png(w, h, format[1], 1)
+    return rast.ffi.string(rast.lib.get_enc_out(), size)
+  end
+  return imgData:encode('png'):getString()
+end
+
+-- Paint colours, indexed from 0 in drawings (`drawing_palette` in `misc/polygon_rast.c`)
+local PALETTE = {
+  {1, .19, .30}, {1, .60, .14}, {.72, .67, .25},
+  {.58, .60, .92}, {1, .20, .81}, {.62, .93, .98}, {.5, .5, .5},
+}
+-- Coordinates in drawings are in units of 1/4 pixel
+local DRAWING_UNITS = 4
+
+-- Encodes the strokes on a `w` x `h` canvas into the drawing format described
+-- above `render_drawing` in `misc/polygon_rast.c`
+-- strokes: {{points = {{x, y} * n}, paint = {r, g, b}, width = width} * n}
+local encodeDrawing = function (strokes, w, h)
+  local bytes = {'BSD1'}
+  local u8 = function (v) bytes[#bytes + 1] = string.char(v) end
+  local varint = function (v)
+    while v >= 128 do
+      u8(v % 128 + 128)
+      v = math.floor(v / 128)
+    end
+    u8(v)
+  end
+  local zigzag = function (v)
+    varint(v >= 0 and v * 2 or -v * 2 - 1)
+  end
+
+  varint(w)
+  varint(h)
+  u8(DRAWING_UNITS)
+  varint(#strokes)
+  for _, stroke in ipairs(strokes) do
+    local r, g, b = unpack(stroke.paint)
+    local index = 255
+    for i = 1, #PALETTE do
+      if PALETTE[i][1] == r and PALETTE[i][2] == g and PALETTE[i][3] == b then
+        index = i - 1
+        break
+      end
+    end
+    u8(index)
+    if index == 255 then
+      u8(math.floor(r * 255 + 0.5))
+      u8(math.floor(g * 255 + 0.5))
+      u8(math.floor(b * 255 + 0.5))
+    end
+    u8(math.floor(stroke.width * 8 + 0.5))
+    varint(#stroke.points)
+    local qx0, qy0 = 0, 0
+    for i = 1, #stroke.points do
+      local qx = math.floor(stroke.points[i][1] * DRAWING_UNITS + 0.5)
+      local qy = math.floor(stroke.points[i][2] * DRAWING_UNITS + 0.5)
+      zigzag(qx - qx0)
+      zigzag(qy - qy0)
+      qx0, qy0 = qx, qy
+    end
+  end
+  return table.concat(bytes)
+end
+
 local saveImage
 if isWeb then
   saveImage = function (imgData)
-    -- The encoding module is not compiled in
-    -- local fileData = imgData:encode('png')
+    -- The encoding module is not compiled in, and the canvas is not rgba8 anyway;
+    -- the page converts and encodes it
     local f = io.open('/tmp/photo.bin', 'wb')
     f:write(imgData:getString())
     f:close()
@@ -62,15 +169,20 @@ if isWeb then
   end
 else
   saveImage = function (imgData)
-    local fileData = imgData:encode('png')
     local f = io.open('/tmp/photo.png', 'wb')
-    f:write(fileData:getString())
+    f:write(encodePng(imgData))
     f:close()
   end
 end
 
 love.physics.setMeter(1)
 
+-- The scene's tick, and the longest physics step of the bubble, in ticks
+local BUBBLE_TICK = 1 / 240
+local BUBBLE_MAX_STEP = 4
+-- Physics steps in a period of the stiffest joint, at least
+local BUBBLE_STEPS_PER_PERIOD = 12
+
 local createBubbles = function (n, max_x, max_y)
   local scale = 5
 
@@ -115,6 +227,11 @@ local createBubbles = function (n, max_x, max_y)
   body_cen:setMass(10)
 
   local expected_r
+  -- Positions before the last step, for interpolation, {x, y} per point
+  local prev = {}
+  for i = 1, n do prev[i] = { b[i]:getPosition() } end
+  -- Ticks in the current physics step, and ticks of it gone by (see `advance`)
+  local step_ticks, step_since = 1, 0
 
   local set_size = function (r)
     expected_r = r
@@ -127,17 +244,25 @@ local createBubbles = function (n, max_x, max_y)
       b[i]:setPosition(x * scale * 0.94, y * scale * 0.94)
       b[i]:setLinearVelocity(0, 0)
       b[i]:setAngularVelocity(0)
+      -- Not interpolated
+      prev[i][1], prev[i][2] = x * scale * 0.94, y * scale * 0.94
     end
     body_cen:setPosition(0.15 * cen_offs, -0.05 * cen_offs)
   end
 
+  local has_joints = false
+
   local remove_joints = function ()
     local js = world:getJoints()
     for i = 1, #js do js[i]:destroy() end
+    has_joints = false
   end
 
   local rebuild_joints = function ()
     remove_joints()
+    has_joints = true
+    -- The next tick starts a step, chosen with the joints
+    step_since = 0
     for i = 1, n do
       local b1 = b[i]
       local x1, y1 = b1:getPosition()
@@ -162,23 +287,32 @@ local createBubbles = function (n, max_x, max_y)
 
   local set_pos = function (i, x, y)
     b[i]:setPosition(x * scale, y * scale)
+    prev[i][1], prev[i][2] = x * scale, y * scale
   end
 
-  local get_pos = function (i)
+  -- Interpolated between the last two physics steps (see `advance`)
+  local alpha = 1
+  local pos = function (i)
     local x, y = b[i]:getPosition()
+    return prev[i][1] + (x - prev[i][1]) * alpha, prev[i][2] + (y - prev[i][2]) * alpha
+  end
+  local get_pos = function (i)
+    local x, y = pos(i)
     return x / scale, y / scale
   end
   local get_body = function (i)
     return b[i]
   end
 
+  -- Against the outline as drawn (`get_pos`), so that a tap pops the bubble the
+  -- player sees. Within `update` the two are the same: a step starts there
   local check_inside = function (x, y)
     x, y = x * scale, y * scale
     -- http://alienryderflex.com/polygon/
-    local x1, y1 = b[n]:getPosition()
+    local x1, y1 = pos(n)
     local parity = false
     for i = 1, n do
-      local x0, y0 = b[i]:getPosition()
+      local x0, y0 = pos(i)
       if ((y0 < y and y1 >= y) or (y1 < y) and (y0 >= y)) and
         (x0 <= x or x1 <= x)
       then
@@ -342,6 +476,43 @@ local createBubbles = function (n, max_x, max_y)
     world:update(dt)
   end
 
+  -- Longest step in ticks that keeps the bubble stable: a number of steps in a
+  -- period of the stiffest joint, and no point moving more than half the
+  -- spacing of the points in a step. Coarsens by one tick at a time
+  local choose_step = function ()
+    local h = BUBBLE_MAX_STEP * BUBBLE_TICK
+    if has_joints then
+      local f_max = 5 / (0.1 + expected_r)^2.1
+      h = math.min(h, 1 / (BUBBLE_STEPS_PER_PERIOD * f_max))
+    end
+    local v_max = 0
+    for i = 1, n do
+      local vx, vy = b[i]:getLinearVelocity()
+      v_max = math.max(v_max, vx * vx + vy * vy)
+    end
+    v_max = math.sqrt(v_max) / scale
+    if v_max > 0 then
+      h = math.min(h, 0.5 * (math.pi * 2 / n * expected_r) / v_max)
+    end
+    local ticks = math.floor(h / BUBBLE_TICK)
+    return math.max(1, math.min(ticks, step_ticks + 1, BUBBLE_MAX_STEP))
+  end
+
+  -- Called once per tick. Steps the physics by `step_ticks` ticks at once every
+  -- `step_ticks` ticks, `get_pos` going from the state before the step to the
+  -- one after in the meantime. The step is chosen from the state alone, so that
+  -- replays stay exact
+  local advance = function ()
+    if step_since == 0 then
+      step_ticks = choose_step()
+      for i = 1, n do prev[i][1], prev[i][2] = b[i]:getPosition() end
+      update(step_ticks * BUBBLE_TICK)
+    end
+    step_since = step_since + 1
+    alpha = step_since / step_ticks
+    if step_since == step_ticks then step_since = 0 end
+  end
+
   local close = function ()
     world:destroy()
   end
@@ -359,6 +530,7 @@ local createBubbles = function (n, max_x, max_y)
     get_ptr = get_ptr,
     get_ptr_trail = get_ptr_trail,
     update = update,
+    advance = advance,
     close = close,
   }
 end
@@ -397,8 +569,11 @@ local CatmullRomSpline = function (t, pts, index)
   return x, y, index
 end
 
-local particles = function ()
+local luaParticles = function ()
   local ps = {}
+  -- Not `love.math.random`, so that the game's sequence is the same whichever
+  -- particles are used, and sessions replay either way
+  local rng = love.math.newRandomGenerator()
 
   -- p: {{x, y} * n}
   local pop = function (p, grav, r, g, b)
@@ -435,9 +610,9 @@ local particles = function ()
           local xMax = math.min(W, xs[i + 1])
           local count = math.ceil((xMax - xMin) / xDensity)
           for t = 1, count do
-            local px = xMin + love.math.random() * (xMax - xMin)
-            local py = y + (love.math.random() - 0.5) * yStep
-            local vScale = 0.2 + love.math.random() * 0.2
+            local px = xMin + rng:random() * (xMax - xMin)
+            local py = y + (rng:random() - 0.5) * yStep
+            local vScale = 0.2 + rng:random() * 0.2
             ps[#ps + 1] = {
               x0 = px, y0 = py,
               x = px, y = py,
@@ -445,7 +620,7 @@ local particles = function ()
               vy = (py - yCen) * vScale,
               grav = grav,
               r = r, g = g, b = b, a = 1,
-              t = 0, ttl = 120 + love.math.random() * 120,
+              t = 0, ttl = 120 + rng:random() * 120,
             }
           end
         end
@@ -491,6 +666,50 @@ local particles = function ()
   }
 end
 
+-- Same particles, kept in `misc/polygon_rast.c` and drawn there into one layer
+-- covering the screen. Desktop only, as the web page's module is not rebuilt yet
+local nativeParticles = function ()
+  local layer = love.image.newImageData(W, H)
+  local layerImg = love.graphics.newImage(layer)
+  -- Ticks until the last pop has faded out (lifetimes are below 240). The pool
+  -- outlives the scene, so start by letting the last scene's particles expire
+  local ticksLeft = 240
+
+  local pop = function (p, grav, r, g, b)
+    local ptBuf = rast.lib.get_pt_buf()
+    for i = 1, #p do
+      ptBuf[i * 2 - 2], ptBuf[i * 2 - 1] = p[i][1], p[i][2]
+    end
+    rast.lib.particles_pop(#p, W, grav, r, g, b)
+    ticksLeft = 240
+  end
+
+  local update = function ()
+    if ticksLeft == 0 then return end
+    ticksLeft = ticksLeft - 1
+    rast.lib.particles_update()
+  end
+
+  local draw = function ()
+    if ticksLeft == 0 then return end
+    rast.lib.particles_render(W, H)
+    rast.ffi.copy(layer:getPointer(), rast.lib.get_particle_buf(), W * H * 4)
+    layerImg:replacePixels(layer)
+    love.graphics.setColor(1, 1, 1)
+    love.graphics.draw(layerImg, 0, 0)
+  end
+
+  return {
+    pop = pop,
+    update = update,
+    draw = draw,
+  }
+end
+
+local particles = function ()
+  return (rast ~= nil and nativeParticles or luaParticles)()
+end
+
 local borderSlice9 = function (tex, borderWidth)
   local w, h = tex:getDimensions()
   local quads = {}
@@ -528,35 +747,54 @@ end
 
 local blitFilledPolygon, blitOutline
 
+-- Stroke width of the bubble outline, in texture pixels
+local OUTLINE_WIDTH = 1.5
+
+-- Counts the bubbles made, so that the web page does not show the frames of the last
+-- one, still in flight in its worker, on the next (see `workerFill` in `web_index.html`)
+local bubbleGeneration = 0
+
+-- `outlineWidth`: if given, the outline is drawn along with the fill, in the same colour
 if isWeb then
-blitFilledPolygon = function (p, tex, paintR, paintG, paintB, bubbleOpacity, T)
+blitFilledPolygon = function (p, tex, paintR, paintG, paintB, bubbleOpacity, T, outlineWidth)
   local addr = tostring(tex:getPointer()):sub(13) -- 'userdata: 0x'
   local texW, texH = tex:getDimensions()
   local pStr = {}
   for i = 1, #p do
     pStr[i] = string.format('%.7f %.7f', p[i][1], p[i][2])
   end
-  print(string.format('+F %s %d %d %.5f %.5f %.5f %.5f %d %s',
-    addr, texW, texH, paintR, paintG, paintB, bubbleOpacity, T, table.concat(pStr, ' ')))
+  print(string.format('+F %s %d %d %.5f %.5f %.5f %.5f %d %.3f %d %s',
+    addr, texW, texH, paintR, paintG, paintB, bubbleOpacity, T, outlineWidth or 0,
+    bubbleGeneration, table.concat(pStr, ' ')))
 end
 
-blitOutline = function (p, tex, paintR, paintG, paintB)
+blitOutline = function (p, tex, paintR, paintG, paintB, width)
   local addr = tostring(tex:getPointer()):sub(13) -- 'userdata: 0x'
   local texW, texH = tex:getDimensions()
   local pStr = {}
   for i = 1, #p do
     pStr[i] = string.format('%.7f %.7f', p[i][1], p[i][2])
   end
-  print(string.format('+O %s %d %d %.5f %.5f %.5f %s',
-    addr, texW, texH, paintR, paintG, paintB, table.concat(pStr, ' ')))
+  print(string.format('+O %s %d %d %.5f %.5f %.5f %.3f %s',
+    addr, texW, texH, paintR, paintG, paintB, width or OUTLINE_WIDTH, table.concat(pStr, ' ')))
 end
 
 else
-blitFilledPolygon = function (p, tex, paintR, paintG, paintB, bubbleOpacity, T)
-  tex:mapPixel(function () return 0, 0, 0, 0 end)
-
+blitFilledPolygon = function (p, tex, paintR, paintG, paintB, bubbleOpacity, T, outlineWidth)
   local texW, texH = tex:getDimensions()
   local n = #p
+  if rast ~= nil and texW * texH <= RAST_MAX_PIXELS then
+    local ptBuf = rast.lib.get_pt_buf()
+    for i = 1, n do
+      ptBuf[i * 2 - 2], ptBuf[i * 2 - 1] = p[i][1], p[i][2]
+    end
+    rast.lib.set_fill_outline(outlineWidth or 0)
+    rast.lib.rasterize_fill(texW, texH, n, paintR, paintG, paintB, bubbleOpacity, T)
+    rast.ffi.copy(tex:getPointer(), rast.lib.get_pix_buf(), texW * texH * 4)
+    return
+  end
+
+  tex:mapPixel(function () return 0, 0, 0, 0 end)
   -- http://alienryderflex.com/polygon_fill/
   for y = 0, texH - 1 do
     local xs = {}
@@ -579,12 +817,29 @@ blitFilledPolygon = function (p, tex, paintR, paintG, paintB, bubbleOpacity, T)
       end
     end
   end
+
+  if outlineWidth then
+    blitOutline(p, tex, paintR, paintG, paintB, outlineWidth)
+  end
 end
 
-blitOutline = function (p, tex, paintR, paintG, paintB)
+blitOutline = function (p, tex, paintR, paintG, paintB, width)
   local texW, texH = tex:getDimensions()
 
   local n = #p
+  if rast ~= nil and texW * texH <= RAST_MAX_PIXELS then
+    local ptBuf = rast.lib.get_pt_buf()
+    for i = 1, n do
+      ptBuf[i * 2 - 2], ptBuf[i * 2 - 1] = p[i][1], p[i][2]
+    end
+    local pixBuf = rast.lib.get_pix_buf()
+    rast.ffi.copy(pixBuf, tex:getPointer(), texW * texH * 4)
+    rast.lib.set_outline_width(width or OUTLINE_WIDTH)
+    rast.lib.rasterize_outline(texW, texH, n, paintR, paintG, paintB)
+    rast.ffi.copy(tex:getPointer(), pixBuf, texW * texH * 4)
+    return
+  end
+
   local pts = {}
   for i = 0, n + 2 do
     local x, y = unpack(p[(i - 1 + n) % n + 1])
@@ -690,6 +945,8 @@ return function ()
 
   local texCanvas = love.image.newImageData(Wc, Hc, 'rgba8')
   local imgCanvas = love.graphics.newImage(texCanvas)
+  -- What has been drawn onto the canvas, sent for recognition (see `encodeDrawing`)
+  local canvasStrokes = {}
 
   local STATE_INITIAL = 0
   local STATE_INFLATE = 1
@@ -712,6 +969,7 @@ return function ()
       -- Clear textures
       texCanvas:mapPixel(function () return 0, 0, 0, 0 end)
       imgCanvas:replacePixels(texCanvas)
+      canvasStrokes = {}
       -- Reset target word (will be drawn after the first bubble is released)
       targetWord = nil
       targetWordText, targetWordTextStr = nil, nil
@@ -760,7 +1018,7 @@ return function ()
   table.insert(buttons, 1, btnCamera)
     -- The stick button is destructive; avoid unintended triggers
 
-  local selPaint = { 1, .19, .30 }
+  local selPaint = { unpack(PALETTE[1]) }
   -- Palette buttons
   local paletteButton = function (x, y, w, h, r, g, b)
     buttons[#buttons + 1] = button({ x = x, y = y, w = w, h = h }, function ()
@@ -777,13 +1035,13 @@ return function ()
       audio.sfx('paint')
     end)
   end
-  paletteButton(45, 266, 18, 17, 1, .19, .30)
-  paletteButton(65, 266, 21, 17, 1, .60, .14)
-  paletteButton(87, 266, 22, 17, .72, .67, .25)
-  paletteButton(45, 284, 18, 23, .58, .60, .92)
-  paletteButton(65, 284, 21, 23, 1, .20, .81)
-  paletteButton(87, 284, 22, 23, .62, .93, .98)
-  paletteButton(106, 269, 17, 38, .5, .5, .5)
+  paletteButton(45, 266, 18, 17, unpack(PALETTE[1]))
+  paletteButton(65, 266, 21, 17, unpack(PALETTE[2]))
+  paletteButton(87, 266, 22, 17, unpack(PALETTE[3]))
+  paletteButton(45, 284, 18, 23, unpack(PALETTE[4]))
+  paletteButton(65, 284, 21, 23, unpack(PALETTE[5]))
+  paletteButton(87, 284, 22, 23, unpack(PALETTE[6]))
+  paletteButton(106, 269, 17, 38, unpack(PALETTE[7]))
 
   local speechBubbles = {
     borderSlice9(draw.get('speech_1'), 7),
@@ -832,6 +1090,7 @@ return function ()
     if state == STATE_INFLATE then
       inflateStart = sinceState
       bubbles = createBubbles(n, 1.1, Hc / Wc * 1.1)
+      bubbleGeneration = bubbleGeneration + 1
       return true
     end
 
@@ -907,17 +1166,17 @@ return function ()
         if bubbles.check_inside(x1, y1) then
           -- Pop the bubble
           -- Blit onto canvas
-          blitOutline(bubblePolygon(Wc / 2, Hc / 2, 0, 0),
-            texCanvas, selPaint[1], selPaint[2], selPaint[3])
+          local p = bubblePolygon(Wc / 2, Hc / 2, 0, 0)
+          blitOutline(p, texCanvas, selPaint[1], selPaint[2], selPaint[3])
           imgCanvas:replacePixels(texCanvas)
+          canvasStrokes[#canvasStrokes + 1] = { points = p, paint = selPaint, width = OUTLINE_WIDTH }
           -- Create particle effect
           particles.pop(bubblePolygon(Xc, Yc, 0, 0), 1, selPaint[1], selPaint[2], selPaint[3])
           bubbles.close()
           -- Disable & hide language button
           btnLang.enabled = false
-          -- Encode image and send to server
-          local imageFileData = texCanvas:encode('png')
-          local s = imageFileData:getString()
+          -- Send the drawing to the server
+          local s = encodeDrawing(canvasStrokes, Wc, Hc)
           local reqPayload = { targetWord[_G['lang']][1] }
           for i = 1, #previousGuesses do reqPayload[i + 1] = ',' .. previousGuesses[i] end
           reqPayload[#reqPayload + 1] = '/'
@@ -1015,7 +1274,7 @@ return function ()
       bubbles.set_size(size)
     end
     if (state == STATE_INFLATE and inflateStart) or state == STATE_PAINT then
-      bubbles.update(1 / 240)
+      bubbles.advance()
     end
     if state == STATE_FINAL and sinceState == 720 then
       -- Allow restart
@@ -1115,8 +1374,9 @@ return function ()
       end
       -- Blit polygon onto texture
       local p = bubblePolygon(Wc / 2, Hc / 2, WcEx, HcEx)
-      blitFilledPolygon(p, tex, paintR, paintG, paintB, bubbleOpacity, T)
-      blitOutline(p, tex, paintR, paintG, paintB)
+      session.polygon(p, Wc + WcEx * 2, Hc + HcEx * 2,
+        paintR, paintG, paintB, bubbleOpacity, T, OUTLINE_WIDTH)
+      blitFilledPolygon(p, tex, paintR, paintG, paintB, bubbleOpacity, T, OUTLINE_WIDTH)
 
       img:replacePixels(tex)
       love.graphics.setBlendMode('alpha')
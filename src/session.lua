@@ -0,0 +1,329 @@
+-- Session logs: the input events, ticks, network responses and bubble polygons
+-- of a play session, from which it replays exactly. When started with
+-- `--record` (not on the web) the log is appended to `sessions/` in the save
+-- directory, which keeps the newest `MAX_SESSIONS` logs within
+-- `MAX_SESSIONS_BYTES`; it is replayed through the game with
+-- `love . --replay <path>`, or through the rasterizer alone by the `REPLAYRUN`
+-- build of `misc/polygon_rast.c`.
+--
+-- Integers are LEB128 varints, signed ones zigzag-encoded. Coordinates are in
+-- 1/`UNITS` pixel, which is also the precision of pointer input while playing
+--   "BSS1", random seed, u8 units per pixel
+--   Records, each a u8 tag followed by:
+--   'U' number of ticks run by an update; the draw after it follows its records
+--   'P', 'M', 'R' (press, move, release): x, y in screen coordinates
+--   'K' key: length, name
+--   'N' network response: index of the tick of the update that fetched it,
+--       length, body
+--   'F' bubble polygon, as passed to `blitFilledPolygon`: w, h (texture size),
+--       u8 r, g, b, opacity (in 1/255), T, u8 outline width in 1/8 pixel,
+--       number of points, (dx, dy) per point from the previous one (the first
+--       from the origin)
+
+local UNITS = 64
+-- Pending bytes are appended to the file once there are this many
+local FLUSH_BYTES = 4096
+-- Logs kept in `sessions/`, the oldest removed first as a new one starts. A
+-- log stops (at an update) once it reaches `MAX_SESSION_BYTES`
+local MAX_SESSIONS = 20
+local MAX_SESSION_BYTES = 64 * 1024 * 1024
+local MAX_SESSIONS_BYTES = 256 * 1024 * 1024
+
+local session = {
+  recording = false,
+  replaying = false,
+  -- Index of the tick being run in the current update, set by `main.lua`
+  tick = 0,
+}
+
+local quantize = function (v) return math.floor(v * UNITS + 0.5) end
+
+-- Writing
+
+local path
+local out, outBytes = {}, 0
+local writtenBytes = 0
+
+local u8 = function (v)
+  out[#out + 1] = string.char(v)
+  outBytes = outBytes + 1
+end
+local varint = function (v)
+  while v >= 128 do
+    u8(v % 128 + 128)
+    v = math.floor(v / 128)
+  end
+  u8(v)
+end
+local zigzag = function (v)
+  varint(v >= 0 and v * 2 or -v * 2 - 1)
+end
+local str = function (s)
+  varint(#s)
+  out[#out + 1] = s
+  outBytes = outBytes + #s
+end
+
+session.flush = function ()
+  if #out == 0 then return end
+  love.filesystem.append(path, table.concat(out))
+  writtenBytes = writtenBytes + outBytes
+  out, outBytes = {}, 0
+end
+
+-- Removes the oldest logs (their names are their start times) until there is
+-- room for one more of at most `MAX_SESSION_BYTES`
+local prune = function ()
+  local names, sizes, total = {}, {}, 0
+  for _, name in ipairs(love.filesystem.getDirectoryItems('sessions')) do
+    local info = name:match('%.bss$') and love.filesystem.getInfo('sessions/' .. name)
+    if info and info.type == 'file' then
+      names[#names + 1] = name
+      sizes[name] = info.size or 0
+      total = total + sizes[name]
+    end
+  end
+  table.sort(names)
+  local i = 1
+  while #names - i + 1 >= MAX_SESSIONS or
+      (i <= #names and total + MAX_SESSION_BYTES > MAX_SESSIONS_BYTES) do
+    love.filesystem.remove('sessions/' .. names[i])
+    total = total - sizes[names[i]]
+    i = i + 1
+  end
+end
+
+-- Seeds the random generator and, if `record`, starts a new log
+session.start = function (record)
+  local seed = os.time()
+  love.math.setRandomSeed(seed)
+  if not record then return end
+  love.filesystem.createDirectory('sessions')
+  prune()
+  path = 'sessions/' .. os.date('%Y%m%d-%H%M%S') .. '.bss'
+  session.recording = true
+  print(string.format('Recording this session, network responses included, to %s/%s (up to %d MiB)',
+    love.filesystem.getSaveDirectory(), path, MAX_SESSION_BYTES / (1024 * 1024)))
+  out[1] = 'BSS1'
+  outBytes = 4
+  varint(seed)
+  u8(UNITS)
+end
+
+-- Pointer event `tag` at screen coordinates `x`, `y`. Returns the coordinates
+-- as they are logged, which the game goes on with
+session.pointer = function (tag, x, y)
+  local qx, qy = quantize(x), quantize(y)
+  if session.recording then
+    u8(tag:byte())
+    zigzag(qx)
+    zigzag(qy)
+  end
+  return qx / UNITS, qy / UNITS
+end
+
+session.key = function (key)
+  if not session.recording then return end
+  u8(('K'):byte())
+  str(key)
+end
+
+session.update = function (count)
+  if not session.recording then return end
+  u8(('U'):byte())
+  varint(count)
+  if outBytes >= FLUSH_BYTES then
+    session.flush()
+    if writtenBytes >= MAX_SESSION_BYTES then session.recording = false end
+  end
+end
+
+-- Forward declarations for replaying
+local replayResponse, replayPolygon
+
+-- Goes through `fetch` for the next network response, or takes it from the log
+session.response = function (fetch)
+  if session.replaying then return replayResponse() end
+  local resp = fetch()
+  if resp ~= nil and session.recording then
+    u8(('N'):byte())
+    varint(session.tick)
+    str(resp)
+  end
+  return resp
+end
+
+session.polygon = function (p, w, h, r, g, b, opacity, T, width)
+  if session.replaying then return replayPolygon(p) end
+  if not session.recording then return end
+  u8(('F'):byte())
+  varint(w)
+  varint(h)
+  u8(math.floor(r * 255 + 0.5))
+  u8(math.floor(g * 255 + 0.5))
+  u8(math.floor(b * 255 + 0.5))
+  u8(math.floor(opacity * 255 + 0.5))
+  varint(T)
+  u8(math.floor(width * 8 + 0.5))
+  varint(#p)
+  local qx0, qy0 = 0, 0
+  for i = 1, #p do
+    local qx, qy = quantize(p[i][1]), quantize(p[i][2])
+    zigzag(qx - qx0)
+    zigzag(qy - qy0)
+    qx0, qy0 = qx, qy
+  end
+end
+
+-- Replaying
+
+local data, pos
+-- Responses of the current update, by tick index
+local responses = {}
+local stats
+
+local rdU8 = function ()
+  local b = data:byte(pos) or 0
+  pos = pos + 1
+  return b
+end
+local rdVarint = function ()
+  local v, mul = 0, 1
+  repeat
+    local b = rdU8()
+    v = v + (b % 128) * mul
+    mul = mul * 128
+  until b < 128
+  return v
+end
+local rdZigzag = function ()
+  local v = rdVarint()
+  return (v % 2 == 0 and v / 2 or -(v + 1) / 2)
+end
+local rdString = function ()
+  local len = rdVarint()
+  local s = data:sub(pos, pos + len - 1)
+  pos = pos + len
+  return s
+end
+
+-- Counts a place where the game no longer does what the log says
+local diverge = function (what)
+  stats.mismatches = stats.mismatches + 1
+  if stats.firstMismatch == nil then
+    stats.firstMismatch = string.format('%s at tick %d', what, stats.ticks)
+  end
+end
+
+replayResponse = function ()
+  local resp = responses[session.tick]
+  responses[session.tick] = nil
+  return resp
+end
+
+-- Reads the rest of an 'F' record, returning the points' coordinates in a flat list
+local rdPolygon = function ()
+  rdVarint(); rdVarint()        -- w, h
+  pos = pos + 4                 -- r, g, b, opacity
+  rdVarint()                    -- T
+  pos = pos + 1                 -- Width
+  local q = {}
+  local qx, qy = 0, 0
+  for i = 1, rdVarint() do
+    qx = qx + rdZigzag()
+    qy = qy + rdZigzag()
+    q[i * 2 - 1], q[i * 2] = qx, qy
+  end
+  return q
+end
+
+replayPolygon = function (p)
+  stats.polygons = stats.polygons + 1
+  if data:sub(pos, pos) ~= 'F' then
+    diverge('extra polygon')
+    return
+  end
+  pos = pos + 1
+  local q = rdPolygon()
+  local same = (#q == #p * 2)
+  for i = 1, (same and #p or 0) do
+    if q[i * 2 - 1] ~= quantize(p[i][1]) or q[i * 2] ~= quantize(p[i][2]) then
+      same = false
+      break
+    end
+  end
+  if not same then diverge('polygon') end
+end
+
+-- Loads the log at `path` (in the save directory, or else anywhere) for
+-- `session.replayStep`, and seeds the random generator from it
+session.replay = function (path)
+  if love.filesystem.getInfo(path) then
+    data = love.filesystem.read(path)
+  else
+    local f = assert(io.open(path, 'rb'))
+    data = f:read('*a')
+    f:close()
+  end
+  assert(data:sub(1, 4) == 'BSS1', 'Not a session log')
+  pos = 5
+  love.math.setRandomSeed(rdVarint())
+  assert(rdU8() == UNITS, 'Unsupported coordinate units')
+  session.replaying = true
+  stats = {
+    updates = 0, ticks = 0, polygons = 0, mismatches = 0,
+    tickTime = 0, drawTime = 0,
+  }
+end
+
+-- Replays records for about `budget` seconds, through `handlers`: {tick =
+-- function (count), draw, press = function (x, y), move, release, key =
+-- function (key)}. Returns false once the log is done, after printing what it took
+session.replayStep = function (budget, handlers)
+  local getTime = love.timer.getTime
+  local t0 = getTime()
+  while pos <= #data do
+    if getTime() - t0 >= budget then return true end
+    local tag = string.char(rdU8())
+    if tag == 'U' then
+      local count = rdVarint()
+      responses = {}
+      while data:sub(pos, pos) == 'N' do
+        pos = pos + 1
+        local i = rdVarint()
+        responses[i] = rdString()
+      end
+      local t1 = getTime()
+      handlers.tick(count)
+      local t2 = getTime()
+      if next(responses) ~= nil then diverge('unfetched response') end
+      handlers.draw()
+      stats.tickTime = stats.tickTime + (t2 - t1)
+      stats.drawTime = stats.drawTime + (getTime() - t2)
+      stats.updates = stats.updates + 1
+      stats.ticks = stats.ticks + count
+    elseif tag == 'P' or tag == 'M' or tag == 'R' then
+      local x = rdZigzag() / UNITS
+      local y = rdZigzag() / UNITS
+      local fn = ({ P = handlers.press, M = handlers.move, R = handlers.release })[tag]
+      fn(x, y)
+    elseif tag == 'K' then
+      handlers.key(rdString())
+    elseif tag == 'F' then
+      rdPolygon()
+      diverge('missing polygon')
+    else
+      diverge('unknown record ' .. string.byte(tag))
+      break
+    end
+  end
+  print(string.format(
+    '%d updates, %d ticks (%.4f ms each), %d bubble draws (%.4f ms per update), ' ..
+    '%d mismatches%s',
+    stats.updates, stats.ticks, stats.tickTime * 1000 / math.max(1, stats.ticks),
+    stats.polygons, stats.drawTime * 1000 / math.max(1, stats.updates),
+    stats.mismatches, stats.firstMismatch and ', first: ' .. stats.firstMismatch or ''))
+  return false
+end
+
+return session